@@ -38,12 +38,34 @@
 #include <sched.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
 #include <math.h>
 #include <pthread.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3 // From <linux/mempolicy.h>.
+#endif
+#endif
 #ifdef WINDOWS
 #define bool char
 #define false 0
@@ -55,27 +77,696 @@
 #define MIN_ORDER 3
 #define MAX_ORDER 400
 
+/* The order is fixed when the program is built, e.g. with
+ * -DORDER=75 (the Makefile has targets for a few that fill
+ * whole cache lines), so that node sizes, offsets and loop
+ * bounds are constants the compiler can fold and unroll.
+ */
+#ifndef ORDER
+#define ORDER DEFAULT_ORDER
+#endif
+#if ORDER < MIN_ORDER || ORDER > MAX_ORDER
+#error "ORDER must lie between MIN_ORDER and MAX_ORDER"
+#endif
+
+// Default fill, in percent, below which a deletion merges or rebalances a node.
+#define DEFAULT_MERGE_PERCENT 25
+
+#define CACHE_LINE 64
+
+#define SLAB_BYTES (1 << 20)
+#define POOL_BATCH 64
+
+/* A tree file (-F) is always mapped at TREE_FILE_BASE, so
+ * that the node and record pointers stored in it stay valid
+ * from one run to the next, and TREE_FILE_RESERVE bytes of
+ * address space are set aside there for it to grow into.
+ * The default lies clear of where x86-64 Linux puts heaps,
+ * libraries and stacks, and of AddressSanitizer's allocator.
+ * The header takes the first TREE_FILE_HEADER bytes, which
+ * are a whole number of pages of any size Linux uses and
+ * hold a bit for each of the TREE_FILE_SLABS slabs that can
+ * follow it.
+ */
+#ifndef TREE_FILE_BASE
+#define TREE_FILE_BASE ((uintptr_t)0x300000000000)
+#endif
+#define TREE_FILE_RESERVE ((size_t)1 << 40)
+#define TREE_FILE_HEADER (1 << 18)
+#define TREE_FILE_SLABS (TREE_FILE_RESERVE / SLAB_BYTES)
+#define TREE_FILE_MAGIC 0x32454c4946545042ULL // "BPTFILE2"
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0 // Only a hint then; tree_file_open() checks where it lands.
+#endif
+
+/* Durability of the changes logged to a write-ahead log
+ * (-W, -y). A committer thread writes out what every thread
+ * logged since its last commit with one write and one
+ * fdatasync. Under DURABILITY_LAZY it does so every commit
+ * interval and no operation waits for it, so a crash loses
+ * up to an interval of changes; under DURABILITY_SYNC a
+ * change returns once its record is on disk, and a commit
+ * starts one interval after the first thread waits for it.
+ */
+#define DURABILITY_NONE 0
+#define DURABILITY_LAZY 1
+#define DURABILITY_SYNC 2
+// Commit interval, unless -G is given.
+#define DEFAULT_COMMIT_USEC 1000
+// Locks that order the changes of the keys hashed to each, see log_lock_key().
+#define LOG_STRIPES 1024
+// Records a thread's log buffer first has room for; it doubles as needed.
+#define LOG_BUFFER_RECORDS 1024
+#define LOG_SET 1
+#define LOG_DELETE 2
+#define LOG_MAGIC 0x3130474f4c545042ULL        // "BPTLOG01"
+#define CHECKPOINT_MAGIC 0x3154504b43545042ULL // "BPTCKPT1"
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* How benchmark threads are pinned to CPUs (-a): not at
+ * all, filling one core and package before the next, spread
+ * over packages and then cores, one thread per core before
+ * any SMT sibling is used, or in the order of a CPU list.
+ */
+#define AFFINITY_NONE 0
+#define AFFINITY_COMPACT 1
+#define AFFINITY_SCATTER 2
+#define AFFINITY_NOSMT 3
+#define AFFINITY_LIST 4
+
+/* NUMA placement of slabs (-N). A slab is first touched by
+ * the thread that threads its free list, which is the first
+ * one to allocate from it, and its pages land on that
+ * thread's node unless they are interleaved across all the
+ * nodes that have memory.
+ */
+#define PLACE_FIRST_TOUCH 0
+#define PLACE_INTERLEAVE 1
+// Retirements between attempts to advance the global epoch.
+#define EPOCH_ADVANCE_PERIOD 64
+
+// Deepest path a latch-coupled descent can hold (MIN_ORDER trees included).
+#define MAX_HEIGHT 64
+
+/* Layout of node->version. Writers set the lock bit while
+ * modifying a node and bump the count when they are done,
+ * so a reader that sees the same unlocked version before and
+ * after reading a node has read a consistent snapshot.
+ */
+#define VERSION_OBSOLETE 1
+#define VERSION_LOCKED 2
+
+/* Leaves keep the value of each key in the pointer slot
+ * next to it. Build with -DINLINE_VALUES=0 to box each value
+ * in a record instead, whose address stays the same for as
+ * long as its key is in the tree (see find_record()).
+ */
+#ifndef INLINE_VALUES
+#define INLINE_VALUES 1
+#endif
+
+/* Keys, and the values stored with them, are 32-bit by
+ * default. Build with -DKEY_BITS=64 (see the Makefile's
+ * bpt-k64) for 64-bit ones; the benchmark then also takes
+ * key ranges beyond 2^31.
+ */
+#ifndef KEY_BITS
+#define KEY_BITS 32
+#endif
+#if KEY_BITS == 64
+typedef int64_t tree_key;
+#define KEY_MIN INT64_MIN
+#define KEY_MAX INT64_MAX
+#define KEY_FORMAT PRId64
+#elif KEY_BITS == 32
+typedef int32_t tree_key;
+#define KEY_MIN INT32_MIN
+#define KEY_MAX INT32_MAX
+#define KEY_FORMAT PRId32
+#else
+#error "KEY_BITS must be 32 or 64"
+#endif
+typedef tree_key tree_value;
+
+/* String keys (-K string) are kept in a tree of their own,
+ * whose nodes are STR_NODE_BYTES-long slotted pages: an
+ * array of fixed-size slots, sorted by key, grows from the
+ * front and the key bytes they point to from the back.
+ */
+#define STR_NODE_BYTES 4096
+#define STR_KEY_MAX 255
+// Key types of the benchmark, selected with -K.
+#define KEY_TYPE_INT 0
+#define KEY_TYPE_STRING 1
+
+/* Kernels for searching the keys of a node. KEY_SEARCH picks
+ * one at build time; the default picks the widest vector
+ * kernel the CPU supports when the program starts, and falls
+ * back to the scalar binary search.
+ */
+#define KEY_SEARCH_AUTO 0
+#define KEY_SEARCH_LINEAR 1
+#define KEY_SEARCH_BINARY 2
+#define KEY_SEARCH_SSE 3
+#define KEY_SEARCH_AVX2 4
+#ifndef KEY_SEARCH
+#define KEY_SEARCH KEY_SEARCH_AUTO
+#endif
+// Lookups per kernel and order in the key search micro-benchmark.
+#define KEY_SEARCH_PROBES 4000000
+
+/* Build with -DLEAF_FINGERPRINTS=1 (see the Makefile's
+ * bpt-fp) for leaves that keep a one-byte hash of each key,
+ * as FPTree does. Point lookups then compare the hash of the
+ * key against all of them with a few vector compares, and
+ * only read the keys that match. The leaves are sorted, so
+ * key_rank() already answers in a handful of probes; which
+ * is faster depends on the order and on how much of the tree
+ * is cached.
+ */
+#ifndef LEAF_FINGERPRINTS
+#define LEAF_FINGERPRINTS 0
+#endif
+// Fingerprints compared at a time; their array is padded to a multiple of it.
+#define FINGERPRINT_BLOCK 32
+
+/* Each thread counts the splits, merges and root changes it
+ * makes, the latches it takes, how long it waits for them
+ * and how often an optimistic operation has to start over;
+ * see get_tree_stats(). Only waits are timed, so uncontended
+ * latches cost a try-lock and an increment. Build with
+ * -DTREE_STATS=0 to leave all of it out.
+ */
+#ifndef TREE_STATS
+#define TREE_STATS 1
+#endif
+
+/* search_batch() sorts up to SEARCH_BATCH_SORT keys at a time
+ * so that neighbouring lookups share nodes, and keeps
+ * SEARCH_BATCH_GROUP of them in flight while their next
+ * nodes are being prefetched.
+ */
+#define SEARCH_BATCH_SORT 256
+#define SEARCH_BATCH_GROUP 16
+// Entries a benchmark range scan reads from its cursor at a time.
+#define SCAN_BUFFER 64
+// Distance from the previous key within which a local benchmark key is drawn.
+#define LOCALITY_WINDOW 64
+
+/* Benchmark latencies are counted in log-linear buckets, as
+ * HdrHistogram does: each power of two is split into
+ * 2^LATENCY_SUB_BITS buckets, so a bucket is never wider
+ * than 1/32 of the values in it.
+ */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+// Formats of the latency report, selected with -H.
+#define LATENCY_OFF 0
+#define LATENCY_TEXT 1
+#define LATENCY_CSV 2
+#define LATENCY_JSON 3
+
+// Hardware events counted with -P, see hw_counter_open().
+#define HW_CYCLES 0
+#define HW_INSTRUCTIONS 1
+#define HW_LLC_MISSES 2
+#define HW_DTLB_MISSES 3
+#define HW_BRANCH_MISSES 4
+#define NUM_HW_COUNTERS 5
+
+/* Distributions of benchmark keys, selected with -d. See
+ * next_key().
+ */
+#define KEY_UNIFORM 0
+#define KEY_ZIPF 1
+#define KEY_HOTSPOT 2
+#define KEY_LATEST 3
+#define KEY_SEQUENTIAL 4
+#define KEY_SHUFFLED 5
+// Skew of the Zipfian distributions, as in YCSB; -z changes it.
+#define DEFAULT_ZIPF_THETA 0.99
+// Terms of the Zipfian normalizing sum added up exactly; the rest is integrated.
+#define ZIPF_EXACT_TERMS 1000000
+// Percentage of the range that KEY_HOTSPOT draws HOTSPOT_OPS percent of its keys from.
+#define HOTSPOT_KEYS 10
+#define HOTSPOT_OPS 90
+// Keys each benchmark thread draws to time its generator.
+#define KEY_GENERATOR_PROBES 100000
+// Length of the intervals a timed benchmark (-D) reports throughput for, unless -I is given.
+#define DEFAULT_SAMPLE_MSEC 100
+// How long before an open loop operation is due its thread stops sleeping and spins.
+#define WAIT_SPIN_NSEC 100000
+
 // TYPES.
 typedef struct record
 {
-  int value;
+  tree_value value;
 } record;
 
+// Reading, creating and releasing the leaf slot of a value.
+#if INLINE_VALUES
+#define slot_value(slot) ((tree_value)(intptr_t)(slot))
+#define make_slot(value) ((void *)(intptr_t)(value))
+#define free_slot(slot) ((void)(slot))
+#define retire_slot(slot) ((void)(slot))
+#define set_slot_value(slot, new_value) ((slot) = make_slot(new_value))
+#else
+#define slot_value(slot) (((record *)(slot))->value)
+#define make_slot(value) ((void *)make_record(value))
+#define set_slot_value(slot, new_value) (((record *)(slot))->value = (new_value))
+#define free_slot(slot) free_record(slot)
+#define retire_slot(slot) retire_record(slot)
+#endif
+
+/* A node is a single cache-line-aligned block: this header,
+ * with the fields a descent reads first at the front, then
+ * the keys and then the pointers that keys and pointers
+ * point to. See node_size().
+ */
 typedef struct node
 {
+  uint64_t version; // Lock bit and modification count, see VERSION_LOCKED.
+  int num_keys;
+  bool is_leaf;
+  int level; // Height above the leaves.
+  tree_key high_key; // Upper bound (exclusive) of the keys, valid if right is set.
+  tree_key *keys;
   void **pointers;
-  int *keys;
+  struct node *right; // Right sibling on the same level, NULL at the right edge.
   struct node *parent;
-  bool is_leaf;
-  int num_keys;
   struct node *next; // Used for queue.
+  pthread_rwlock_t latch; // Used by lock coupling.
 } node;
 
+/* Concurrency control schemes, selected at runtime with -c.
+ * CC_GLOBAL serializes all writers on one rwlock, CC_COUPLING
+ * latches nodes top-down and lets go of ancestors as soon as
+ * a child is known to be safe. CC_BLINK is a Lehman-Yao
+ * B-link tree: readers take no locks and writers lock one
+ * level at a time, following right links past concurrent
+ * splits. CC_OLC is optimistic lock coupling: readers validate
+ * node versions and restart from the root on conflict, and
+ * writers only lock the nodes they modify.
+ */
+typedef enum cc_mode
+{
+  CC_GLOBAL = 0,
+  CC_COUPLING = 1,
+  CC_BLINK = 2,
+  CC_OLC = 3
+} cc_mode;
+
+/* The kind of modification a latch-coupled descent is made for.
+ * Decides when a node is safe, i.e. cannot split or underflow.
+ */
+typedef enum latch_op
+{
+  LATCH_INSERT,
+  LATCH_DELETE,
+  LATCH_UPDATE // Changes a value only, so every node is safe.
+} latch_op;
+
+/* Exclusive latches held by a writer during lock coupling.
+ * Nodes unlinked from the tree while latched are only freed
+ * once every latch on the path has been released.
+ */
+typedef struct latch_path
+{
+  node *held[2 * MAX_HEIGHT];
+  int count;
+  bool root_latched;
+} latch_path;
+
+/* Fixed-size objects are carved out of large slabs and
+ * recycled through per-thread free lists. A thread that
+ * frees more than it allocates hands batches back to the
+ * shared depot, where other threads pick them up.
+ */
+typedef struct pool
+{
+  const char *name;
+  size_t object_size;
+  pthread_mutex_t lock;
+  void *depot;
+  long depot_count;
+  void **slabs;
+  long num_slabs;
+  long slabs_capacity;
+  long reopened; // Objects in use when the tree file was reopened.
+} pool;
+
+typedef struct pool_cache
+{
+  void *free_list;
+  long count;
+  long allocated;
+  long freed;
+} pool_cache;
+
+typedef enum object_kind
+{
+  OBJECT_NODE,
+  OBJECT_RECORD
+} object_kind;
+
+typedef struct retired_object
+{
+  void *object;
+  object_kind kind;
+} retired_object;
+
+/* Objects unlinked during one epoch. They are freed once
+ * the global epoch has moved two steps further, at which
+ * point no thread can still be reading them.
+ */
+typedef struct limbo_bag
+{
+  uint64_t epoch;
+  long count;
+  long capacity;
+  retired_object *objects;
+} limbo_bag;
+
+/* First page of a tree file. Besides the root it keeps the
+ * free lists of both pools, whose links are in the file
+ * too, and what the tree was built with, since a node
+ * layout from a different build cannot be read.
+ */
+typedef struct tree_file_header
+{
+  uint64_t magic;
+  uint64_t base; // Address the file was mapped at.
+  uint32_t order;
+  uint32_t key_bits;
+  uint32_t inline_values;
+  uint32_t leaf_fingerprints;
+  uint64_t node_size;
+  uint64_t slabs; // After the header, SLAB_BYTES each.
+  uint64_t clean; // Closed by tree_file_close() since it was last opened.
+  struct node *root;
+  void *depots[2]; // Free objects of the node and record pools.
+  long depot_counts[2];
+  uint64_t record_slabs[TREE_FILE_SLABS / 64]; // Bit i is set if slab i holds records.
+} tree_file_header;
+
+/* A change in the write-ahead log. It holds the state the
+ * change left the key in, not the operation, so that the
+ * last record of each key is all that recovery replays.
+ */
+typedef struct log_record
+{
+  uint32_t op;    // LOG_SET or LOG_DELETE.
+  uint32_t check; // See log_check().
+  uint64_t seq;   // Orders the changes to a key.
+  tree_key key;
+  tree_value value;
+} log_record;
+
+/* First bytes of a log or checkpoint file. A checkpoint
+ * holds count key-value pairs, and every change numbered
+ * before seq.
+ */
+typedef struct log_header
+{
+  uint64_t magic;
+  uint32_t key_bits;
+  uint32_t record_size;
+  uint64_t seq;
+  uint64_t count;
+} log_header;
+
+/* Records a thread logged since the last commit. The
+ * committer swaps them for the spare array, so the thread
+ * can go on logging while they are written.
+ */
+typedef struct log_buffer
+{
+  pthread_mutex_t lock;
+  log_record *records;
+  log_record *spare;
+  long count;
+  long capacity;
+  long spare_capacity;
+  uint64_t appended;   // Records logged by the thread ever.
+  uint64_t committing; // Of those, ones taken by the commit under way.
+  uint64_t durable;    // Of those, ones on disk. Guarded by commit_lock.
+} log_buffer;
+
+// What the write-ahead log did, see print_log_stats().
+typedef struct log_stats
+{
+  long records;
+  long commits; // Each one write and one fdatasync.
+  uint64_t bytes;
+  uint64_t sync_nsec;
+  long checkpoints;
+  uint64_t checkpoint_nsec;
+} log_stats;
+
+/* Counts of structural changes and contention, summed over
+ * all threads by get_tree_stats().
+ */
+typedef struct tree_stats
+{
+  long leaf_splits;
+  long internal_splits;
+  long merges;
+  long redistributions;
+  long root_splits;       // New roots on top of a split one.
+  long root_collapses;    // Roots removed by a deletion.
+  long lock_acquisitions; // Latches and node locks taken.
+  long lock_waits;        // Of those, and of optimistic reads, ones that found the node locked.
+  uint64_t lock_wait_nsec;
+  long restarts;          // Optimistic descents started over, and B-link nodes read again.
+  long finger_hits;       // Lookups the thread's finger answered, see finger_get().
+  long finger_misses;
+} tree_stats;
+
+/* Per-thread allocator and epoch state. States are never
+ * freed; one left behind by an exited thread is adopted,
+ * free lists and limbo bags included, by the next new one.
+ */
+typedef struct thread_state
+{
+  uint64_t epoch; // (epoch << 1) | 1 inside an operation, 0 outside.
+  bool in_use;
+  struct thread_state *next;
+  pool_cache nodes;
+  pool_cache records;
+  limbo_bag limbo[3];
+  long retired;
+  long reclaimed;
+#if TREE_STATS
+  tree_stats stats;
+#endif
+  log_buffer log;
+  node *finger;          // Leaf the thread's last descent ended at.
+  uint64_t finger_epoch; // Epoch the finger was taken in, see finger_get().
+} thread_state;
+
+// Returns the number of keys in a sorted array that are less than key.
+typedef int (*key_search_fn)(const tree_key *keys, int num_keys, tree_key key);
+
+// Returns the position of key in a leaf, or num_keys if it is not present.
+typedef int (*fingerprint_fn)(const uint8_t *fingerprints, const tree_key *keys, int num_keys, tree_key key);
+
+/* A position in the tree for iterating over its keys in
+ * order. The cursor keeps a copy of the leaf it is in, so
+ * no latches are held between calls. When the copy runs
+ * out the cursor looks up the next leaf from the root by
+ * the fence key it stopped at, rather than by following a
+ * sibling pointer that may be stale by then.
+ * Keys added or removed behind the cursor since the leaf
+ * was copied may or may not be seen.
+ */
+typedef struct cursor
+{
+  node **root;
+  int num_keys;  // Entries in the copy of the leaf.
+  int position;  // Entry that cursor_next() returns next.
+  bool has_low;  // Whether keys below low_key may exist.
+  tree_key low_key;   // Lowest key the leaf may hold.
+  bool has_high; // Whether keys at or above high_key may exist.
+  tree_key high_key;  // Lowest key to the right of the leaf.
+  tree_key keys[ORDER - 1];
+  tree_value values[ORDER - 1];
+} cursor;
+
+// A key and its value, as given to bulk_load().
+typedef struct kv_pair
+{
+  tree_key key;
+  tree_value value;
+} kv_pair;
+
+// Computes the new value of a key for update().
+typedef tree_value (*update_fn)(tree_value value, void *arg);
+
+// An update() being logged, and the value it left.
+typedef struct logged_update
+{
+  update_fn fn;
+  void *arg;
+  tree_value value;
+} logged_update;
+
+/* One level of a tree being built by bulk_load(). Node j
+ * of the level takes entries j * num_entries / num_nodes
+ * up to (j + 1) * num_entries / num_nodes of the level
+ * below, so the nodes differ in size by at most one.
+ */
+typedef struct bulk_level
+{
+  kv_pair *pairs;     // Entries of a leaf level.
+  node **children;    // Entries of an internal level.
+  tree_key *child_lows;    // Lowest key under each child.
+  long num_entries;
+  node **nodes;
+  tree_key *lows;          // Lowest key under each node.
+  long num_nodes;
+} bulk_level;
+
+/* An entry of a string node. Its key is kept without the
+ * prefix that every key of the node shares, and head caches
+ * the first bytes of what is left, so that most comparisons
+ * end at the slot without reading the key.
+ */
+typedef struct str_slot
+{
+  uint32_t head;   // See str_head().
+  uint16_t offset; // Of the key in the node.
+  uint16_t length;
+  union
+  {
+    tree_value value;       // In a leaf.
+    struct str_node *child; // In an internal node, the subtree of keys from this one up.
+  };
+} str_slot;
+
+/* A node of the string-key tree. Its fences bound the keys
+ * it may hold, the low one inclusive, and are kept in full
+ * at the back of the node. Every key between them starts
+ * with what the two have in common, and is stored without
+ * it (prefix truncation). Leaf splits keep the fences short
+ * by passing up no more of the new sibling's first key than
+ * it takes to tell the halves apart, see str_split().
+ */
+typedef struct str_node
+{
+  pthread_rwlock_t latch; // Used by lock coupling.
+  int level; // Height above the leaves.
+  int num_keys;
+  int heap;    // Offset of the lowest key byte; the keys take the node from there to its end.
+  int garbage; // Bytes of removed keys, reclaimed by str_compact().
+  int prefix_length;
+  int low_offset;
+  int low_length; // -1 at the left edge of the tree.
+  int high_offset;
+  int high_length; // -1 at the right edge.
+  struct str_node *first; // In an internal node, the subtree of keys below the first one.
+  str_slot slots[];
+} str_node;
+
+// A CPU and where it sits. order holds its sort key under an affinity policy.
+typedef struct cpu_place
+{
+  int cpu;
+  int package;
+  int core;
+  int thread; // Position among the SMT siblings of its core.
+  int order[3];
+} cpu_place;
+
+// The nodes of a bulk_level that one thread builds.
+typedef struct bulk_task
+{
+  bulk_level *level;
+  long first;
+  long last;
+} bulk_task;
+
 // GLOBALS.
-int order = DEFAULT_ORDER;
+static const int order = ORDER;
 node *queue = NULL;
 bool verbose_output = true;
+cc_mode concurrency = CC_GLOBAL;
+int batch_size = 0; // Benchmark searches per search_batch(), 0 for single searches.
+int scan_length = 0; // Keys read by each benchmark range scan, 0 for point searches.
+int merge_percent = DEFAULT_MERGE_PERCENT; // See min_node_keys().
+node *rightmost_leaf = NULL; // Hint for appending insertions, see append_hint().
+bool finger_cache = false; // Try the leaf of each thread's last descent first.
+int locality = 0; // Percentage of benchmark keys drawn near the previous one.
+int latency_report = LATENCY_OFF; // Time every benchmark operation, and report in this format.
+int key_distribution = KEY_UNIFORM; // Of benchmark keys.
+double zipf_theta = DEFAULT_ZIPF_THETA;
+int bench_duration = 0; // Seconds the benchmark runs for, 0 to run MAXITER operations.
+long bench_rate = 0; // Operations per second over all threads, 0 to run as fast as possible.
+int sample_msec = DEFAULT_SAMPLE_MSEC; // Interval of the throughput time series.
+bool hw_counting = false; // Count hardware events over the measured regions.
+int hw_counter_errno = 0; // Why the first counter that could not be opened failed.
+const char *hw_counter_names[] = {"cycles", "instructions", "LLC misses", "dTLB misses", "branch misses"};
+const char *key_distribution_names[] = {"uniform", "zipf", "hotspot", "latest", "sequential", "shuffled"};
+int affinity = AFFINITY_NONE; // How benchmark threads are pinned, see affinity_init().
+int *affinity_cpus = NULL; // CPUs that benchmark thread i is pinned to, modulo their number.
+int num_affinity_cpus = 0;
+int node_placement = PLACE_FIRST_TOUCH; // NUMA policy of new slabs.
+unsigned long memory_nodes = 0; // Mask of the NUMA nodes interleaved slabs are spread over.
+const char *affinity_names[] = {"none", "compact", "scatter", "nosmt", "list"};
+const char *placement_names[] = {"first touch", "interleaved"};
+const char *cc_mode_names[] = {"global rwlock", "lock coupling", "B-link tree", "optimistic lock coupling"};
+const char *key_search_names[] = {"auto", "linear", "binary", "sse4.2", "avx2"};
+int key_search = KEY_SEARCH_LINEAR;
+int key_type = KEY_TYPE_INT; // Of benchmark and test keys.
+const char *key_type_names[] = {"int", "string"};
+str_node *str_root = NULL; // Tree of the string keys.
+key_search_fn key_rank; // Set by key_search_init().
+fingerprint_fn fingerprint_search; // Set by key_search_init().
 pthread_rwlock_t rwlock;
+pthread_rwlock_t root_latch; // Guards the root pointer under lock coupling.
+__thread latch_path *current_path = NULL;
+pool node_pool = {.name = "nodes", .lock = PTHREAD_MUTEX_INITIALIZER};
+pool record_pool = {.name = "records", .lock = PTHREAD_MUTEX_INITIALIZER};
+tree_file_header *tree_header = NULL; // Start of the mapped tree file, if any.
+int tree_file_fd = -1;
+pthread_mutex_t tree_file_lock = PTHREAD_MUTEX_INITIALIZER; // Guards growing the file.
+int durability = DURABILITY_NONE;
+const char *durability_names[] = {"none", "lazy", "sync"};
+long commit_usec = DEFAULT_COMMIT_USEC;
+int checkpoint_sec = 0; // Between checkpoints, 0 to checkpoint only at start and exit.
+bool log_active = false; // Changes are logged, from log_start() to log_close().
+char *log_path, *log_old_path, *checkpoint_path, *checkpoint_tmp_path;
+int log_fd = -1;
+uint64_t log_seq = 1; // Number of the next record.
+pthread_mutex_t log_stripes[LOG_STRIPES];
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; // Held for a commit and to switch logs.
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; // Guards durable counts and the rest below.
+pthread_cond_t commit_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+pthread_cond_t checkpoint_wake = PTHREAD_COND_INITIALIZER;
+int log_waiters = 0; // Threads waiting for a commit under DURABILITY_SYNC.
+bool log_stopping = false;
+pthread_t log_committer, log_checkpointer;
+struct iovec *log_iov = NULL; // Gathered by log_commit().
+long log_iov_capacity = 0;
+log_stats log_counts;
+uint64_t global_epoch = 1;
+thread_state *thread_states = NULL;
+pthread_key_t thread_state_key;
+pthread_once_t thread_state_once = PTHREAD_ONCE_INIT;
+__thread thread_state *self = NULL;
+
+#if TREE_STATS
+#define STAT_ADD(field, n) (get_thread_state()->stats.field += (n))
+#else
+#define STAT_ADD(field, n) ((void)0)
+#endif
 
 // Output and utility.
 void usage(void);
@@ -85,34 +776,239 @@ int height(node *root);
 int path_to_root(node *root, node *child);
 void print_leaves(node *root);
 void print_tree(node *root);
-void find_and_print(node *root, int key, bool verbose);
-void find_and_print_range(node *root, int range1, int range2, bool verbose);
-int find_range(node *root, int key_start, int key_end, bool verbose, int returned_keys[], void *returned_pointers[]);
-node *find_leaf(node *root, int key, bool verbose);
-record *find(node *root, int key, bool verbose);
+void find_and_print(node *root, tree_key key, bool verbose);
+void find_and_print_range(node *root, tree_key range1, tree_key range2, bool verbose);
+int find_range(node *root, tree_key key_start, tree_key key_end, bool verbose, tree_key returned_keys[], void *returned_pointers[]);
+node *find_leaf(node *root, tree_key key, bool verbose);
+bool find_slot(node *root, tree_key key, bool verbose, void **slot);
+bool find(node *root, tree_key key, bool verbose, tree_value *value);
+#if !INLINE_VALUES
+record *find_record(node *root, tree_key key, bool verbose);
+#endif
 int cut(int length);
+int min_node_keys(node *n);
+
+// Lock coupling.
+bool is_safe(node *n, latch_op op);
+void release_ancestors(latch_path *path);
+void release_path(latch_path *path);
+node *find_leaf_shared(node **root, tree_key key, bool *has_low, tree_key *low_key);
+node *find_leaf_exclusive(node **root, tree_key key, latch_op op, latch_path *path);
+void latch_neighbor(node *neighbor);
+void retire_node(node *n);
+void free_node(node *n);
+
+// Memory.
+void memory_init(void);
+void memory_release(void);
+void *pool_alloc(pool *p, pool_cache *cache);
+void pool_free(pool *p, pool_cache *cache, void *object);
+void pool_refill(pool *p, pool_cache *cache);
+void pool_add_slab(pool *p, void *slab);
+thread_state *get_thread_state(void);
+void release_thread_state(void *state);
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *object, object_kind kind);
+bool epoch_try_advance(void);
+void epoch_reclaim(thread_state *ts, bool all);
+void free_record(record *r);
+void print_allocator_stats(void);
+void get_tree_stats(tree_stats *stats);
+void reset_structure_stats(void);
+void print_structure_stats(void);
+
+// Placement.
+int parse_list(const char *list, int values[], int max);
+int read_sysfs_int(const char *path, int fallback);
+int compare_cpu_places(const void *a, const void *b);
+void affinity_init(int policy, const char *list);
+void pin_thread(int cpu);
+void placement_init(void);
+void place_slab(void *slab, size_t size);
+
+// Tree file.
+void *tree_file_map(size_t offset, size_t size, int flags);
+bool tree_file_open(const char *path, node **root);
+void *tree_file_grow(pool *p);
+void pool_flush(pool *p, int index);
+void tree_file_close(node *root);
+
+// Write-ahead log.
+uint64_t mix64(uint64_t x);
+uint32_t log_check(const log_record *r);
+char *log_name(const char *path, const char *suffix);
+void log_sync_dir(const char *path);
+void log_write_all(int fd, const void *data, size_t size, const char *path);
+int log_create(const char *path);
+void *log_read_file(const char *path, uint64_t magic, size_t item_size, log_header *header, long *count);
+int compare_log_records(const void *a, const void *b);
+bool log_recover(const char *path, node **root, int fill, int num_threads);
+void log_write_checkpoint(node **root, uint64_t seq);
+void log_start(node **root);
+pthread_mutex_t *log_lock_key(tree_key key);
+uint64_t log_append(uint32_t op, tree_key key, tree_value value);
+void log_release_key(pthread_mutex_t *stripe, uint64_t appended);
+tree_value log_update_fn(tree_value value, void *arg);
+void log_writev(struct iovec *iov, long count);
+void log_commit(void);
+void *log_committer_thread(void *arg);
+void log_checkpoint(node **root);
+void *log_checkpointer_thread(void *arg);
+void log_close(node **root);
+void print_log_stats(void);
+
+// Key search.
+int key_rank_linear(const tree_key *keys, int num_keys, tree_key key);
+int key_rank_binary(const tree_key *keys, int num_keys, tree_key key);
+#ifdef HAVE_X86_SIMD
+int key_rank_sse(const tree_key *keys, int num_keys, tree_key key);
+int key_rank_avx2(const tree_key *keys, int num_keys, tree_key key);
+#endif
+key_search_fn key_search_kernel(int kernel);
+void key_search_init(void);
+int child_index(const tree_key *keys, int num_keys, tree_key key);
+int key_index(const tree_key *keys, int num_keys, tree_key key);
+void key_search_benchmark(void);
+
+// Fingerprints.
+uint8_t key_fingerprint(tree_key key);
+size_t node_fingerprints_size(void);
+void fingerprint_leaf(node *leaf, int from);
+void fingerprint_insert(node *leaf, int i);
+void fingerprint_remove(node *leaf, int i);
+int fingerprint_search_scalar(const uint8_t *fingerprints, const tree_key *keys, int num_keys, tree_key key);
+#ifdef HAVE_X86_SIMD
+int fingerprint_search_sse(const uint8_t *fingerprints, const tree_key *keys, int num_keys, tree_key key);
+int fingerprint_search_avx2(const uint8_t *fingerprints, const tree_key *keys, int num_keys, tree_key key);
+#endif
+int leaf_index(node *leaf, int num_keys, tree_key key);
+
+// Latches.
+uint64_t clock_nsec(void);
+void latch_read(pthread_rwlock_t *latch);
+void latch_write(pthread_rwlock_t *latch);
+void latch_waited(uint64_t start);
+
+// Node versions.
+uint64_t version_read_begin(node *n);
+bool version_validate(node *n, uint64_t version);
+void version_lock(node *n);
+bool version_upgrade(node *n, uint64_t version);
+void version_unlock(node *n);
 
 // Insertion.
-record *make_record(int value);
+record *make_record(tree_value value);
+size_t node_keys_size(void);
+size_t node_size(void);
 node *make_node(void);
 node *make_leaf(void);
 int get_left_index(node *parent, node *left);
-node *insert_into_leaf(node *leaf, int key, record *pointer);
-node *insert_into_leaf_after_splitting(node *root, node *leaf, int key, record *pointer);
-node *insert_into_node(node *root, node *parent, int left_index, int key, node *right);
-node *insert_into_node_after_splitting(node *root, node *parent, int left_index, int key, node *right);
-node *insert_into_parent(node *root, node *left, int key, node *right);
-node *insert_into_new_root(node *left, int key, node *right);
-node *start_new_tree(int key, record *pointer);
-node *insert(node **root, int key, int value);
+node *insert_into_leaf(node *leaf, tree_key key, void *pointer);
+node *split_leaf(node *leaf, tree_key key, void *pointer);
+node *insert_into_leaf_after_splitting(node *root, node *leaf, tree_key key, void *pointer);
+node *insert_into_node(node *root, node *parent, int left_index, tree_key key, node *right);
+node *split_internal(node *old_node, int left_index, tree_key key, node *right, tree_key *k_prime);
+node *insert_into_node_after_splitting(node *root, node *parent, int left_index, tree_key key, node *right);
+node *insert_into_parent(node *root, node *left, tree_key key, node *right);
+node *insert_into_new_root(node *left, tree_key key, node *right);
+node *start_new_tree(tree_key key, void *pointer);
+void remember_rightmost(node *leaf);
+void forget_rightmost(node *n);
+node *append_hint(tree_key key);
+bool can_append(node *leaf, tree_key key);
+void put_existing(node *leaf, int i, tree_value value, bool overwrite, tree_value *existing);
+bool put(node **root, tree_key key, tree_value value, bool overwrite, tree_value *existing);
+bool insert(node **root, tree_key key, tree_value value);
+bool upsert(node **root, tree_key key, tree_value value);
+bool insert_or_get(node **root, tree_key key, tree_value value, tree_value *existing);
+bool update(node **root, tree_key key, update_fn fn, void *arg);
 
 // Deletion.
 int get_neighbor_index(node *n);
 node *adjust_root(node *root);
-node *coalesce_nodes(node *root, node *n, node *neighbor, int neighbor_index, int k_prime);
-node *redistribute_nodes(node *root, node *n, node *neighbor, int neighbor_index, int k_prime_index, int k_prime);
-node *delete_entry(node *root, node *n, int key, void *pointer);
-node *delete (node *root, int key);
+node *coalesce_nodes(node *root, node *n, node *neighbor, int neighbor_index, tree_key k_prime);
+node *redistribute_nodes(node *root, node *n, node *neighbor, int neighbor_index, int k_prime_index, tree_key k_prime);
+node *delete_entry(node *root, node *n, tree_key key, void *pointer);
+bool delete (node **root, tree_key key);
+
+// B-link tree.
+node *blink_move_right(node *n, tree_key key);
+node *blink_find_leaf(node *root, tree_key key, node *stack[], int *depth, int level);
+bool blink_find(node *root, tree_key key, void **slot);
+int blink_find_range(node *root, tree_key key_start, tree_key key_end, tree_key returned_keys[], void *returned_pointers[]);
+void blink_insert_into_parent(node **root, node *stack[], int depth, node *left, tree_key key, node *right);
+bool blink_insert(node **root, tree_key key, tree_value value, bool overwrite, tree_value *existing);
+bool blink_update(node **root, tree_key key, update_fn fn, void *arg);
+bool blink_delete(node **root, tree_key key);
+void retire_record(record *r);
+
+// Optimistic lock coupling.
+bool olc_read_lock(node *n, uint64_t *version);
+node *split_full_internal(node *n, bool append, tree_key *k_prime);
+node *olc_find_leaf(node **root, tree_key key, node **parent, uint64_t *parent_version, uint64_t *version);
+bool olc_find(node **root, tree_key key, void **slot);
+bool olc_insert(node **root, tree_key key, tree_value value, bool overwrite, tree_value *existing);
+bool olc_update(node **root, tree_key key, update_fn fn, void *arg);
+bool olc_delete(node **root, tree_key key);
+
+// Finger cache.
+void finger_set(node *leaf);
+node *finger_get(void);
+bool finger_covers(node *leaf, int num_keys, tree_key key);
+void finger_lock(node *leaf);
+void finger_unlock(node *leaf);
+void finger_count(bool hit);
+bool finger_search(tree_key key, int *found);
+bool finger_put(tree_key key, tree_value value, bool overwrite, tree_value *existing, bool *inserted);
+bool finger_delete(node **root, tree_key key, bool *deleted);
+
+// Cursors.
+void cursor_copy_leaf(cursor *c, node *leaf, int num_keys, void *slots[]);
+void cursor_read_values(cursor *c, void *slots[]);
+void cursor_load_optimistic(cursor *c, tree_key key);
+void cursor_load(cursor *c, tree_key key, tree_key bound);
+void cursor_seek(cursor *c, node **root, tree_key key);
+bool cursor_next(cursor *c, tree_key *key, tree_value *value);
+bool cursor_prev(cursor *c, tree_key *key, tree_value *value);
+int cursor_next_batch(cursor *c, tree_key keys[], tree_value values[], int capacity);
+
+// Bulk loading.
+int compare_pairs(const void *a, const void *b);
+long bulk_level_size(long num_entries, int capacity, int minimum, int fill);
+void bulk_build_nodes(bulk_level *level, long first, long last);
+void *bulk_build_thread(void *args);
+void bulk_build_level(bulk_level *level, int num_threads);
+node *bulk_load(kv_pair *pairs, long num, bool sorted, int fill, int num_threads);
+
+// String keys.
+uint32_t str_head(const uint8_t *key, int length);
+int str_compare(const uint8_t *a, int a_length, const uint8_t *b, int b_length);
+int str_key_format(tree_key key, uint8_t *buf);
+uint8_t *str_bytes(str_node *n, int offset);
+str_node *str_make_node(int level);
+int str_free_bytes(str_node *n);
+bool str_room(str_node *n, int length);
+void str_set_fences(str_node *n, const uint8_t *low, int low_length, const uint8_t *high, int high_length);
+int str_key(str_node *n, int i, uint8_t *buf);
+int str_rank(str_node *n, const uint8_t *key, int length, bool *found);
+str_node *str_child(str_node *n, const uint8_t *key, int length);
+void str_insert_at(str_node *n, int i, const uint8_t *key, int length, const str_slot *entry);
+void str_remove_at(str_node *n, int i);
+void str_fill(str_node *n, str_node *src, int first, int last,
+              const uint8_t *low, int low_length, const uint8_t *high, int high_length);
+void str_compact(str_node *n);
+str_node *str_split(str_node *n, uint8_t *separator, int *separator_length);
+void str_latch(str_node *n, bool exclusive);
+void str_unlatch(str_node *n);
+str_node *str_find_leaf(str_node **root, const uint8_t *key, int length, bool exclusive);
+bool str_insert_path(str_node **root, const uint8_t *key, int length, tree_value value);
+bool str_insert(str_node **root, const uint8_t *key, int length, tree_value value);
+bool str_find(str_node **root, const uint8_t *key, int length, tree_value *value);
+bool str_delete(str_node **root, const uint8_t *key, int length);
+void str_tree_stats(str_node *n, long *nodes, long *keys, long *stored_bytes, long *key_bytes);
+void print_str_stats(str_node *root);
+void str_destroy(str_node *n);
 
 // OUTPUT AND UTILITIES
 void usage()
@@ -121,9 +1017,32 @@ void usage()
   fprintf(stderr, "-r <NUM>    : Range size\n");
   fprintf(stderr, "-u <0..100> : Update ratio. 0 = Only search; 100 = Only updates\n");
   fprintf(stderr, "-i <NUM>    : Initial tree size (inital pre-filled element count)\n");
+  fprintf(stderr, "-b <0..100> : Bulk load the initial tree, filling nodes to this percentage. 0 = insert one at a time\n");
   fprintf(stderr, "-t <0 / 1>  : Test mode (for correctness). 0: NO / 1: YES.\n");
   fprintf(stderr, "-n <NUM>    : Number of threads\n");
   fprintf(stderr, "-s <NUM>    : Random seed. 0 = using time as seed\n");
+  fprintf(stderr, "-c <0..3>   : Concurrency control. 0: global rwlock / 1: lock coupling / 2: B-link tree / 3: optimistic lock coupling\n");
+  fprintf(stderr, "-q <NUM>    : Benchmark searches in batches of NUM keys with search_batch(). 0 = one key at a time\n");
+  fprintf(stderr, "-l <NUM>    : Benchmark range scans of NUM keys in place of searches. 0 = point searches\n");
+  fprintf(stderr, "-m <1..50>  : Merge or rebalance a node once a deletion leaves it below this percentage full. 50 = classic B+ tree\n");
+  fprintf(stderr, "-f          : Try the leaf each thread visited last before descending from the root\n");
+  fprintf(stderr, "-L <0..100> : Key locality. Percentage of benchmark keys drawn close to the thread's previous key\n");
+  fprintf(stderr, "-H <0..3>   : Report benchmark latency percentiles. 0: NO / 1: text / 2: CSV / 3: JSON\n");
+  fprintf(stderr, "-a <POLICY> : Pin benchmark threads. none / compact / scatter / nosmt (one per core first) / a CPU list like 0,2,4-7\n");
+  fprintf(stderr, "-N <0 / 1>  : NUMA placement of tree memory. 0: first touch / 1: interleaved across nodes\n");
+  fprintf(stderr, "-d <DIST>   : Benchmark key distribution. uniform / zipf / hotspot / latest / sequential / shuffled\n");
+  fprintf(stderr, "-z <THETA>  : Skew of the zipf and latest distributions, between 0 and 1 (default 0.99)\n");
+  fprintf(stderr, "-D <SEC>    : Run the benchmark for SEC seconds, reporting throughput over time. 0 = run a fixed number of operations\n");
+  fprintf(stderr, "-R <NUM>    : Open loop: start NUM operations per second over all threads, timing each from when it was due. Needs -D\n");
+  fprintf(stderr, "-I <MSEC>   : Length of the intervals reported with -D (default 100)\n");
+  fprintf(stderr, "-P          : Count cycles, instructions, LLC and dTLB misses and branch mispredictions per operation (Linux perf events)\n");
+  fprintf(stderr, "-F <FILE>   : Keep the tree in FILE. A tree already in it is reopened instead of prefilled\n");
+  fprintf(stderr, "-W <FILE>   : Log every change to FILE, checkpointing to FILE.ckpt. A tree in them is recovered instead of prefilled\n");
+  fprintf(stderr, "-y <LEVEL>  : Durability of logged changes. lazy (committed in the background) / sync (default; each change waits for its commit)\n");
+  fprintf(stderr, "-G <USEC>   : Commit interval of the log, and how long a commit waits for more changes under sync (default 1000)\n");
+  fprintf(stderr, "-C <SEC>    : Checkpoint the logged tree every SEC seconds. 0 = only at start and exit\n");
+  fprintf(stderr, "-k          : Compare the key search kernels at several orders and exit\n");
+  fprintf(stderr, "-K <TYPE>   : Key type of the benchmark and test. int / string (\"user:\" and the key's digits; -c 0 or 1 only, see README)\n");
   fprintf(stderr, "-h          : This help\n\n");
   fprintf(stderr, "Benchmark output format: \n\"0: range, insert ratio, delete ratio, #threads, attempted insert, attempted delete, attempted search, effective insert, effective delete, effective search, time (in msec)\"\n\n");
   exit(EXIT_SUCCESS);
@@ -186,7 +1105,7 @@ void print_leaves(node *root)
     {
       if (verbose_output)
         printf("%lx ", (unsigned long)c->pointers[i]);
-      printf("%d ", c->keys[i]);
+      printf("%" KEY_FORMAT " ", c->keys[i]);
     }
 
     if (c->pointers[order - 1] == NULL)
@@ -277,7 +1196,7 @@ void print_tree(node *root)
     {
       if (verbose_output)
         printf("%lx ", (unsigned long)n->pointers[i]);
-      printf("%d ", n->keys[i]);
+      printf("%" KEY_FORMAT " ", n->keys[i]);
     }
 
     if (!n->is_leaf)
@@ -301,38 +1220,35 @@ void print_tree(node *root)
 /* Finds the record under a given key and prints an
  * appropriate message to stdout.
  */
-void find_and_print(node *root, int key, bool verbose)
+void find_and_print(node *root, tree_key key, bool verbose)
 {
-  record *r = find(root, key, verbose);
-  if (r == NULL)
-    printf("Record not found under key %d.\n", key);
+  tree_value value;
+  if (!find(root, key, verbose, &value))
+    printf("Record not found under key %" KEY_FORMAT ".\n", key);
   else
-    printf("Record at %lx -- key %d, value %d.\n",
-           (unsigned long)r, key, r->value);
+    printf("Record found -- key %" KEY_FORMAT ", value %" KEY_FORMAT ".\n", key, value);
 }
 
 /* Finds and prints the keys, pointers, and values within a range
  * of keys between key_start and key_end, including both bounds.
  */
-void find_and_print_range(node *root, int key_start, int key_end, bool verbose)
+void find_and_print_range(node *root, tree_key key_start, tree_key key_end, bool verbose)
 {
-  int i;
-  int array_size = key_end - key_start + 1;
-  int returned_keys[array_size];
-  void *returned_pointers[array_size];
-  int num_found = find_range(root, key_start, key_end, verbose,
-                             returned_keys, returned_pointers);
-  if (num_found)
-  {
-    for (i = 0; i < num_found; i++)
-      printf("Key: %d   Location: %lx  Value: %d\n",
-             returned_keys[i],
-             (unsigned long)returned_pointers[i],
-             ((record *)
-                  returned_pointers[i])
-                 ->value);
+  tree_key key;
+  tree_value value;
+  int num_found = 0;
+  cursor c;
+
+  if (verbose)
+    find_leaf(root, key_start, true);
+
+  cursor_seek(&c, &root, key_start);
+  while (cursor_next(&c, &key, &value) && key <= key_end)
+  {
+    printf("Key: %" KEY_FORMAT "   Value: %" KEY_FORMAT "\n", key, value);
+    num_found++;
   }
-  else
+  if (num_found == 0)
     printf("None found.\n");
 }
 
@@ -341,17 +1257,19 @@ void find_and_print_range(node *root, int key_start, int key_end, bool verbose)
  * returned_keys and returned_pointers, and returns the number of
  * entries found.
  */
-int find_range(node *root, int key_start, int key_end, bool verbose, int returned_keys[], void *returned_pointers[])
+int find_range(node *root, tree_key key_start, tree_key key_end, bool verbose, tree_key returned_keys[], void *returned_pointers[])
 {
+  // Optimistic trees keep right links too, so they share the lock-free scan.
+  if (concurrency == CC_BLINK || concurrency == CC_OLC)
+    return blink_find_range(root, key_start, key_end, returned_keys, returned_pointers);
+
   int i, num_found;
   num_found = 0;
   node *n = find_leaf(root, key_start, verbose);
   if (n == NULL)
     return 0;
 
-  // for-loop intentionally left empty
-  for (i = 0; i < n->num_keys && n->keys[i] < key_start; i++)
-    ;
+  i = key_rank(n->keys, n->num_keys, key_start);
   if (i == n->num_keys)
     return 0;
 
@@ -377,7 +1295,7 @@ int find_range(node *root, int key_start, int key_end, bool verbose, int returne
  * if the verbose flag is set.
  * Returns the leaf containing the given key.
  */
-node *find_leaf(node *root, int key, bool verbose)
+node *find_leaf(node *root, tree_key key, bool verbose)
 {
   int i = 0;
   node *c = root;
@@ -395,18 +1313,11 @@ node *find_leaf(node *root, int key, bool verbose)
     {
       printf("[");
       for (i = 0; i < c->num_keys - 1; i++)
-        printf("%d ", c->keys[i]);
-      printf("%d] ", c->keys[i]);
+        printf("%" KEY_FORMAT " ", c->keys[i]);
+      printf("%" KEY_FORMAT "] ", c->keys[i]);
     }
 
-    i = 0;
-    while (i < c->num_keys)
-    {
-      if (key >= c->keys[i])
-        i++;
-      else
-        break;
-    }
+    i = child_index(c->keys, c->num_keys, key);
     if (verbose)
       printf("%d ->\n", i);
     c = (node *)c->pointers[i];
@@ -416,36 +1327,63 @@ node *find_leaf(node *root, int key, bool verbose)
   {
     printf("Leaf [");
     for (i = 0; i < c->num_keys - 1; i++)
-      printf("%d ", c->keys[i]);
-    printf("%d] ->\n", c->keys[i]);
+      printf("%" KEY_FORMAT " ", c->keys[i]);
+    printf("%" KEY_FORMAT "] ->\n", c->keys[i]);
   }
 
+  finger_set(c);
   return c;
 }
 
-/* Finds and returns the record to which
- * a key refers.
+/* Finds the leaf slot that holds the value to which
+ * a key refers. Returns false if the key is not present.
  */
-record *find(node *root, int key, bool verbose)
+bool find_slot(node *root, tree_key key, bool verbose, void **slot)
 {
+  if (concurrency == CC_BLINK)
+    return blink_find(root, key, slot);
+  if (concurrency == CC_OLC)
+    return olc_find(&root, key, slot);
+
   int i = 0;
   node *c = find_leaf(root, key, verbose);
   if (c == NULL)
-    return NULL;
-
-  for (i = 0; i < c->num_keys; i++)
-  {
-    if (c->keys[i] == key)
-    {
-      break;
-    }
-  }
+    return false;
 
+  i = leaf_index(c, c->num_keys, key);
   if (i == c->num_keys)
-    return NULL;
-  else
-    return (record *)c->pointers[i];
+    return false;
+  *slot = c->pointers[i];
+  return true;
+}
+
+/* Finds the value to which a key refers and stores it
+ * in *value, unless value is NULL.
+ * Returns false if the key is not present.
+ */
+bool find(node *root, tree_key key, bool verbose, tree_value *value)
+{
+  void *slot;
+
+  if (!find_slot(root, key, verbose, &slot))
+    return false;
+  if (value != NULL)
+    *value = slot_value(slot);
+  return true;
+}
+
+#if !INLINE_VALUES
+/* Finds and returns the record to which a key refers.
+ * The record stays at the same address until the key
+ * is deleted.
+ */
+record *find_record(node *root, tree_key key, bool verbose)
+{
+  void *slot;
+
+  return find_slot(root, key, verbose, &slot) ? slot : NULL;
 }
+#endif
 
 /* Finds the appropriate place to
  * split a node that is too big into two.
@@ -458,907 +1396,6097 @@ int cut(int length)
     return length / 2 + 1;
 }
 
-// INSERTION
-/* Creates a new record to hold the value
- * to which a key refers.
+/* Returns the fewest keys a non-root node may be left with
+ * by a deletion before it is merged with or borrows from a
+ * neighbor. At merge_percent 50 this is the classic half-full
+ * bound; lower values let nodes drain further, so that a
+ * node just split in half can lose keys again without being
+ * merged straight back, and the merge is left to whichever
+ * later deletion finally empties it past the bound.
  */
-record *make_record(int value)
+int min_node_keys(node *n)
 {
-  record *new_record = malloc(sizeof(record));
+  int children;
 
-  if (new_record == NULL)
+  if (n->is_leaf)
   {
-    perror("Record creation.");
-    exit(EXIT_FAILURE);
+    int keys = ((order - 1) * merge_percent + 99) / 100;
+    return keys > 1 ? keys : 1;
   }
 
-  new_record->value = value;
-  return new_record;
+  children = (order * merge_percent + 99) / 100;
+  return (children > 2 ? children : 2) - 1;
 }
 
-/* Creates a new general node, which can be adapted
- * to serve as either a leaf or an internal node.
+// LOCK COUPLING
+
+/* Tells whether a latched node can absorb the given
+ * modification without splitting or underflowing, so
+ * that none of its ancestors can be touched by it.
  */
-node *make_node(void)
+bool is_safe(node *n, latch_op op)
 {
-  node *new_node = malloc(sizeof(node));
-  if (new_node == NULL)
-  {
-    perror("Node creation.");
-    exit(EXIT_FAILURE);
-  }
-
-  new_node->keys = malloc((order - 1) * sizeof(int));
-  if (new_node->keys == NULL)
-  {
-    perror("New node keys array.");
-    exit(EXIT_FAILURE);
-  }
+  if (op == LATCH_UPDATE)
+    return true;
+  if (op == LATCH_INSERT)
+    return n->num_keys < order - 1;
 
-  new_node->pointers = malloc(order * sizeof(void *));
-  if (new_node->pointers == NULL)
-  {
-    perror("New node pointers array.");
-    exit(EXIT_FAILURE);
-  }
+  // The root may shrink down to a single key.
+  if (n->parent == NULL)
+    return n->num_keys > 1;
 
-  new_node->is_leaf = false;
-  new_node->num_keys = 0;
-  new_node->parent = NULL;
-  new_node->next = NULL;
-  return new_node;
+  return n->num_keys > min_node_keys(n);
 }
 
-/* Creates a new leaf by creating a node
- * and then adapting it appropriately.
+/* Releases every latch on the path except the one
+ * on the most recently latched node.
  */
-node *make_leaf(void)
+void release_ancestors(latch_path *path)
 {
-  node *leaf = make_node();
-  leaf->is_leaf = true;
-  return leaf;
-}
+  int i;
 
-/* Helper function used in insert_into_parent
- * to find the index of the parent's pointer to
- * the node to the left of the key to be inserted.
- */
-int get_left_index(node *parent, node *left)
-{
-  int left_index = 0;
+  if (path->root_latched)
+  {
+    pthread_rwlock_unlock(&root_latch);
+    path->root_latched = false;
+  }
 
-  while (left_index <= parent->num_keys && parent->pointers[left_index] != left)
-    left_index++;
+  for (i = 0; i < path->count - 1; i++)
+    pthread_rwlock_unlock(&path->held[i]->latch);
 
-  return left_index;
+  if (path->count > 0)
+  {
+    path->held[0] = path->held[path->count - 1];
+    path->count = 1;
+  }
 }
 
-/* Inserts a new pointer to a record and its corresponding
- * key into a leaf.
- * Returns the altered leaf.
- */
-node *insert_into_leaf(node *leaf, int key, record *pointer)
+// Releases every latch on the path.
+void release_path(latch_path *path)
 {
-  int insertion_point = 0;
-  while (insertion_point < leaf->num_keys && leaf->keys[insertion_point] < key)
-    insertion_point++;
-
   int i;
-  for (i = leaf->num_keys; i > insertion_point; i--)
-  {
-    leaf->keys[i] = leaf->keys[i - 1];
-    leaf->pointers[i] = leaf->pointers[i - 1];
-  }
 
-  leaf->keys[insertion_point] = key;
-  leaf->pointers[insertion_point] = pointer;
-  leaf->num_keys++;
+  for (i = 0; i < path->count; i++)
+    pthread_rwlock_unlock(&path->held[i]->latch);
+  path->count = 0;
 
-  return leaf;
+  if (path->root_latched)
+  {
+    pthread_rwlock_unlock(&root_latch);
+    path->root_latched = false;
+  }
 }
 
-/* Inserts a new key and pointer
- * to a new record into a leaf so as to exceed
- * the tree's order, causing the leaf to be split
- * in half.
+/* Descends to the leaf that should hold the key while
+ * holding at most two shared latches at a time. Unless
+ * has_low is NULL, also finds the lower bound (inclusive)
+ * of the keys the leaf may hold, which is valid for as
+ * long as the leaf stays latched; the leftmost leaf has
+ * none.
+ * Returns the leaf latched in shared mode, or NULL
+ * if the tree is empty.
  */
-node *insert_into_leaf_after_splitting(node *root, node *leaf, int key, record *pointer)
+node *find_leaf_shared(node **root, tree_key key, bool *has_low, tree_key *low_key)
 {
-  node *new_leaf = make_leaf();
+  int i;
+  node *c, *child;
 
-  int *temp_keys = malloc(order * sizeof(int));
-  if (temp_keys == NULL)
+  if (has_low != NULL)
+    *has_low = false;
+
+  latch_read(&root_latch);
+  c = *root;
+  if (c == NULL)
   {
-    perror("Temporary keys array.");
-    exit(EXIT_FAILURE);
+    pthread_rwlock_unlock(&root_latch);
+    return NULL;
   }
+  latch_read(&c->latch);
+  pthread_rwlock_unlock(&root_latch);
 
-  void **temp_pointers = malloc(order * sizeof(void *));
-  if (temp_pointers == NULL)
+  while (!c->is_leaf)
   {
-    perror("Temporary pointers array.");
-    exit(EXIT_FAILURE);
+    i = child_index(c->keys, c->num_keys, key);
+    if (has_low != NULL && i > 0)
+    {
+      *has_low = true;
+      *low_key = c->keys[i - 1];
+    }
+    child = (node *)c->pointers[i];
+    latch_read(&child->latch);
+    pthread_rwlock_unlock(&c->latch);
+    c = child;
   }
 
-  int insertion_index, split, new_key, i, j;
-
-  insertion_index = 0;
-  while (insertion_index < order - 1 && leaf->keys[insertion_index] < key)
-    insertion_index++;
+  finger_set(c);
+  return c;
+}
 
-  for (i = 0, j = 0; i < leaf->num_keys; i++, j++)
-  {
-    if (j == insertion_index)
-      j++;
-    temp_keys[j] = leaf->keys[i];
-    temp_pointers[j] = leaf->pointers[i];
-  }
+/* Descends to the leaf that should hold the key, latching
+ * every node on the way in exclusive mode and releasing
+ * the ancestors of each node that is safe for the given
+ * operation. The root pointer latch stays held for as long
+ * as the root itself may change.
+ * Returns the leaf, or NULL with the root pointer latch
+ * held if the tree is empty.
+ */
+node *find_leaf_exclusive(node **root, tree_key key, latch_op op, latch_path *path)
+{
+  int i;
+  node *c;
 
-  temp_keys[insertion_index] = key;
-  temp_pointers[insertion_index] = pointer;
+  path->count = 0;
 
-  leaf->num_keys = 0;
+  latch_write(&root_latch);
+  path->root_latched = true;
 
-  split = cut(order - 1);
+  c = *root;
+  if (c == NULL)
+    return NULL;
 
-  for (i = 0; i < split; i++)
+  while (true)
   {
-    leaf->pointers[i] = temp_pointers[i];
-    leaf->keys[i] = temp_keys[i];
-    leaf->num_keys++;
-  }
+    latch_write(&c->latch);
+    path->held[path->count++] = c;
+    if (is_safe(c, op))
+      release_ancestors(path);
 
-  for (i = split, j = 0; i < order; i++, j++)
-  {
-    new_leaf->pointers[j] = temp_pointers[i];
-    new_leaf->keys[j] = temp_keys[i];
-    new_leaf->num_keys++;
+    if (c->is_leaf)
+    {
+      finger_set(c);
+      return c;
+    }
+
+    i = child_index(c->keys, c->num_keys, key);
+    c = (node *)c->pointers[i];
   }
+}
 
-  free(temp_pointers);
-  free(temp_keys);
+/* Latches the sibling a deletion borrows from or merges
+ * with. Its parent is held, so no descent can be waiting
+ * on it in turn.
+ */
+void latch_neighbor(node *neighbor)
+{
+  if (current_path == NULL)
+    return;
 
-  new_leaf->pointers[order - 1] = leaf->pointers[order - 1];
-  leaf->pointers[order - 1] = new_leaf;
+  latch_write(&neighbor->latch);
+  current_path->held[current_path->count++] = neighbor;
+}
 
-  for (i = leaf->num_keys; i < order - 1; i++)
-    leaf->pointers[i] = NULL;
+/* Releases a node that has been unlinked from the tree.
+ * It may still be latched, or being read by an optimistic
+ * reader, so it is only freed once its epoch has passed.
+ */
+void retire_node(node *n)
+{
+  __atomic_fetch_or(&n->version, VERSION_OBSOLETE, __ATOMIC_RELEASE);
+  forget_rightmost(n);
+  epoch_retire(n, OBJECT_NODE);
+}
 
-  for (i = new_leaf->num_keys; i < order - 1; i++)
-    new_leaf->pointers[i] = NULL;
+void free_node(node *n)
+{
+  pthread_rwlock_destroy(&n->latch);
+  pool_free(&node_pool, &get_thread_state()->nodes, n);
+}
 
-  new_leaf->parent = leaf->parent;
-  new_key = new_leaf->keys[0];
+void free_record(record *r)
+{
+  pool_free(&record_pool, &get_thread_state()->records, r);
+}
+
+// KEY SEARCH
 
-  return insert_into_parent(root, leaf, new_key, new_leaf);
+// The original scan, one key at a time.
+int key_rank_linear(const tree_key *keys, int num_keys, tree_key key)
+{
+  int i = 0;
+  while (i < num_keys && keys[i] < key)
+    i++;
+  return i;
 }
 
-/* Inserts a new key and pointer to a node
- * into a node into which these can fit
- * without violating the B+ tree properties.
+/* Binary search without a data-dependent branch: the
+ * comparison only selects the next base, which compiles
+ * to a conditional move.
  */
-node *insert_into_node(node *root, node *n, int left_index, int key, node *right)
+int key_rank_binary(const tree_key *keys, int num_keys, tree_key key)
 {
-  int i;
+  const tree_key *base = keys;
+  int half, n = num_keys;
 
-  for (i = n->num_keys; i > left_index; i--)
+  if (n == 0)
+    return 0;
+  while (n > 1)
   {
-    n->pointers[i + 1] = n->pointers[i];
-    n->keys[i] = n->keys[i - 1];
+    half = n / 2;
+    base = base[half] < key ? base + half : base;
+    n -= half;
   }
-
-  n->pointers[left_index + 1] = right;
-  n->keys[left_index] = key;
-  n->num_keys++;
-  return root;
+  return (int)(base - keys) + (*base < key);
 }
 
-/* Inserts a new key and pointer to a node
- * into a node, causing the node's size to exceed
- * the order, and causing the node to split into two.
+#ifdef HAVE_X86_SIMD
+/* Compares a vector of copies of the key with the keys at
+ * p, giving one mask bit per lane whose key is less.
+ */
+#if KEY_BITS == 64
+#define SSE_LANES 2
+#define AVX2_LANES 4
+#define sse_broadcast(key) _mm_set1_epi64x(key)
+#define sse_less_mask(k, p) _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, _mm_loadu_si128((const __m128i *)(p)))))
+#define avx2_broadcast(key) _mm256_set1_epi64x(key)
+#define avx2_less_mask(k, p) _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, _mm256_loadu_si256((const __m256i *)(p)))))
+#else
+#define SSE_LANES 4
+#define AVX2_LANES 8
+#define sse_broadcast(key) _mm_set1_epi32(key)
+#define sse_less_mask(k, p) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, _mm_loadu_si128((const __m128i *)(p)))))
+#define avx2_broadcast(key) _mm256_set1_epi32(key)
+#define avx2_less_mask(k, p) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, _mm256_loadu_si256((const __m256i *)(p)))))
+#endif
+
+/* Narrows the search as key_rank_binary() does until the
+ * answer lies within a window of eight keys, and then counts
+ * the keys in the window that are less than key with two
+ * vector compares (four with 64-bit keys). The window is moved left if it would run
+ * past the last key; the keys it then takes in from before
+ * the narrowed range are all less than key anyway.
  */
-node *insert_into_node_after_splitting(node *root, node *old_node, int left_index, int key, node *right)
+__attribute__((target("sse4.2"))) int key_rank_sse(const tree_key *keys, int num_keys, tree_key key)
 {
-  /* First create a temporary set of keys and pointers
-  * to hold everything in order, including
-  * the new key and pointer, inserted in their
-  * correct places.
-  * Then create a new node and copy half of the
-  * keys and pointers to the old node and
-  * the other half to the new.
-  */
+  const tree_key *base = keys;
+  int i, half, mask = 0, n = num_keys;
+  __m128i k;
 
-  node **temp_pointers = malloc((order + 1) * sizeof(node *));
-  if (temp_pointers == NULL)
+  if (n < 8)
+    return key_rank_binary(keys, num_keys, key);
+  while (n > 8)
   {
-    perror("Temporary pointers array for splitting nodes.");
-    exit(EXIT_FAILURE);
+    half = n / 2;
+    base = base[half] < key ? base + half : base;
+    n -= half;
   }
+  if (base > keys + num_keys - 8)
+    base = keys + num_keys - 8;
 
-  int *temp_keys = malloc(order * sizeof(int));
-  if (temp_keys == NULL)
-  {
-    perror("Temporary keys array for splitting nodes.");
-    exit(EXIT_FAILURE);
-  }
+  k = sse_broadcast(key);
+  for (i = 0; i < 8; i += SSE_LANES)
+    mask |= sse_less_mask(k, base + i) << i;
+  return (int)(base - keys) + __builtin_popcount(mask);
+}
 
-  int i, j, split, k_prime;
-  for (i = 0, j = 0; i < old_node->num_keys + 1; i++, j++)
-  {
-    if (j == left_index + 1)
-      j++;
-    temp_pointers[j] = old_node->pointers[i];
-  }
+// As key_rank_sse(), with a window of sixteen keys.
+__attribute__((target("avx2"))) int key_rank_avx2(const tree_key *keys, int num_keys, tree_key key)
+{
+  const tree_key *base = keys;
+  int i, half, mask = 0, n = num_keys;
+  __m256i k;
 
-  for (i = 0, j = 0; i < old_node->num_keys; i++, j++)
+  if (n < 16)
+    return key_rank_binary(keys, num_keys, key);
+  while (n > 16)
   {
-    if (j == left_index)
-      j++;
-    temp_keys[j] = old_node->keys[i];
+    half = n / 2;
+    base = base[half] < key ? base + half : base;
+    n -= half;
   }
+  if (base > keys + num_keys - 16)
+    base = keys + num_keys - 16;
 
-  temp_pointers[left_index + 1] = right;
-  temp_keys[left_index] = key;
-
-  /* Create the new node and copy
-  * half the keys and pointers to the
-  * old and half to the new.
-  */
-  split = cut(order);
-
-  node *new_node = make_node();
-  old_node->num_keys = 0;
+  k = avx2_broadcast(key);
+  for (i = 0; i < 16; i += AVX2_LANES)
+    mask |= avx2_less_mask(k, base + i) << i;
+  return (int)(base - keys) + __builtin_popcount(mask);
+}
+#endif
 
-  for (i = 0; i < split - 1; i++)
+/* Returns the kernel for one of the KEY_SEARCH_* values,
+ * or NULL if this CPU cannot run it.
+ */
+key_search_fn key_search_kernel(int kernel)
+{
+  switch (kernel)
   {
-    old_node->pointers[i] = temp_pointers[i];
-    old_node->keys[i] = temp_keys[i];
-    old_node->num_keys++;
+  case KEY_SEARCH_LINEAR:
+    return key_rank_linear;
+  case KEY_SEARCH_BINARY:
+    return key_rank_binary;
+#ifdef HAVE_X86_SIMD
+  case KEY_SEARCH_SSE:
+    return __builtin_cpu_supports("sse4.2") ? key_rank_sse : NULL;
+  case KEY_SEARCH_AVX2:
+    return __builtin_cpu_supports("avx2") ? key_rank_avx2 : NULL;
+#endif
   }
+  return NULL;
+}
 
-  old_node->pointers[i] = temp_pointers[i];
-  k_prime = temp_keys[split - 1];
-  for (++i, j = 0; i < order; i++, j++)
-  {
-    new_node->pointers[j] = temp_pointers[i];
-    new_node->keys[j] = temp_keys[i];
-    new_node->num_keys++;
-  }
+/* Sets key_rank to the kernel chosen by KEY_SEARCH. Must
+ * be called before the tree is used.
+ */
+void key_search_init(void)
+{
+  int kernel = KEY_SEARCH;
 
-  new_node->pointers[j] = temp_pointers[i];
-  free(temp_pointers);
-  free(temp_keys);
+  if (kernel == KEY_SEARCH_AUTO)
+    for (kernel = KEY_SEARCH_AVX2; kernel > KEY_SEARCH_BINARY; kernel--)
+      if (key_search_kernel(kernel) != NULL)
+        break;
 
-  node *child;
-  new_node->parent = old_node->parent;
-  for (i = 0; i <= new_node->num_keys; i++)
+  key_rank = key_search_kernel(kernel);
+  if (key_rank == NULL)
   {
-    child = new_node->pointers[i];
-    child->parent = new_node;
+    fprintf(stderr, "Key search kernel %s is not supported here\n", key_search_names[kernel]);
+    exit(EXIT_FAILURE);
   }
-
-  /* Insert a new key into the parent of the two
-  * nodes resulting from the split, with
-  * the old node to the left and the new to the right.
-  */
-
-  return insert_into_parent(root, old_node, k_prime, new_node);
+  key_search = kernel;
+
+  // Fingerprints are compared with the same instruction set.
+  fingerprint_search = fingerprint_search_scalar;
+#ifdef HAVE_X86_SIMD
+  if (kernel == KEY_SEARCH_AVX2)
+    fingerprint_search = fingerprint_search_avx2;
+  else if (kernel == KEY_SEARCH_SSE)
+    fingerprint_search = fingerprint_search_sse;
+#endif
 }
 
-/* Inserts a new node (leaf or internal node) into the B+ tree.
- * Returns the root of the tree after insertion.
+/* Returns the index of the child of an internal node
+ * that covers key, i.e. the number of keys <= key.
  */
-node *insert_into_parent(node *root, node *left, int key, node *right)
+int child_index(const tree_key *keys, int num_keys, tree_key key)
 {
-  node *parent = left->parent;
+  return key == KEY_MAX ? num_keys : key_rank(keys, num_keys, key + 1);
+}
 
-  // Case: new root
-  if (parent == NULL)
-    return insert_into_new_root(left, key, right);
+// Returns the position of key, or num_keys if it is not present.
+int key_index(const tree_key *keys, int num_keys, tree_key key)
+{
+  int i = key_rank(keys, num_keys, key);
+  return i < num_keys && keys[i] == key ? i : num_keys;
+}
 
-  // Case: leaf or node
+// FINGERPRINTS
 
-  // Find the parent's pointer to the left node.
-  int left_index = get_left_index(parent, left);
+// The fingerprints of a node follow its pointers. See node_size().
+#define node_fingerprints(n) ((uint8_t *)((n)->pointers + order))
 
-  // Simple case: the new key fits into the node.
-  if (parent->num_keys < order - 1)
-    return insert_into_node(root, parent, left_index, key, right);
+// The top byte of a multiplicative hash of the key.
+uint8_t key_fingerprint(tree_key key)
+{
+  return (uint8_t)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 56);
+}
 
-  // Harder case:  split a node in order to preserve the B+ tree properties.
-  return insert_into_node_after_splitting(root, parent, left_index, key, right);
+// Bytes taken by the fingerprints of a node, or 0 without them.
+size_t node_fingerprints_size(void)
+{
+#if LEAF_FINGERPRINTS
+  return (order - 1 + FINGERPRINT_BLOCK - 1) / FINGERPRINT_BLOCK * FINGERPRINT_BLOCK;
+#else
+  return 0;
+#endif
 }
 
-/* Creates a new root for two subtrees
- * and inserts the appropriate key into
- * the new root.
+/* Recomputes the fingerprints of a leaf from position from
+ * onwards, once the keys there have been changed.
  */
-node *insert_into_new_root(node *left, int key, node *right)
+void fingerprint_leaf(node *leaf, int from)
 {
-  node *root = make_node();
-  root->keys[0] = key;
-  root->pointers[0] = left;
-  root->pointers[1] = right;
-  root->num_keys++;
-  root->parent = NULL;
-  left->parent = root;
-  right->parent = root;
-  return root;
+#if LEAF_FINGERPRINTS
+  uint8_t *fingerprints = node_fingerprints(leaf);
+  int i;
+
+  for (i = from; i < leaf->num_keys; i++)
+    fingerprints[i] = key_fingerprint(leaf->keys[i]);
+#else
+  (void)leaf;
+  (void)from;
+#endif
 }
 
-/* First insertion:
- * start a new tree.
+/* Moves the fingerprints after position i up by one for
+ * the key just inserted there, which is counted already.
  */
-node *start_new_tree(int key, record *pointer)
+void fingerprint_insert(node *leaf, int i)
 {
-  node *root = make_leaf();
-  root->keys[0] = key;
-  root->pointers[0] = pointer;
-  root->pointers[order - 1] = NULL;
-  root->parent = NULL;
-  root->num_keys++;
-  return root;
+#if LEAF_FINGERPRINTS
+  uint8_t *fingerprints = node_fingerprints(leaf);
+
+  memmove(fingerprints + i + 1, fingerprints + i, leaf->num_keys - i - 1);
+  fingerprints[i] = key_fingerprint(leaf->keys[i]);
+#else
+  (void)leaf;
+  (void)i;
+#endif
 }
 
-/* Master insertion function.
- * Inserts a key and an associated value into
- * the B+ tree, causing the tree to be adjusted
- * however necessary to maintain the B+ tree
- * properties.
- */
-node *insert(node **root, int key, int value)
+// Moves the fingerprints after the key just removed from position i down by one.
+void fingerprint_remove(node *leaf, int i)
 {
-  pthread_rwlock_wrlock(&rwlock);
+#if LEAF_FINGERPRINTS
+  uint8_t *fingerprints = node_fingerprints(leaf);
 
-  // The current implementation ignores duplicates.
-  if (find(*root, key, false) != NULL)
-  {
-    pthread_rwlock_unlock(&rwlock);
-    return *root;
-  }
+  memmove(fingerprints + i, fingerprints + i + 1, leaf->num_keys - i);
+#else
+  (void)leaf;
+  (void)i;
+#endif
+}
 
-  // Create a new record for the value.
-  record *pointer = make_record(value);
+// Compares one fingerprint at a time.
+int fingerprint_search_scalar(const uint8_t *fingerprints, const tree_key *keys, int num_keys, tree_key key)
+{
+  uint8_t fingerprint = key_fingerprint(key);
+  int i;
 
-  // Case: the tree does not exist yet.
-  if (*root == NULL)
-  {
-    node *mordi = start_new_tree(key, pointer);
-    pthread_rwlock_unlock(&rwlock);
-    return mordi;
-  }
+  for (i = 0; i < num_keys; i++)
+    if (fingerprints[i] == fingerprint && keys[i] == key)
+      return i;
+  return num_keys;
+}
 
-  node *leaf = find_leaf(*root, key, false);
+#ifdef HAVE_X86_SIMD
+/* Compares sixteen fingerprints at a time, and then the keys
+ * of those that match. The array is padded, so the last
+ * compare may read past num_keys; its extra bits are masked.
+ */
+__attribute__((target("sse2"))) int fingerprint_search_sse(const uint8_t *fingerprints, const tree_key *keys, int num_keys, tree_key key)
+{
+  __m128i f = _mm_set1_epi8((char)key_fingerprint(key));
+  unsigned mask;
+  int i;
 
-  // Case: leaf has room for key and pointer.
-  if (leaf->num_keys < order - 1)
+  for (i = 0; i < num_keys; i += 16)
   {
-    leaf = insert_into_leaf(leaf, key, pointer);
-    pthread_rwlock_unlock(&rwlock);
-    return *root;
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(f, _mm_loadu_si128((const __m128i *)(fingerprints + i))));
+    if (num_keys - i < 16)
+      mask &= (1u << (num_keys - i)) - 1;
+    for (; mask != 0; mask &= mask - 1)
+      if (keys[i + __builtin_ctz(mask)] == key)
+        return i + __builtin_ctz(mask);
   }
+  return num_keys;
+}
 
-  // Case: leaf must be split.
-  node *nd = insert_into_leaf_after_splitting(*root, leaf, key, pointer);
+// As fingerprint_search_sse(), thirty-two at a time.
+__attribute__((target("avx2"))) int fingerprint_search_avx2(const uint8_t *fingerprints, const tree_key *keys, int num_keys, tree_key key)
+{
+  __m256i f = _mm256_set1_epi8((char)key_fingerprint(key));
+  unsigned mask;
+  int i;
 
-  pthread_rwlock_unlock(&rwlock);
+  for (i = 0; i < num_keys; i += 32)
+  {
+    mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(f, _mm256_loadu_si256((const __m256i *)(fingerprints + i))));
+    if (num_keys - i < 32)
+      mask &= (1u << (num_keys - i)) - 1;
+    for (; mask != 0; mask &= mask - 1)
+      if (keys[i + __builtin_ctz(mask)] == key)
+        return i + __builtin_ctz(mask);
+  }
+  return num_keys;
+}
+#endif
 
-  return nd;
+/* Returns the position of key in a leaf, or num_keys if it
+ * is not present, going by the fingerprints if there are
+ * any. Optimistic readers pass the num_keys they read.
+ */
+int leaf_index(node *leaf, int num_keys, tree_key key)
+{
+#if LEAF_FINGERPRINTS
+  return fingerprint_search(node_fingerprints(leaf), leaf->keys, num_keys, key);
+#else
+  return key_index(leaf->keys, num_keys, key);
+#endif
 }
 
-// DELETION.
+// LATCHES
 
-/* Utility function for deletion.  Retrieves
- * the index of a node's nearest neighbor (sibling)
- * to the left if one exists.  If not (the node
- * is the leftmost child), returns -1 to signify
- * this special case.
+/* Takes a latch in shared mode. With TREE_STATS the latch
+ * is tried first, and the clock only read if that fails.
  */
-int get_neighbor_index(node *n)
+void latch_read(pthread_rwlock_t *latch)
 {
-  /* Return the index of the key to the left
-  * of the pointer in the parent pointing
-  * to n.
-  * If n is the leftmost child, this means
-  * return -1.
-  */
-  int i;
-  for (i = 0; i <= n->parent->num_keys; i++)
-    if (n->parent->pointers[i] == n)
-      return i - 1;
+#if TREE_STATS
+  uint64_t start;
 
-  // Error state.
-  printf("Search for nonexistent pointer to node in parent.\n");
-  printf("Node:  %#lx\n", (unsigned long)n);
-  exit(EXIT_FAILURE);
+  STAT_ADD(lock_acquisitions, 1);
+  if (pthread_rwlock_tryrdlock(latch) == 0)
+    return;
+  start = clock_nsec();
+  pthread_rwlock_rdlock(latch);
+  latch_waited(start);
+#else
+  pthread_rwlock_rdlock(latch);
+#endif
 }
 
-node *remove_entry_from_node(node *n, int key, node *pointer)
+// Takes a latch in exclusive mode, as latch_read() does in shared mode.
+void latch_write(pthread_rwlock_t *latch)
 {
-  int i = 0;
+#if TREE_STATS
+  uint64_t start;
 
-  // Remove the key and shift other keys accordingly.
-  while (n->keys[i] != key)
-    i++;
-  for (++i; i < n->num_keys; i++)
-    n->keys[i - 1] = n->keys[i];
+  STAT_ADD(lock_acquisitions, 1);
+  if (pthread_rwlock_trywrlock(latch) == 0)
+    return;
+  start = clock_nsec();
+  pthread_rwlock_wrlock(latch);
+  latch_waited(start);
+#else
+  pthread_rwlock_wrlock(latch);
+#endif
+}
 
-  // Remove the pointer and shift other pointers accordingly.
-  // First determine number of pointers.
-  int num_pointers = n->is_leaf ? n->num_keys : n->num_keys + 1;
-  i = 0;
-  while (n->pointers[i] != pointer)
-    i++;
-  for (++i; i < num_pointers; i++)
-    n->pointers[i - 1] = n->pointers[i];
+// Counts a wait for a latch or node that began at start.
+void latch_waited(uint64_t start)
+{
+#if TREE_STATS
+  thread_state *ts = get_thread_state();
 
-  // One key fewer.
-  n->num_keys--;
+  ts->stats.lock_waits++;
+  ts->stats.lock_wait_nsec += clock_nsec() - start;
+#else
+  (void)start;
+#endif
+}
 
-  // Set the other pointers to NULL for tidiness.
-  // A leaf uses the last pointer to point to the next leaf.
-  if (n->is_leaf)
-    for (i = n->num_keys; i < order - 1; i++)
-      n->pointers[i] = NULL;
-  else
-    for (i = n->num_keys + 1; i < order; i++)
-      n->pointers[i] = NULL;
+// NODE VERSIONS
 
-  return n;
+/* Waits for any writer to finish with the node and
+ * returns its version, to be checked with
+ * version_validate() once the node has been read.
+ */
+uint64_t version_read_begin(node *n)
+{
+  uint64_t version = __atomic_load_n(&n->version, __ATOMIC_ACQUIRE);
+#if TREE_STATS
+  uint64_t start;
+
+  if (!(version & VERSION_LOCKED))
+    return version;
+  start = clock_nsec();
+#endif
+  while (version & VERSION_LOCKED)
+  {
+    sched_yield();
+    version = __atomic_load_n(&n->version, __ATOMIC_ACQUIRE);
+  }
+#if TREE_STATS
+  latch_waited(start);
+#endif
+  return version;
 }
 
-node *adjust_root(node *root)
+/* Tells whether nothing has been written to the node
+ * since version_read_begin() returned the given version.
+ */
+bool version_validate(node *n, uint64_t version)
 {
-  node *new_root;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&n->version, __ATOMIC_RELAXED) == version;
+}
 
-  // Case: nonempty root.
-  // Key and pointer have already been deleted, nothing to be done.
-  if (root->num_keys > 0)
-    return root;
+void version_lock(node *n)
+{
+  uint64_t version, start = 0;
 
-  // If it has a child, promote the first (only) child as the new root.
-  if (!root->is_leaf)
+  STAT_ADD(lock_acquisitions, 1);
+  while (true)
   {
-    new_root = root->pointers[0];
-    new_root->parent = NULL;
+    version = __atomic_load_n(&n->version, __ATOMIC_RELAXED);
+    if (!(version & VERSION_LOCKED) &&
+        __atomic_compare_exchange_n(&n->version, &version, version + VERSION_LOCKED,
+                                    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+#if TREE_STATS
+    if (start == 0)
+      start = clock_nsec();
+#endif
+    sched_yield();
   }
-  // If it is a leaf (has no children) then the whole tree is empty.
-  else
-    new_root = NULL;
+  if (start != 0)
+    latch_waited(start);
+}
+
+/* Takes the lock on a node only if it is still at the
+ * version read earlier, i.e. what was read still holds.
+ */
+bool version_upgrade(node *n, uint64_t version)
+{
+  if (!__atomic_compare_exchange_n(&n->version, &version, version + VERSION_LOCKED,
+                                   false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return false;
+  STAT_ADD(lock_acquisitions, 1);
+  return true;
+}
+
+// Clears the lock bit and carries into the modification count.
+void version_unlock(node *n)
+{
+  __atomic_fetch_add(&n->version, VERSION_LOCKED, __ATOMIC_RELEASE);
+}
 
-  free(root->keys);
-  free(root->pointers);
-  free(root);
+// MEMORY
 
-  return new_root;
+void memory_init(void)
+{
+  node_pool.object_size = node_size();
+  record_pool.object_size = sizeof(record) > sizeof(void *) ? sizeof(record) : sizeof(void *);
+  placement_init();
 }
 
-/* Coalesces a node that has become
- * too small after deletion
- * with a neighboring node that
- * can accept the additional entries
- * without exceeding the maximum.
+/* Frees every slab. Only valid once no node or record is in
+ * use. Slabs in a tree file are left to tree_file_close().
  */
-node *coalesce_nodes(node *root, node *n, node *neighbor, int neighbor_index, int k_prime)
+void memory_release(void)
 {
-  int i, j, neighbor_insertion_index, n_end;
-  node *tmp;
+  long i;
+  thread_state *ts;
+  pool *pools[] = {&node_pool, &record_pool};
+  pool *p;
 
-  /* Swap neighbor with node if node is on the
-  * extreme left and neighbor is to its right.
-  */
-  if (neighbor_index == -1)
+  for (ts = thread_states; ts != NULL; ts = ts->next)
   {
-    tmp = n;
-    n = neighbor;
-    neighbor = tmp;
+    ts->nodes.free_list = ts->records.free_list = NULL;
+    ts->nodes.count = ts->records.count = 0;
   }
 
-  /* Starting point in the neighbor for copying
-  * keys and pointers from n.
-  * Recall that n and neighbor have swapped places
-  * in the special case of n being a leftmost child.
-  */
-  neighbor_insertion_index = neighbor->num_keys;
-
-  /* Case:  nonleaf node.
-  * Append k_prime and the following pointer.
-  * Append all pointers and keys from the neighbor.
-  */
-  if (!n->is_leaf)
+  for (i = 0; i < 2; i++)
   {
-    // Append k_prime.
-    neighbor->keys[neighbor_insertion_index] = k_prime;
-    neighbor->num_keys++;
-
-    n_end = n->num_keys;
-
-    for (i = neighbor_insertion_index + 1, j = 0; j < n_end; i++, j++)
+    p = pools[i];
+    while (p->num_slabs > 0)
     {
-      neighbor->keys[i] = n->keys[j];
-      neighbor->pointers[i] = n->pointers[j];
-      neighbor->num_keys++;
-      n->num_keys--;
+      p->num_slabs--;
+      if (tree_header == NULL)
+        free(p->slabs[p->num_slabs]);
     }
+    free(p->slabs);
+    p->slabs = NULL;
+    p->slabs_capacity = 0;
+    p->depot = NULL;
+    p->depot_count = 0;
+    p->reopened = 0;
+  }
+}
 
-    /* The number of pointers is always
-    * one more than the number of keys.
-    */
-    neighbor->pointers[i] = n->pointers[j];
+void *pool_alloc(pool *p, pool_cache *cache)
+{
+  void *object;
 
-    // All children must now point up to the same parent.
-    for (i = 0; i < neighbor->num_keys + 1; i++)
-    {
-      tmp = (node *)neighbor->pointers[i];
-      tmp->parent = neighbor;
-    }
-  }
-  /* In a leaf, append the keys and pointers of
-  * n to the neighbor.
-  * Set the neighbor's last pointer to point to
-  * what had been n's right neighbor.
-  */
-  else
-  {
-    for (i = neighbor_insertion_index, j = 0; j < n->num_keys; i++, j++)
-    {
-      neighbor->keys[i] = n->keys[j];
-      neighbor->pointers[i] = n->pointers[j];
-      neighbor->num_keys++;
-    }
+  if (cache->free_list == NULL)
+    pool_refill(p, cache);
 
-    neighbor->pointers[order - 1] = n->pointers[order - 1];
-  }
+  object = cache->free_list;
+  cache->free_list = *(void **)object;
+  cache->count--;
+  cache->allocated++;
+  return object;
+}
 
-  root = delete_entry(root, n->parent, k_prime, n);
-  free(n->keys);
-  free(n->pointers);
-  free(n);
-  return root;
+void pool_free(pool *p, pool_cache *cache, void *object)
+{
+  long i;
+  void *batch, *last;
+
+  *(void **)object = cache->free_list;
+  cache->free_list = object;
+  cache->count++;
+  cache->freed++;
+
+  if (cache->count < 2 * POOL_BATCH)
+    return;
+
+  // Hand a batch back to the depot.
+  batch = last = cache->free_list;
+  for (i = 1; i < POOL_BATCH; i++)
+    last = *(void **)last;
+  cache->free_list = *(void **)last;
+  cache->count -= POOL_BATCH;
+
+  pthread_mutex_lock(&p->lock);
+  *(void **)last = p->depot;
+  p->depot = batch;
+  p->depot_count += POOL_BATCH;
+  pthread_mutex_unlock(&p->lock);
 }
 
-/* Redistributes entries between two nodes when
- * one has become too small after deletion
- * but its neighbor is too big to append the
- * small node's entries without exceeding the
- * maximum
+/* Refills an empty per-thread free list, from the depot
+ * if other threads have handed objects back, and from a
+ * fresh slab otherwise.
  */
-node *redistribute_nodes(node *root, node *n, node *neighbor, int neighbor_index, int k_prime_index, int k_prime)
+void pool_refill(pool *p, pool_cache *cache)
 {
-  /* Case: n has a neighbor to the left.
-    * Pull the neighbor's last key-pointer pair over
-    * from the neighbor's right end to n's left end.
-    */
-  if (neighbor_index != -1)
+  long i, per_slab;
+  char *slab;
+  void *last;
+
+  pthread_mutex_lock(&p->lock);
+
+  if (p->depot != NULL)
   {
-    if (!n->is_leaf)
-      n->pointers[n->num_keys + 1] = n->pointers[n->num_keys];
+    cache->free_list = last = p->depot;
+    for (i = 1; i < POOL_BATCH && *(void **)last != NULL; i++)
+      last = *(void **)last;
+    p->depot = *(void **)last;
+    p->depot_count -= i;
+    *(void **)last = NULL;
+    cache->count += i;
+    pthread_mutex_unlock(&p->lock);
+    return;
+  }
 
-    int i;
-    for (i = n->num_keys; i > 0; i--)
-    {
-      n->keys[i] = n->keys[i - 1];
-      n->pointers[i] = n->pointers[i - 1];
-    }
+  // Page aligned, so that place_slab() can set its policy.
+  if (tree_header != NULL)
+    slab = tree_file_grow(p);
+  else if (posix_memalign((void **)&slab, sysconf(_SC_PAGESIZE), SLAB_BYTES) != 0)
+  {
+    perror("Slab creation.");
+    exit(EXIT_FAILURE);
+  }
+  pool_add_slab(p, slab);
 
-    if (!n->is_leaf)
-    {
-      n->pointers[0] = neighbor->pointers[neighbor->num_keys];
-      node *tmp = (node *)n->pointers[0];
-      tmp->parent = n;
-      neighbor->pointers[neighbor->num_keys] = NULL;
-      n->keys[0] = k_prime;
-      n->parent->keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
-    }
-    else
-    {
-      n->pointers[0] = neighbor->pointers[neighbor->num_keys - 1];
-      neighbor->pointers[neighbor->num_keys - 1] = NULL;
-      n->keys[0] = neighbor->keys[neighbor->num_keys - 1];
-      n->parent->keys[k_prime_index] = n->keys[0];
-    }
+  pthread_mutex_unlock(&p->lock);
+
+  // The page cache of a tree file is placed by the kernel.
+  if (tree_header == NULL)
+    place_slab(slab, SLAB_BYTES);
+  per_slab = SLAB_BYTES / p->object_size;
+  for (i = per_slab - 1; i >= 0; i--)
+  {
+    *(void **)(slab + i * p->object_size) = cache->free_list;
+    cache->free_list = slab + i * p->object_size;
   }
-  /* Case: n is the leftmost child.
-    * Take a key-pointer pair from the neighbor to the right.
-    * Move the neighbor's leftmost key-pointer pair
-    * to n's rightmost position.
-    */
-  else
+  cache->count += per_slab;
+}
+
+// Records a slab of the pool, whose lock is held unless no other thread runs.
+void pool_add_slab(pool *p, void *slab)
+{
+  if (p->num_slabs == p->slabs_capacity)
   {
-    if (n->is_leaf)
+    p->slabs_capacity = p->slabs_capacity ? 2 * p->slabs_capacity : 64;
+    p->slabs = realloc(p->slabs, p->slabs_capacity * sizeof(void *));
+    if (p->slabs == NULL)
     {
-      n->keys[n->num_keys] = neighbor->keys[0];
-      n->pointers[n->num_keys] = neighbor->pointers[0];
-      n->parent->keys[k_prime_index] = neighbor->keys[1];
-    }
-    else
-    {
-      n->keys[n->num_keys] = k_prime;
-      n->pointers[n->num_keys + 1] = neighbor->pointers[0];
-      node *tmp = (node *)n->pointers[n->num_keys + 1];
-      tmp->parent = n;
-      n->parent->keys[k_prime_index] = neighbor->keys[0];
+      perror("Slab array.");
+      exit(EXIT_FAILURE);
     }
+  }
+  p->slabs[p->num_slabs++] = slab;
+}
 
-    int i;
-    for (i = 0; i < neighbor->num_keys - 1; i++)
+void make_thread_state_key(void)
+{
+  pthread_key_create(&thread_state_key, release_thread_state);
+}
+
+/* Returns the calling thread's state, adopting one left
+ * behind by an exited thread or creating it on first use.
+ */
+thread_state *get_thread_state(void)
+{
+  thread_state *ts;
+  bool unused;
+
+  if (self != NULL)
+    return self;
+
+  pthread_once(&thread_state_once, make_thread_state_key);
+
+  for (ts = __atomic_load_n(&thread_states, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next)
+  {
+    unused = false;
+    if (__atomic_compare_exchange_n(&ts->in_use, &unused, true, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (ts == NULL)
+  {
+    ts = calloc(1, sizeof(thread_state));
+    if (ts == NULL)
     {
-      neighbor->keys[i] = neighbor->keys[i + 1];
-      neighbor->pointers[i] = neighbor->pointers[i + 1];
+      perror("Thread state creation.");
+      exit(EXIT_FAILURE);
     }
-    if (!n->is_leaf)
-      neighbor->pointers[i] = neighbor->pointers[i + 1];
+    pthread_mutex_init(&ts->log.lock, NULL);
+    ts->in_use = true;
+    ts->next = __atomic_load_n(&thread_states, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&thread_states, &ts->next, ts, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
   }
 
-  /* n now has one more key and one more pointer;
-  * the neighbor has one fewer of each.
-  */
+  self = ts;
+  pthread_setspecific(thread_state_key, ts);
+  return ts;
+}
 
-  n->num_keys++;
-  neighbor->num_keys--;
+// Runs at thread exit, leaving the state for the next thread to adopt.
+void release_thread_state(void *state)
+{
+  thread_state *ts = state;
 
-  return root;
+  __atomic_store_n(&ts->epoch, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&ts->in_use, false, __ATOMIC_RELEASE);
 }
 
-/* Deletes an entry from the B+ tree.
- * Removes the record and its key and pointer
- * from the leaf, and then makes all appropriate
- * changes to preserve the B+ tree properties.
+/* Announces that the calling thread may from now on hold
+ * pointers into the tree that a concurrent writer unlinks.
  */
-node *delete_entry(node *root, node *n, int key, void *pointer)
+void epoch_enter(void)
 {
-  int min_keys;
-  node *neighbor;
-  int neighbor_index;
-  int k_prime_index, k_prime;
-  int capacity;
-
-  // Remove key and pointer from node.
-  n = remove_entry_from_node(n, key, pointer);
+  thread_state *ts = get_thread_state();
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
 
-  // Case: deletion from the root.
-  if (n == root)
-    return adjust_root(root);
+  __atomic_store_n(&ts->epoch, (epoch << 1) | 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
 
-  /* Determine minimum allowable size of node,
-  * to be preserved after deletion.
-  */
-  min_keys = n->is_leaf ? cut(order - 1) : cut(order) - 1;
+void epoch_exit(void)
+{
+  __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+}
 
-  /* Case: node stays at or above minimum.
-  * (The simple case.)
-  */
-  if (n->num_keys >= min_keys)
-    return root;
+/* Moves the global epoch one step forward if every thread
+ * inside an operation has already seen the current one.
+ */
+bool epoch_try_advance(void)
+{
+  thread_state *ts;
+  uint64_t local, epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
 
-  /* Case: node falls below minimum.
-  * Either coalescence or redistribution is needed.
-  */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (ts = __atomic_load_n(&thread_states, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next)
+  {
+    local = __atomic_load_n(&ts->epoch, __ATOMIC_ACQUIRE);
+    if ((local & 1) && (local >> 1) != epoch)
+      return false;
+  }
 
-  /* Find the appropriate neighbor node with which
-  * to coalesce.
-  * Also find the key (k_prime) in the parent
-  * between the pointer to node n and the pointer
-  * to the neighbor.
-  */
-  neighbor_index = get_neighbor_index(n);
-  k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
-  k_prime = n->parent->keys[k_prime_index];
-  neighbor = neighbor_index == -1 ? n->parent->pointers[1] : n->parent->pointers[neighbor_index];
+  return __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
 
-  capacity = n->is_leaf ? order : order - 1;
+void free_object(retired_object *r)
+{
+  if (r->kind == OBJECT_NODE)
+    free_node(r->object);
+  else
+    free_record(r->object);
+}
 
-  if (neighbor->num_keys + n->num_keys < capacity)
-    return coalesce_nodes(root, n, neighbor, neighbor_index, k_prime);
+/* Frees the objects in the thread's limbo bags that no
+ * reader can reach any more, or all of them if the
+ * caller knows no other thread is running.
+ */
+void epoch_reclaim(thread_state *ts, bool all)
+{
+  int b;
+  long i;
+  limbo_bag *bag;
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
 
-  return redistribute_nodes(root, n, neighbor, neighbor_index, k_prime_index, k_prime);
+  for (b = 0; b < 3; b++)
+  {
+    bag = &ts->limbo[b];
+    if (bag->count == 0 || (!all && bag->epoch + 2 > epoch))
+      continue;
+
+    for (i = 0; i < bag->count; i++)
+      free_object(&bag->objects[i]);
+    ts->reclaimed += bag->count;
+    bag->count = 0;
+  }
 }
 
-// Master deletion function.
-node *delete (node *root, int key)
+/* Defers freeing an object that has been unlinked from the
+ * tree until every thread that might have seen it has left
+ * its operation.
+ */
+void epoch_retire(void *object, object_kind kind)
 {
-  pthread_rwlock_wrlock(&rwlock);
+  thread_state *ts = get_thread_state();
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+  limbo_bag *bag = &ts->limbo[epoch % 3];
+
+  // Whatever is left in the bag is from three or more epochs ago.
+  if (bag->epoch != epoch)
+  {
+    epoch_reclaim(ts, false);
+    bag->epoch = epoch;
+  }
+
+  if (bag->count == bag->capacity)
+  {
+    bag->capacity = bag->capacity ? 2 * bag->capacity : 256;
+    bag->objects = realloc(bag->objects, bag->capacity * sizeof(retired_object));
+    if (bag->objects == NULL)
+    {
+      perror("Limbo bag.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  bag->objects[bag->count].object = object;
+  bag->objects[bag->count].kind = kind;
+  bag->count++;
 
-  record *key_record = find(root, key, false);
-  node *key_leaf = find_leaf(root, key, false);
+  if (++ts->retired % EPOCH_ADVANCE_PERIOD == 0 && epoch_try_advance())
+    epoch_reclaim(ts, false);
+}
+
+void print_allocator_stats(void)
+{
+  long nodes = 0, nodes_freed = 0, records = 0, records_freed = 0;
+  long retired = 0, reclaimed = 0, states = 0;
+  thread_state *ts;
 
-  if (key_record != NULL && key_leaf != NULL)
+  for (ts = thread_states; ts != NULL; ts = ts->next)
   {
-    root = delete_entry(root, key_leaf, key, key_record);
-    free(key_record);
+    nodes += ts->nodes.allocated;
+    nodes_freed += ts->nodes.freed;
+    records += ts->records.allocated;
+    records_freed += ts->records.freed;
+    retired += ts->retired;
+    reclaimed += ts->reclaimed;
+    states++;
   }
 
-  pthread_rwlock_unlock(&rwlock);
+  fprintf(stderr, "Allocator: %ld nodes live (%ld allocated, %ld freed) in %ld slabs, "
+                  "%ld records live (%ld allocated, %ld freed) in %ld slabs\n",
+          node_pool.reopened + nodes - nodes_freed, nodes, nodes_freed, node_pool.num_slabs,
+          record_pool.reopened + records - records_freed, records, records_freed, record_pool.num_slabs);
+  fprintf(stderr, "Reclamation: epoch %lu, %ld retired, %ld reclaimed, %ld pending, %ld thread states\n",
+          (unsigned long)global_epoch, retired, reclaimed, retired - reclaimed, states);
+}
+
+/* Sums the counts of every thread into stats. Threads
+ * that are still running may be caught halfway through an
+ * operation, so the sums are only exact once they are done.
+ * Without TREE_STATS they are all zero.
+ */
+void get_tree_stats(tree_stats *stats)
+{
+  thread_state *ts;
+
+  memset(stats, 0, sizeof(tree_stats));
+#if TREE_STATS
+  for (ts = __atomic_load_n(&thread_states, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next)
+  {
+    stats->leaf_splits += ts->stats.leaf_splits;
+    stats->internal_splits += ts->stats.internal_splits;
+    stats->merges += ts->stats.merges;
+    stats->redistributions += ts->stats.redistributions;
+    stats->root_splits += ts->stats.root_splits;
+    stats->root_collapses += ts->stats.root_collapses;
+    stats->lock_acquisitions += ts->stats.lock_acquisitions;
+    stats->lock_waits += ts->stats.lock_waits;
+    stats->lock_wait_nsec += ts->stats.lock_wait_nsec;
+    stats->restarts += ts->stats.restarts;
+    stats->finger_hits += ts->stats.finger_hits;
+    stats->finger_misses += ts->stats.finger_misses;
+  }
+#else
+  (void)ts;
+#endif
+}
+
+// Zeroes the tree stats, e.g. once the tree is prefilled.
+void reset_structure_stats(void)
+{
+#if TREE_STATS
+  thread_state *ts;
+
+  for (ts = thread_states; ts != NULL; ts = ts->next)
+    memset(&ts->stats, 0, sizeof(tree_stats));
+#endif
+}
+
+void print_structure_stats(void)
+{
+  tree_stats stats;
+
+#if TREE_STATS
+  get_tree_stats(&stats);
+  fprintf(stderr, "Structure: %ld leaf splits, %ld internal splits, %ld merges, %ld redistributions, "
+                  "%ld root splits, %ld root collapses (merge below %d%% full)\n",
+          stats.leaf_splits, stats.internal_splits, stats.merges, stats.redistributions,
+          stats.root_splits, stats.root_collapses, merge_percent);
+  fprintf(stderr, "Contention: %ld locks taken, %ld waits for a locked node (%.1f msec in all), %ld optimistic restarts\n",
+          stats.lock_acquisitions, stats.lock_waits, stats.lock_wait_nsec / 1e6, stats.restarts);
+  if (finger_cache)
+    fprintf(stderr, "Finger cache: %ld hits, %ld misses (%.1f%% hit rate)\n",
+            stats.finger_hits, stats.finger_misses,
+            stats.finger_hits + stats.finger_misses ? 100.0 * stats.finger_hits / (stats.finger_hits + stats.finger_misses) : 0.0);
+#else
+  (void)stats;
+#endif
+}
+
+// TREE FILE
+
+/* Maps part of the tree file at its place in the reserved
+ * address range.
+ */
+void *tree_file_map(size_t offset, size_t size, int flags)
+{
+  void *at = (char *)TREE_FILE_BASE + offset;
+
+  if (mmap(at, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | flags, tree_file_fd, offset) != at)
+  {
+    perror("Tree file mapping");
+    exit(EXIT_FAILURE);
+  }
+  return at;
+}
+
+/* Opens the tree file at path, creating it if it does not
+ * exist, and from then on allocates nodes and records in it.
+ * A tree that is already in the file is only mapped, so it
+ * is ready at once and read from the page cache as it is
+ * used. The file is marked as in use until
+ * tree_file_close(), and one that was never closed (the
+ * program crashed, or is still running) is refused.
+ * Returns true if the file held a tree, which is put in root.
+ */
+bool tree_file_open(const char *path, node **root)
+{
+  struct stat st;
+  tree_file_header *h;
+  void *reserved;
+  pool *pools[] = {&node_pool, &record_pool};
+  uint64_t j;
+  int i;
+
+  tree_file_fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (tree_file_fd < 0 || fstat(tree_file_fd, &st) != 0)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  reserved = mmap((void *)TREE_FILE_BASE, TREE_FILE_RESERVE, PROT_NONE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+  if (reserved != (void *)TREE_FILE_BASE)
+  {
+    fprintf(stderr, "Tree file: address range at %p is not free\n", (void *)TREE_FILE_BASE);
+    exit(EXIT_FAILURE);
+  }
+
+  if (st.st_size == 0)
+  {
+    if (ftruncate(tree_file_fd, TREE_FILE_HEADER) != 0)
+    {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+    h = tree_file_map(0, TREE_FILE_HEADER, 0);
+    h->magic = TREE_FILE_MAGIC;
+    h->base = TREE_FILE_BASE;
+    h->order = ORDER;
+    h->key_bits = KEY_BITS;
+    h->inline_values = INLINE_VALUES;
+    h->leaf_fingerprints = LEAF_FINGERPRINTS;
+    h->node_size = node_size();
+    tree_header = h;
+    return false;
+  }
+
+  if (st.st_size < TREE_FILE_HEADER || (size_t)st.st_size > TREE_FILE_RESERVE)
+  {
+    fprintf(stderr, "%s: not a tree file\n", path);
+    exit(EXIT_FAILURE);
+  }
+  h = tree_file_map(0, st.st_size, 0);
+  if (h->magic != TREE_FILE_MAGIC || h->base != TREE_FILE_BASE ||
+      (size_t)st.st_size != TREE_FILE_HEADER + h->slabs * SLAB_BYTES)
+  {
+    fprintf(stderr, "%s: not a tree file\n", path);
+    exit(EXIT_FAILURE);
+  }
+  if (h->order != ORDER || h->key_bits != KEY_BITS || h->inline_values != INLINE_VALUES ||
+      h->leaf_fingerprints != LEAF_FINGERPRINTS || h->node_size != node_size())
+  {
+    fprintf(stderr, "%s: built with order %u, %u-bit keys, INLINE_VALUES=%u and LEAF_FINGERPRINTS=%u\n",
+            path, h->order, h->key_bits, h->inline_values, h->leaf_fingerprints);
+    exit(EXIT_FAILURE);
+  }
+  if (!h->clean)
+  {
+    fprintf(stderr, "%s: was not closed cleanly; remove it to start over\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  h->clean = 0;
+  if (msync(h, TREE_FILE_HEADER, MS_SYNC) != 0)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  for (j = 0; j < h->slabs; j++)
+    pool_add_slab(pools[(h->record_slabs[j / 64] >> (j % 64)) & 1], (char *)h + TREE_FILE_HEADER + j * SLAB_BYTES);
+  for (i = 0; i < 2; i++)
+  {
+    pools[i]->depot = h->depots[i];
+    pools[i]->depot_count = h->depot_counts[i];
+    // Every object in the file's slabs that is not free belongs to the tree.
+    pools[i]->reopened = pools[i]->num_slabs * (long)(SLAB_BYTES / pools[i]->object_size) - h->depot_counts[i];
+  }
+  tree_header = h;
+  *root = h->root;
+  return true;
+}
+
+/* Adds a slab for pool p to the end of the tree file and
+ * returns it.
+ */
+void *tree_file_grow(pool *p)
+{
+  size_t offset;
+  void *slab;
+
+  pthread_mutex_lock(&tree_file_lock);
+  offset = TREE_FILE_HEADER + tree_header->slabs * SLAB_BYTES;
+  if (offset + SLAB_BYTES > TREE_FILE_RESERVE)
+  {
+    fprintf(stderr, "Tree file: full\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ftruncate(tree_file_fd, offset + SLAB_BYTES) != 0)
+  {
+    perror("Tree file");
+    exit(EXIT_FAILURE);
+  }
+  slab = tree_file_map(offset, SLAB_BYTES, 0);
+  if (p == &record_pool)
+    tree_header->record_slabs[tree_header->slabs / 64] |= 1ULL << (tree_header->slabs % 64);
+  tree_header->slabs++;
+  pthread_mutex_unlock(&tree_file_lock);
+
+  return slab;
+}
+
+/* Moves every thread's free objects of a pool to its depot,
+ * and records the depot in the tree file header.
+ */
+void pool_flush(pool *p, int index)
+{
+  thread_state *ts;
+  pool_cache *cache;
+  void *last;
+
+  for (ts = thread_states; ts != NULL; ts = ts->next)
+  {
+    cache = p == &node_pool ? &ts->nodes : &ts->records;
+    if (cache->free_list == NULL)
+      continue;
+    for (last = cache->free_list; *(void **)last != NULL; last = *(void **)last)
+      ;
+    *(void **)last = p->depot;
+    p->depot = cache->free_list;
+    p->depot_count += cache->count;
+    cache->free_list = NULL;
+    cache->count = 0;
+  }
+
+  tree_header->depots[index] = p->depot;
+  tree_header->depot_counts[index] = p->depot_count;
+}
+
+/* Writes the tree and the allocator state back to the tree
+ * file, marks it as closed and unmaps it. No other thread
+ * may be using the tree.
+ */
+void tree_file_close(node *root)
+{
+  thread_state *ts;
+
+  // Whatever is retired can be freed, into the file's free lists.
+  global_epoch += 2;
+  for (ts = thread_states; ts != NULL; ts = ts->next)
+    epoch_reclaim(ts, true);
+  for (ts = thread_states; ts != NULL; ts = ts->next)
+    ts->finger = NULL;
+  rightmost_leaf = NULL;
+
+  pool_flush(&node_pool, 0);
+  pool_flush(&record_pool, 1);
+  tree_header->root = root;
+
+  // The header only says the file is closed once the rest is on disk.
+  if (msync(tree_header, TREE_FILE_HEADER + tree_header->slabs * SLAB_BYTES, MS_SYNC) != 0)
+  {
+    perror("Tree file");
+    exit(EXIT_FAILURE);
+  }
+  tree_header->clean = 1;
+  if (msync(tree_header, TREE_FILE_HEADER, MS_SYNC) != 0)
+  {
+    perror("Tree file");
+    exit(EXIT_FAILURE);
+  }
+
+  memory_release();
+  munmap(tree_header, TREE_FILE_RESERVE);
+  close(tree_file_fd);
+  tree_header = NULL;
+  tree_file_fd = -1;
+}
+
+// WRITE-AHEAD LOG
+
+// Hashes a log record, which tells a whole one from a torn or stale one.
+uint32_t log_check(const log_record *r)
+{
+  return (uint32_t)mix64(mix64(mix64(r->seq ^ r->op) ^ (uint64_t)r->key) ^ (uint64_t)r->value);
+}
+
+// Returns path with suffix appended, in new memory.
+char *log_name(const char *path, const char *suffix)
+{
+  char *name = malloc(strlen(path) + strlen(suffix) + 2); // Room for log_sync_dir().
+
+  if (name == NULL)
+  {
+    perror("Log");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(name, path);
+  strcat(name, suffix);
+  return name;
+}
+
+/* Flushes the directory that holds path, so that a file
+ * created or renamed there stays so after a crash.
+ */
+void log_sync_dir(const char *path)
+{
+  char *dir = log_name(path, "");
+  char *slash = strrchr(dir, '/');
+  int fd;
+
+  if (slash == NULL)
+    strcpy(dir, ".");
+  else if (slash == dir)
+    slash[1] = '\0';
+  else
+    *slash = '\0';
+
+  fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || fsync(fd) != 0)
+  {
+    perror(dir);
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  free(dir);
+}
+
+// Writes size bytes to the file at path, open as fd.
+void log_write_all(int fd, const void *data, size_t size, const char *path)
+{
+  ssize_t n;
+
+  while (size > 0)
+  {
+    n = write(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+    {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+    data = (const char *)data + n;
+    size -= n;
+  }
+}
+
+/* Creates an empty log at path, replacing any file there,
+ * and returns it open for appending with its header on disk.
+ */
+int log_create(const char *path)
+{
+  log_header header = {.magic = LOG_MAGIC, .key_bits = KEY_BITS, .record_size = sizeof(log_record)};
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+  if (fd < 0)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  log_write_all(fd, &header, sizeof(header), path);
+  if (fdatasync(fd) != 0)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+/* Reads a whole log or checkpoint file, whose items take
+ * item_size bytes each, and stores its header in *header
+ * and the number of whole items in *count. A file cut off
+ * within its header, as a crash right after creating it
+ * can leave one, holds no items.
+ * Returns the items, in memory to be freed, or NULL if
+ * there is no such file.
+ */
+void *log_read_file(const char *path, uint64_t magic, size_t item_size, log_header *header, long *count)
+{
+  struct stat st;
+  char *data;
+  size_t size = 0;
+  ssize_t n;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 && errno == ENOENT)
+    return NULL;
+  if (fd < 0 || fstat(fd, &st) != 0 || (data = malloc(st.st_size + 1)) == NULL)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  while (size < (size_t)st.st_size)
+  {
+    n = read(fd, data + size, st.st_size - size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+    {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+    size += n;
+  }
+  close(fd);
+
+  memset(header, 0, sizeof(log_header));
+  *count = 0;
+  if (size < sizeof(log_header))
+    return data;
+
+  memcpy(header, data, sizeof(log_header));
+  if (header->magic != magic)
+  {
+    fprintf(stderr, "%s: not a %s\n", path, magic == LOG_MAGIC ? "log" : "checkpoint");
+    exit(EXIT_FAILURE);
+  }
+  if (header->key_bits != KEY_BITS || header->record_size != item_size)
+  {
+    fprintf(stderr, "%s: written with %u-bit keys and %u-byte records\n", path, header->key_bits, header->record_size);
+    exit(EXIT_FAILURE);
+  }
+  *count = (size - sizeof(log_header)) / item_size;
+  memmove(data, data + sizeof(log_header), *count * item_size);
+  return data;
+}
+
+int compare_log_records(const void *a, const void *b)
+{
+  const log_record *x = a, *y = b;
+
+  if (x->key != y->key)
+    return (x->key > y->key) - (x->key < y->key);
+  return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* Rebuilds the tree that the write-ahead log at path left.
+ * Its checkpoint, path.ckpt, is bulk loaded with nodes
+ * filled to fill percent by up to num_threads threads. Then
+ * the last record of each key that is not in it is applied,
+ * from the log and from path.old, the log before a
+ * checkpoint that did not finish. A log is read up to its
+ * first torn record. Nothing is logged yet.
+ * Returns true if there was anything to recover.
+ */
+bool log_recover(const char *path, node **root, int fill, int num_threads)
+{
+  log_header header;
+  kv_pair *pairs;
+  log_record *records = NULL, *file;
+  long num_pairs = 0, num_records = 0, applied = 0, count, i;
+  uint64_t since = 0, start = clock_nsec();
+  const char *logs[2];
+  bool found = false;
+  int k;
+
+  log_path = log_name(path, "");
+  log_old_path = log_name(path, ".old");
+  checkpoint_path = log_name(path, ".ckpt");
+  checkpoint_tmp_path = log_name(path, ".ckpt.tmp");
+  logs[0] = log_old_path;
+  logs[1] = log_path;
+
+  pairs = log_read_file(checkpoint_path, CHECKPOINT_MAGIC, sizeof(kv_pair), &header, &num_pairs);
+  if (pairs != NULL)
+  {
+    if ((uint64_t)num_pairs != header.count)
+    {
+      fprintf(stderr, "%s: holds %ld of %lu keys\n", checkpoint_path, num_pairs, (unsigned long)header.count);
+      exit(EXIT_FAILURE);
+    }
+    found = true;
+    since = log_seq = header.seq;
+    *root = bulk_load(pairs, num_pairs, true, fill, num_threads);
+    free(pairs);
+  }
+
+  for (k = 0; k < 2; k++)
+  {
+    file = log_read_file(logs[k], LOG_MAGIC, sizeof(log_record), &header, &count);
+    if (file == NULL)
+      continue;
+    found = true;
+    records = realloc(records, (num_records + count + 1) * sizeof(log_record));
+    if (records == NULL)
+    {
+      perror("Recovery");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < count; i++)
+    {
+      if ((file[i].op != LOG_SET && file[i].op != LOG_DELETE) || file[i].check != log_check(&file[i]))
+        break;
+      if (file[i].seq >= log_seq)
+        log_seq = file[i].seq + 1;
+      if (file[i].seq >= since)
+        records[num_records++] = file[i];
+    }
+    free(file);
+  }
+
+  if (num_records > 0)
+    qsort(records, num_records, sizeof(log_record), compare_log_records);
+  for (i = 0; i < num_records; i++)
+  {
+    if (i + 1 < num_records && records[i + 1].key == records[i].key)
+      continue;
+    if (records[i].op == LOG_SET)
+      upsert(root, records[i].key, records[i].value);
+    else
+      delete (root, records[i].key);
+    applied++;
+  }
+  free(records);
+
+  if (found)
+    fprintf(stderr, "Recovered %ld keys from the checkpoint and %ld from %ld log records in %.2f msec\n",
+            num_pairs, applied, num_records, (clock_nsec() - start) / 1e6);
+  return found;
+}
+
+/* Writes every key in the tree to a new checkpoint, which
+ * replaces the last one once it is on disk. The tree may
+ * change meanwhile, so each key is read as it was at some
+ * point during the snapshot; recovery replays every change
+ * numbered from seq on over it, and seq must have been
+ * taken before the snapshot starts.
+ */
+void log_write_checkpoint(node **root, uint64_t seq)
+{
+  log_header header = {.magic = CHECKPOINT_MAGIC, .key_bits = KEY_BITS, .record_size = sizeof(kv_pair), .seq = seq};
+  tree_key keys[SCAN_BUFFER];
+  tree_value values[SCAN_BUFFER];
+  kv_pair pairs[SCAN_BUFFER];
+  cursor c;
+  int count, i;
+  int fd = open(checkpoint_tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0)
+  {
+    perror(checkpoint_tmp_path);
+    exit(EXIT_FAILURE);
+  }
+
+  // The header is written again once the count is known.
+  log_write_all(fd, &header, sizeof(header), checkpoint_tmp_path);
+  cursor_seek(&c, root, KEY_MIN);
+  while ((count = cursor_next_batch(&c, keys, values, SCAN_BUFFER)) > 0)
+  {
+    for (i = 0; i < count; i++)
+    {
+      pairs[i].key = keys[i];
+      pairs[i].value = values[i];
+    }
+    log_write_all(fd, pairs, count * sizeof(kv_pair), checkpoint_tmp_path);
+    header.count += count;
+  }
+
+  if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) != 0 || close(fd) != 0 ||
+      rename(checkpoint_tmp_path, checkpoint_path) != 0)
+  {
+    perror(checkpoint_tmp_path);
+    exit(EXIT_FAILURE);
+  }
+  log_sync_dir(checkpoint_path);
+}
+
+/* Checkpoints the tree as it is, empties the log, and logs
+ * every change from then on, starting the committer and,
+ * with checkpoint_sec set, the checkpointer.
+ */
+void log_start(node **root)
+{
+  int i;
+
+  for (i = 0; i < LOG_STRIPES; i++)
+    pthread_mutex_init(&log_stripes[i], NULL);
+
+  // Every record left in the logs is older than the checkpoint.
+  log_write_checkpoint(root, log_seq);
+  log_fd = log_create(log_path);
+  if (unlink(log_old_path) != 0 && errno != ENOENT)
+  {
+    perror(log_old_path);
+    exit(EXIT_FAILURE);
+  }
+  log_sync_dir(log_path);
+
+  log_active = true;
+  pthread_create(&log_committer, NULL, log_committer_thread, NULL);
+  if (checkpoint_sec > 0)
+    pthread_create(&log_checkpointer, NULL, log_checkpointer_thread, root);
+}
+
+/* Locks the stripe of a key for a change to it, so that
+ * its records are numbered in the order of the changes.
+ */
+pthread_mutex_t *log_lock_key(tree_key key)
+{
+  pthread_mutex_t *stripe = &log_stripes[mix64(key) % LOG_STRIPES];
+
+  pthread_mutex_lock(stripe);
+  return stripe;
+}
+
+/* Adds a record to the calling thread's log buffer, for the
+ * next commit to write. The key's stripe must be held.
+ * Returns how many records the thread has logged.
+ */
+uint64_t log_append(uint32_t op, tree_key key, tree_value value)
+{
+  log_buffer *b = &get_thread_state()->log;
+  log_record *r;
+  uint64_t appended;
+
+  pthread_mutex_lock(&b->lock);
+  if (b->count == b->capacity)
+  {
+    b->capacity = b->capacity > 0 ? 2 * b->capacity : LOG_BUFFER_RECORDS;
+    b->records = realloc(b->records, b->capacity * sizeof(log_record));
+    if (b->records == NULL)
+    {
+      perror("Log buffer");
+      exit(EXIT_FAILURE);
+    }
+  }
+  r = &b->records[b->count++];
+  r->op = op;
+  // Numbered under the buffer lock, see log_checkpoint().
+  r->seq = __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED);
+  r->key = key;
+  r->value = value;
+  r->check = log_check(r);
+  appended = ++b->appended;
+  pthread_mutex_unlock(&b->lock);
+
+  return appended;
+}
+
+/* Unlocks a key's stripe after a change. Under
+ * DURABILITY_SYNC it then waits for the commit of the
+ * calling thread's record number appended, unless that is 0
+ * because nothing changed.
+ */
+void log_release_key(pthread_mutex_t *stripe, uint64_t appended)
+{
+  log_buffer *b;
+
+  pthread_mutex_unlock(stripe);
+  if (appended == 0 || durability != DURABILITY_SYNC)
+    return;
+
+  b = &get_thread_state()->log;
+  pthread_mutex_lock(&commit_lock);
+  log_waiters++;
+  pthread_cond_signal(&commit_wake);
+  while (b->durable < appended)
+    pthread_cond_wait(&commit_done, &commit_lock);
+  log_waiters--;
+  pthread_mutex_unlock(&commit_lock);
+}
+
+// Applies a logged update, keeping the new value for its record.
+tree_value log_update_fn(tree_value value, void *arg)
+{
+  logged_update *u = arg;
+
+  return u->value = u->fn(value, u->arg);
+}
+
+// Appends count buffers to the log, in as few system calls as it takes.
+void log_writev(struct iovec *iov, long count)
+{
+  ssize_t n;
+
+  while (count > 0)
+  {
+    n = writev(log_fd, iov, count < IOV_MAX ? count : IOV_MAX);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+    {
+      perror(log_path);
+      exit(EXIT_FAILURE);
+    }
+    for (; count > 0 && (size_t)n >= iov->iov_len; count--, iov++)
+      n -= iov->iov_len;
+    if (count > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+/* Group commit: writes out what every thread logged since
+ * the last commit, and makes it durable with one fdatasync.
+ * Each buffer is swapped for its spare first, so threads go
+ * on logging meanwhile. The caller holds log_lock.
+ */
+void log_commit(void)
+{
+  thread_state *ts;
+  log_buffer *b;
+  log_record *full;
+  long num_iov = 0, records = 0, capacity;
+  uint64_t bytes = 0, start;
+
+  for (ts = __atomic_load_n(&thread_states, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next)
+  {
+    if (num_iov == log_iov_capacity)
+    {
+      log_iov_capacity = log_iov_capacity > 0 ? 2 * log_iov_capacity : 64;
+      log_iov = realloc(log_iov, log_iov_capacity * sizeof(struct iovec));
+      if (log_iov == NULL)
+      {
+        perror("Log commit");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    b = &ts->log;
+    pthread_mutex_lock(&b->lock);
+    full = b->records;
+    log_iov[num_iov].iov_base = full;
+    log_iov[num_iov].iov_len = b->count * sizeof(log_record);
+    records += b->count;
+    b->records = b->spare;
+    b->spare = full;
+    capacity = b->capacity;
+    b->capacity = b->spare_capacity;
+    b->spare_capacity = capacity;
+    b->count = 0;
+    b->committing = b->appended;
+    pthread_mutex_unlock(&b->lock);
+
+    bytes += log_iov[num_iov].iov_len;
+    if (log_iov[num_iov].iov_len > 0)
+      num_iov++;
+  }
+
+  if (records > 0)
+  {
+    log_writev(log_iov, num_iov);
+    start = clock_nsec();
+    if (fdatasync(log_fd) != 0)
+    {
+      perror(log_path);
+      exit(EXIT_FAILURE);
+    }
+    log_counts.sync_nsec += clock_nsec() - start;
+    log_counts.records += records;
+    log_counts.commits++;
+    log_counts.bytes += bytes;
+  }
+
+  pthread_mutex_lock(&commit_lock);
+  for (ts = __atomic_load_n(&thread_states, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next)
+    ts->log.durable = ts->log.committing;
+  pthread_cond_broadcast(&commit_done);
+  pthread_mutex_unlock(&commit_lock);
+}
+
+/* Commits every commit_usec microseconds until log_close()
+ * or, under DURABILITY_SYNC, commit_usec after a thread
+ * starts waiting, so that the threads that change keys
+ * meanwhile share the fdatasync.
+ */
+void *log_committer_thread(void *arg)
+{
+  struct timespec delay = {commit_usec / 1000000, commit_usec % 1000000 * 1000};
+
+  (void)arg;
+  pthread_mutex_lock(&commit_lock);
+  while (!log_stopping)
+  {
+    if (durability == DURABILITY_SYNC && log_waiters == 0)
+    {
+      pthread_cond_wait(&commit_wake, &commit_lock);
+      continue;
+    }
+    pthread_mutex_unlock(&commit_lock);
+
+    nanosleep(&delay, NULL);
+    pthread_mutex_lock(&log_lock);
+    log_commit();
+    pthread_mutex_unlock(&log_lock);
+
+    pthread_mutex_lock(&commit_lock);
+  }
+  pthread_mutex_unlock(&commit_lock);
+
+  return NULL;
+}
+
+/* Checkpoints the tree while it changes, and drops the log
+ * up to then. A new log is started first, and the last one
+ * kept as path.old until the checkpoint is on disk. Records
+ * are numbered under their buffer's lock, so every one
+ * numbered from the checkpoint's seq on goes to the new log.
+ */
+void log_checkpoint(node **root)
+{
+  uint64_t seq, start = clock_nsec();
+
+  pthread_mutex_lock(&log_lock);
+  log_commit();
+  if (close(log_fd) != 0 || rename(log_path, log_old_path) != 0)
+  {
+    perror(log_path);
+    exit(EXIT_FAILURE);
+  }
+  log_fd = log_create(log_path);
+  log_sync_dir(log_path);
+  seq = __atomic_load_n(&log_seq, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&log_lock);
+
+  log_write_checkpoint(root, seq);
+  if (unlink(log_old_path) != 0)
+  {
+    perror(log_old_path);
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&log_lock);
+  log_counts.checkpoints++;
+  log_counts.checkpoint_nsec += clock_nsec() - start;
+  pthread_mutex_unlock(&log_lock);
+}
+
+// Checkpoints every checkpoint_sec seconds until log_close().
+void *log_checkpointer_thread(void *arg)
+{
+  struct timespec deadline;
+
+  pthread_mutex_lock(&commit_lock);
+  while (!log_stopping)
+  {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += checkpoint_sec;
+    while (!log_stopping && pthread_cond_timedwait(&checkpoint_wake, &commit_lock, &deadline) != ETIMEDOUT)
+      ;
+    if (log_stopping)
+      break;
+    pthread_mutex_unlock(&commit_lock);
+
+    log_checkpoint(arg);
+
+    pthread_mutex_lock(&commit_lock);
+  }
+  pthread_mutex_unlock(&commit_lock);
+
+  return NULL;
+}
+
+/* Stops logging, after a last commit, and checkpoints the
+ * tree so that the next start has no log to replay. No
+ * other thread may be changing the tree.
+ */
+void log_close(node **root)
+{
+  thread_state *ts;
+
+  pthread_mutex_lock(&commit_lock);
+  log_stopping = true;
+  pthread_cond_broadcast(&commit_wake);
+  pthread_cond_broadcast(&checkpoint_wake);
+  pthread_mutex_unlock(&commit_lock);
+  pthread_join(log_committer, NULL);
+  if (checkpoint_sec > 0)
+    pthread_join(log_checkpointer, NULL);
+
+  pthread_mutex_lock(&log_lock);
+  log_commit();
+  pthread_mutex_unlock(&log_lock);
+  log_active = false;
+
+  log_write_checkpoint(root, log_seq);
+  close(log_fd);
+  close(log_create(log_path));
+  log_fd = -1;
+
+  for (ts = thread_states; ts != NULL; ts = ts->next)
+  {
+    free(ts->log.records);
+    free(ts->log.spare);
+    ts->log.records = ts->log.spare = NULL;
+    ts->log.capacity = ts->log.spare_capacity = 0;
+  }
+  free(log_iov);
+  free(log_path);
+  free(log_old_path);
+  free(checkpoint_path);
+  free(checkpoint_tmp_path);
+}
+
+// Prints what the write-ahead log wrote since it started.
+void print_log_stats(void)
+{
+  if (!log_active)
+    return;
+
+  pthread_mutex_lock(&log_lock);
+  fprintf(stderr, "Log: %s, %ld records in %ld commits (%.1f each), %.1f MiB, %.3f msec per fdatasync, "
+                  "%ld checkpoints in %.1f msec\n",
+          durability_names[durability], log_counts.records, log_counts.commits,
+          log_counts.commits > 0 ? (double)log_counts.records / log_counts.commits : 0,
+          log_counts.bytes / 1048576.0, log_counts.commits > 0 ? log_counts.sync_nsec / 1e6 / log_counts.commits : 0,
+          log_counts.checkpoints, log_counts.checkpoint_nsec / 1e6);
+  pthread_mutex_unlock(&log_lock);
+}
+
+// PLACEMENT
+
+/* Parses a list such as "0,2,4-7", as used on the command
+ * line and in sysfs, into at most max values.
+ * Returns the number of values, or -1 if the list is not
+ * valid or too long.
+ */
+int parse_list(const char *list, int values[], int max)
+{
+  int count = 0;
+  long first, last;
+  char *end;
+
+  while (*list != '\0' && *list != '\n')
+  {
+    first = last = strtol(list, &end, 10);
+    if (end == list || first < 0)
+      return -1;
+    if (*end == '-')
+    {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list || last < first)
+        return -1;
+    }
+    for (; first <= last; first++)
+    {
+      if (count == max)
+        return -1;
+      values[count++] = (int)first;
+    }
+
+    list = end;
+    if (*list == ',')
+      list++;
+    else if (*list != '\0' && *list != '\n')
+      return -1;
+  }
+  return count;
+}
+
+// Reads a number from a sysfs file, or returns fallback if there is none.
+int read_sysfs_int(const char *path, int fallback)
+{
+  FILE *file = fopen(path, "r");
+  int value;
+
+  if (file == NULL)
+    return fallback;
+  if (fscanf(file, "%d", &value) != 1)
+    value = fallback;
+  fclose(file);
+  return value;
+}
+
+int compare_cpu_places(const void *a, const void *b)
+{
+  const cpu_place *x = a, *y = b;
+  int i;
+
+  for (i = 0; i < 3; i++)
+    if (x->order[i] != y->order[i])
+      return x->order[i] < y->order[i] ? -1 : 1;
+  return x->cpu - y->cpu;
+}
+
+/* Fills affinity_cpus with the CPUs this process may run
+ * on, in the order the policy gives them out, or with the
+ * CPUs of list under AFFINITY_LIST. The topology comes from
+ * sysfs; a CPU it says nothing about is taken to be a core
+ * of its own on package 0.
+ */
+void affinity_init(int policy, const char *list)
+{
+  cpu_set_t allowed;
+  cpu_place *places, *p;
+  char path[128];
+  int i, j, n = 0;
+
+  affinity = policy;
+  if (policy == AFFINITY_NONE)
+    return;
+
+  affinity_cpus = malloc(CPU_SETSIZE * sizeof(int));
+  if (affinity_cpus == NULL)
+  {
+    perror("CPU affinity");
+    exit(EXIT_FAILURE);
+  }
+
+  if (policy == AFFINITY_LIST)
+  {
+    num_affinity_cpus = parse_list(list, affinity_cpus, CPU_SETSIZE);
+    for (i = 0; i < num_affinity_cpus; i++)
+      if (affinity_cpus[i] >= CPU_SETSIZE)
+        num_affinity_cpus = -1;
+    if (num_affinity_cpus <= 0)
+    {
+      fprintf(stderr, "Invalid CPU list: %s\n", list);
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+  {
+    perror("CPU affinity");
+    exit(EXIT_FAILURE);
+  }
+  places = malloc(CPU_COUNT(&allowed) * sizeof(cpu_place));
+  if (places == NULL)
+  {
+    perror("CPU affinity");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < CPU_SETSIZE; i++)
+  {
+    if (!CPU_ISSET(i, &allowed))
+      continue;
+
+    p = &places[n++];
+    p->cpu = i;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", i);
+    p->package = read_sysfs_int(path, 0);
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", i);
+    p->core = read_sysfs_int(path, i);
+    p->thread = 0;
+    for (j = 0; j < n - 1; j++)
+      if (places[j].package == p->package && places[j].core == p->core)
+        p->thread++;
+
+    switch (policy)
+    {
+    case AFFINITY_COMPACT:
+      p->order[0] = p->package, p->order[1] = p->core, p->order[2] = p->thread;
+      break;
+    case AFFINITY_SCATTER:
+      p->order[0] = p->thread, p->order[1] = p->core, p->order[2] = p->package;
+      break;
+    case AFFINITY_NOSMT:
+      p->order[0] = p->thread, p->order[1] = p->package, p->order[2] = p->core;
+      break;
+    }
+  }
+
+  qsort(places, n, sizeof(cpu_place), compare_cpu_places);
+  for (i = 0; i < n; i++)
+    affinity_cpus[i] = places[i].cpu;
+  num_affinity_cpus = n;
+  free(places);
+}
+
+void pin_thread(int cpu)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+  {
+    fprintf(stderr, "Cannot pin a thread to CPU %d\n", cpu);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Finds the NUMA nodes to interleave slabs over, if they
+ * are to be interleaved.
+ */
+void placement_init(void)
+{
+  char list[256];
+  int nodes[64];
+  int i, num_nodes = 0;
+  FILE *file;
+
+  if (node_placement != PLACE_INTERLEAVE)
+    return;
+
+  file = fopen("/sys/devices/system/node/has_memory", "r");
+  if (file == NULL)
+    file = fopen("/sys/devices/system/node/online", "r");
+  if (file != NULL)
+  {
+    if (fgets(list, sizeof(list), file) != NULL)
+      num_nodes = parse_list(list, nodes, 64);
+    fclose(file);
+  }
+
+  memory_nodes = 0;
+  for (i = 0; i < num_nodes; i++)
+    memory_nodes |= 1UL << nodes[i];
+  if (memory_nodes == 0)
+    memory_nodes = 1;
+}
+
+// Applies the NUMA policy to a new slab before anything touches it.
+void place_slab(void *slab, size_t size)
+{
+#ifdef __linux__
+  if (node_placement == PLACE_INTERLEAVE &&
+      syscall(SYS_mbind, slab, size, MPOL_INTERLEAVE, &memory_nodes, sizeof(memory_nodes) * 8 + 1, 0) != 0)
+  {
+    perror("Slab interleaving");
+    exit(EXIT_FAILURE);
+  }
+#else
+  (void)slab;
+  (void)size;
+#endif
+}
+
+// INSERTION
+/* Creates a new record to hold the value
+ * to which a key refers.
+ */
+record *make_record(tree_value value)
+{
+  record *new_record = pool_alloc(&record_pool, &get_thread_state()->records);
+
+  new_record->value = value;
+  return new_record;
+}
+
+// Bytes taken by the keys of a node, padded to pointer alignment.
+size_t node_keys_size(void)
+{
+  size_t keys_size = (order - 1) * sizeof(tree_key);
+  return (keys_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+/* Bytes taken by one node: the header, its keys, its
+ * pointers and its key fingerprints, rounded up to whole
+ * cache lines.
+ */
+size_t node_size(void)
+{
+  size_t size = sizeof(node) + node_keys_size() + order * sizeof(void *) + node_fingerprints_size();
+  return (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+}
+
+/* Creates a new general node, which can be adapted
+ * to serve as either a leaf or an internal node.
+ */
+node *make_node(void)
+{
+  node *new_node = pool_alloc(&node_pool, &get_thread_state()->nodes);
+
+  new_node->keys = (tree_key *)(new_node + 1);
+  new_node->pointers = (void **)((char *)new_node->keys + node_keys_size());
+
+  new_node->is_leaf = false;
+  new_node->num_keys = 0;
+  new_node->parent = NULL;
+  new_node->next = NULL;
+  new_node->right = NULL;
+  new_node->high_key = 0;
+  new_node->level = 0;
+  new_node->version = 0;
+  pthread_rwlock_init(&new_node->latch, NULL);
+  return new_node;
+}
+
+/* Creates a new leaf by creating a node
+ * and then adapting it appropriately.
+ */
+node *make_leaf(void)
+{
+  node *leaf = make_node();
+  leaf->is_leaf = true;
+  return leaf;
+}
+
+/* Helper function used in insert_into_parent
+ * to find the index of the parent's pointer to
+ * the node to the left of the key to be inserted.
+ */
+int get_left_index(node *parent, node *left)
+{
+  int left_index = 0;
+
+  while (left_index <= parent->num_keys && parent->pointers[left_index] != left)
+    left_index++;
+
+  return left_index;
+}
+
+/* Inserts a new pointer to a record and its corresponding
+ * key into a leaf.
+ * Returns the altered leaf.
+ */
+node *insert_into_leaf(node *leaf, tree_key key, void *pointer)
+{
+  int insertion_point = key_rank(leaf->keys, leaf->num_keys, key);
+
+  int i;
+  for (i = leaf->num_keys; i > insertion_point; i--)
+  {
+    leaf->keys[i] = leaf->keys[i - 1];
+    leaf->pointers[i] = leaf->pointers[i - 1];
+  }
+
+  leaf->keys[insertion_point] = key;
+  leaf->pointers[insertion_point] = pointer;
+  leaf->num_keys++;
+  fingerprint_insert(leaf, insertion_point);
+
+  return leaf;
+}
+
+/* Splits a full leaf in half while inserting a new
+ * key and pointer, and links the new leaf in to the right
+ * of the old one. A key that goes past the end of the leaf
+ * is taken to be one of a run of ascending keys; the old
+ * leaf is then left full and the new one starts with just
+ * that key, rather than both being left half empty.
+ * Returns the new leaf; its first key separates the two.
+ */
+node *split_leaf(node *leaf, tree_key key, void *pointer)
+{
+  node *new_leaf = make_leaf();
+
+  STAT_ADD(leaf_splits, 1);
+
+  tree_key temp_keys[ORDER];
+  void *temp_pointers[ORDER];
+
+  int insertion_index, split, i, j;
+
+  insertion_index = key_rank(leaf->keys, order - 1, key);
+
+  for (i = 0, j = 0; i < leaf->num_keys; i++, j++)
+  {
+    if (j == insertion_index)
+      j++;
+    temp_keys[j] = leaf->keys[i];
+    temp_pointers[j] = leaf->pointers[i];
+  }
+
+  temp_keys[insertion_index] = key;
+  temp_pointers[insertion_index] = pointer;
+
+  leaf->num_keys = 0;
+
+  split = insertion_index == order - 1 ? order - 1 : cut(order - 1);
+
+  for (i = 0; i < split; i++)
+  {
+    leaf->pointers[i] = temp_pointers[i];
+    leaf->keys[i] = temp_keys[i];
+    leaf->num_keys++;
+  }
+
+  for (i = split, j = 0; i < order; i++, j++)
+  {
+    new_leaf->pointers[j] = temp_pointers[i];
+    new_leaf->keys[j] = temp_keys[i];
+    new_leaf->num_keys++;
+  }
+
+  // The keys before the new one have not moved.
+  fingerprint_leaf(leaf, insertion_index);
+  fingerprint_leaf(new_leaf, 0);
+
+  new_leaf->pointers[order - 1] = leaf->pointers[order - 1];
+  leaf->pointers[order - 1] = new_leaf;
+
+  for (i = leaf->num_keys; i < order - 1; i++)
+    leaf->pointers[i] = NULL;
+
+  for (i = new_leaf->num_keys; i < order - 1; i++)
+    new_leaf->pointers[i] = NULL;
+
+  new_leaf->parent = leaf->parent;
+  new_leaf->right = leaf->right;
+  new_leaf->high_key = leaf->high_key;
+  leaf->right = new_leaf;
+  leaf->high_key = new_leaf->keys[0];
+  remember_rightmost(new_leaf);
+
+  return new_leaf;
+}
+
+/* Inserts a new key and pointer
+ * to a new record into a leaf so as to exceed
+ * the tree's order, causing the leaf to be split
+ * in half.
+ */
+node *insert_into_leaf_after_splitting(node *root, node *leaf, tree_key key, void *pointer)
+{
+  node *new_leaf = split_leaf(leaf, key, pointer);
+
+  return insert_into_parent(root, leaf, new_leaf->keys[0], new_leaf);
+}
+
+/* Inserts a new key and pointer to a node
+ * into a node into which these can fit
+ * without violating the B+ tree properties.
+ */
+node *insert_into_node(node *root, node *n, int left_index, tree_key key, node *right)
+{
+  int i;
+
+  for (i = n->num_keys; i > left_index; i--)
+  {
+    n->pointers[i + 1] = n->pointers[i];
+    n->keys[i] = n->keys[i - 1];
+  }
+
+  n->pointers[left_index + 1] = right;
+  n->keys[left_index] = key;
+  n->num_keys++;
+  return root;
+}
+
+/* Splits a full internal node in half while inserting
+ * a new key and pointer, and links the new node in to the
+ * right of the old one. As with leaves, a pointer appended
+ * past the end leaves the old node full instead.
+ * Returns the new node, and the key that separates the
+ * two halves in k_prime.
+ */
+node *split_internal(node *old_node, int left_index, tree_key key, node *right, tree_key *k_prime)
+{
+  /* First create a temporary set of keys and pointers
+  * to hold everything in order, including
+  * the new key and pointer, inserted in their
+  * correct places.
+  * Then create a new node and copy half of the
+  * keys and pointers to the old node and
+  * the other half to the new.
+  */
+
+  node *temp_pointers[ORDER + 1];
+  tree_key temp_keys[ORDER];
+
+  int i, j, split;
+
+  STAT_ADD(internal_splits, 1);
+
+  for (i = 0, j = 0; i < old_node->num_keys + 1; i++, j++)
+  {
+    if (j == left_index + 1)
+      j++;
+    temp_pointers[j] = old_node->pointers[i];
+  }
+
+  for (i = 0, j = 0; i < old_node->num_keys; i++, j++)
+  {
+    if (j == left_index)
+      j++;
+    temp_keys[j] = old_node->keys[i];
+  }
+
+  temp_pointers[left_index + 1] = right;
+  temp_keys[left_index] = key;
+
+  /* Create the new node and copy
+  * half the keys and pointers to the
+  * old and half to the new.
+  */
+  split = left_index == old_node->num_keys ? order - 1 : cut(order);
+
+  node *new_node = make_node();
+  old_node->num_keys = 0;
+
+  for (i = 0; i < split - 1; i++)
+  {
+    old_node->pointers[i] = temp_pointers[i];
+    old_node->keys[i] = temp_keys[i];
+    old_node->num_keys++;
+  }
+
+  old_node->pointers[i] = temp_pointers[i];
+  *k_prime = temp_keys[split - 1];
+  for (++i, j = 0; i < order; i++, j++)
+  {
+    new_node->pointers[j] = temp_pointers[i];
+    new_node->keys[j] = temp_keys[i];
+    new_node->num_keys++;
+  }
+
+  new_node->pointers[j] = temp_pointers[i];
+
+  node *child;
+  new_node->parent = old_node->parent;
+  new_node->level = old_node->level;
+  for (i = 0; i <= new_node->num_keys; i++)
+  {
+    child = new_node->pointers[i];
+    child->parent = new_node;
+  }
+
+  new_node->right = old_node->right;
+  new_node->high_key = old_node->high_key;
+  old_node->right = new_node;
+  old_node->high_key = *k_prime;
+
+  return new_node;
+}
+
+/* Inserts a new key and pointer to a node
+ * into a node, causing the node's size to exceed
+ * the order, and causing the node to split into two.
+ */
+node *insert_into_node_after_splitting(node *root, node *old_node, int left_index, tree_key key, node *right)
+{
+  tree_key k_prime;
+  node *new_node = split_internal(old_node, left_index, key, right, &k_prime);
+
+  /* Insert a new key into the parent of the two
+  * nodes resulting from the split, with
+  * the old node to the left and the new to the right.
+  */
+
+  return insert_into_parent(root, old_node, k_prime, new_node);
+}
+
+/* Inserts a new node (leaf or internal node) into the B+ tree.
+ * Returns the root of the tree after insertion.
+ */
+node *insert_into_parent(node *root, node *left, tree_key key, node *right)
+{
+  node *parent = left->parent;
+
+  // Case: new root
+  if (parent == NULL)
+    return insert_into_new_root(left, key, right);
+
+  // Case: leaf or node
+
+  // Find the parent's pointer to the left node.
+  int left_index = get_left_index(parent, left);
+
+  // Simple case: the new key fits into the node.
+  if (parent->num_keys < order - 1)
+    return insert_into_node(root, parent, left_index, key, right);
+
+  // Harder case:  split a node in order to preserve the B+ tree properties.
+  return insert_into_node_after_splitting(root, parent, left_index, key, right);
+}
+
+/* Creates a new root for two subtrees
+ * and inserts the appropriate key into
+ * the new root.
+ */
+node *insert_into_new_root(node *left, tree_key key, node *right)
+{
+  node *root = make_node();
+
+  STAT_ADD(root_splits, 1);
+  root->keys[0] = key;
+  root->pointers[0] = left;
+  root->pointers[1] = right;
+  root->num_keys++;
+  root->parent = NULL;
+  root->level = left->level + 1;
+  left->parent = root;
+  right->parent = root;
+  return root;
+}
+
+/* First insertion:
+ * start a new tree.
+ */
+node *start_new_tree(tree_key key, void *pointer)
+{
+  node *root = make_leaf();
+  root->keys[0] = key;
+  root->pointers[0] = pointer;
+  root->pointers[order - 1] = NULL;
+  root->parent = NULL;
+  root->num_keys++;
+  fingerprint_leaf(root, 0);
+  remember_rightmost(root);
+  return root;
+}
+
+/* Caches the leaf at the right end of the tree, so that
+ * insertions of ascending keys can go straight to it
+ * instead of descending from the root. The caller must
+ * hold the leaf exclusively.
+ */
+void remember_rightmost(node *leaf)
+{
+  if (leaf->right == NULL)
+    __atomic_store_n(&rightmost_leaf, leaf, __ATOMIC_RELEASE);
+}
+
+// Drops the cached rightmost leaf if it is being unlinked.
+void forget_rightmost(node *n)
+{
+  node *expected = n;
+
+  __atomic_compare_exchange_n(&rightmost_leaf, &expected, NULL, false,
+                              __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/* Returns the cached rightmost leaf if the key can be
+ * appended to it without a split, or NULL. The leaf is read
+ * under the global rwlock, which the caller holds, under its
+ * latch with lock coupling, giving up if a writer holds it,
+ * and otherwise optimistically against its version. The
+ * answer may be stale by the time the caller latches the
+ * leaf, so can_append() confirms it then.
+ * Must be called within an epoch, which keeps the leaf from
+ * being freed even if it is unlinked in the meantime.
+ */
+node *append_hint(tree_key key)
+{
+  int num_keys;
+  uint64_t version = 0;
+  bool fits;
+  node *leaf = __atomic_load_n(&rightmost_leaf, __ATOMIC_ACQUIRE);
+
+  if (leaf == NULL)
+    return NULL;
+
+  if (concurrency == CC_COUPLING)
+  {
+    if (pthread_rwlock_tryrdlock(&leaf->latch) != 0)
+      return NULL;
+    STAT_ADD(lock_acquisitions, 1);
+  }
+  else if (concurrency != CC_GLOBAL)
+    version = version_read_begin(leaf);
+
+  num_keys = leaf->num_keys;
+  fits = num_keys >= 1 && num_keys < order - 1 && key > leaf->keys[num_keys - 1];
+
+  if (concurrency == CC_COUPLING)
+    pthread_rwlock_unlock(&leaf->latch);
+  else if (concurrency != CC_GLOBAL && !version_validate(leaf, version))
+    return NULL;
+  return fits ? leaf : NULL;
+}
+
+/* Tells whether a key belongs at the end of a latched leaf
+ * that has room for it: the leaf must still be in the tree
+ * and the rightmost one, and the key above all of its keys.
+ */
+bool can_append(node *leaf, tree_key key)
+{
+  return !(leaf->version & VERSION_OBSOLETE) &&
+         leaf->right == NULL &&
+         leaf->num_keys > 0 &&
+         leaf->num_keys < order - 1 &&
+         key > leaf->keys[leaf->num_keys - 1];
+}
+
+/* Handles an insertion of a key that the leaf already
+ * holds at position i: stores its value in *existing unless
+ * that is NULL, and replaces it if overwrite is set. The
+ * caller must hold the leaf exclusively.
+ */
+void put_existing(node *leaf, int i, tree_value value, bool overwrite, tree_value *existing)
+{
+  if (existing != NULL)
+    *existing = slot_value(leaf->pointers[i]);
+  if (overwrite)
+    set_slot_value(leaf->pointers[i], value);
+}
+
+/* Insertion under lock coupling. Only the nodes that the
+ * insertion may split stay latched, along with the root
+ * pointer if the root itself may split.
+ */
+bool insert_coupled(node **root, tree_key key, tree_value value, bool overwrite, tree_value *existing)
+{
+  int i;
+  latch_path path;
+  node *leaf = append_hint(key);
+
+  // Case: an ascending key that fits in the rightmost leaf.
+  if (leaf != NULL)
+  {
+    latch_write(&leaf->latch);
+    if (can_append(leaf, key))
+    {
+      insert_into_leaf(leaf, key, make_slot(value));
+      pthread_rwlock_unlock(&leaf->latch);
+      return true;
+    }
+    pthread_rwlock_unlock(&leaf->latch);
+  }
+
+  leaf = find_leaf_exclusive(root, key, LATCH_INSERT, &path);
+
+  // Case: the tree does not exist yet.
+  if (leaf == NULL)
+  {
+    *root = start_new_tree(key, make_slot(value));
+    release_path(&path);
+    return true;
+  }
+
+  // Case: the key is already present.
+  i = leaf_index(leaf, leaf->num_keys, key);
+  if (i < leaf->num_keys)
+  {
+    put_existing(leaf, i, value, overwrite, existing);
+    release_path(&path);
+    return false;
+  }
+
+  void *pointer = make_slot(value);
+
+  if (leaf->num_keys < order - 1)
+    insert_into_leaf(leaf, key, pointer);
+  else
+  {
+    node *new_root = insert_into_leaf_after_splitting(path.root_latched ? *root : NULL,
+                                                      leaf, key, pointer);
+    if (path.root_latched)
+      *root = new_root;
+  }
+
+  release_path(&path);
+  return true;
+}
+
+/* Insertion under the global rwlock, with a single
+ * descent to the leaf.
+ */
+bool insert_global(node **root, tree_key key, tree_value value, bool overwrite, tree_value *existing)
+{
+  int i;
+
+  latch_write(&rwlock);
+
+  // Case: the tree does not exist yet.
+  if (*root == NULL)
+  {
+    *root = start_new_tree(key, make_slot(value));
+    pthread_rwlock_unlock(&rwlock);
+    return true;
+  }
+
+  // An ascending key goes straight to the rightmost leaf.
+  node *leaf = append_hint(key);
+  if (leaf == NULL || !can_append(leaf, key))
+    leaf = find_leaf(*root, key, false);
+
+  // Case: the key is already present.
+  i = leaf_index(leaf, leaf->num_keys, key);
+  if (i < leaf->num_keys)
+  {
+    put_existing(leaf, i, value, overwrite, existing);
+    pthread_rwlock_unlock(&rwlock);
+    return false;
+  }
+
+  // Create the leaf slot for the value.
+  void *pointer = make_slot(value);
+
+  // Case: leaf has room for key and pointer.
+  if (leaf->num_keys < order - 1)
+  {
+    leaf = insert_into_leaf(leaf, key, pointer);
+    pthread_rwlock_unlock(&rwlock);
+    return true;
+  }
+
+  // Case: leaf must be split.
+  *root = insert_into_leaf_after_splitting(*root, leaf, key, pointer);
+
+  pthread_rwlock_unlock(&rwlock);
+
+  return true;
+}
+
+/* Master insertion function.
+ * Inserts a key and an associated value into
+ * the B+ tree, causing the tree to be adjusted
+ * however necessary to maintain the B+ tree
+ * properties, and publishes the new root.
+ * If the key is already present its value is stored
+ * in *existing, unless that is NULL, and replaced
+ * with the new one if overwrite is set. A change is
+ * logged while the write-ahead log is active.
+ * Returns false if the key was already present.
+ */
+bool put(node **root, tree_key key, tree_value value, bool overwrite, tree_value *existing)
+{
+  bool inserted;
+  pthread_mutex_t *stripe = log_active ? log_lock_key(key) : NULL;
+
+  epoch_enter();
+  if (!finger_cache || !finger_put(key, value, overwrite, existing, &inserted))
+  {
+    switch (concurrency)
+    {
+    case CC_COUPLING:
+      inserted = insert_coupled(root, key, value, overwrite, existing);
+      break;
+    case CC_BLINK:
+      inserted = blink_insert(root, key, value, overwrite, existing);
+      break;
+    case CC_OLC:
+      inserted = olc_insert(root, key, value, overwrite, existing);
+      break;
+    default:
+      inserted = insert_global(root, key, value, overwrite, existing);
+    }
+  }
+  epoch_exit();
+
+  if (stripe != NULL)
+    log_release_key(stripe, inserted || overwrite ? log_append(LOG_SET, key, value) : 0);
+  return inserted;
+}
+
+// Inserts a key unless it is already present.
+bool insert(node **root, tree_key key, tree_value value)
+{
+  return put(root, key, value, false, NULL);
+}
+
+/* Inserts a key, or replaces its value if it is already
+ * present. Returns true if the key was inserted.
+ */
+bool upsert(node **root, tree_key key, tree_value value)
+{
+  return put(root, key, value, true, NULL);
+}
+
+/* Inserts a key unless it is already present, in which
+ * case its value is stored in *existing.
+ * Returns true if the key was inserted.
+ */
+bool insert_or_get(node **root, tree_key key, tree_value value, tree_value *existing)
+{
+  return put(root, key, value, false, existing);
+}
+
+// Update under lock coupling; only the leaf stays latched.
+bool update_coupled(node **root, tree_key key, update_fn fn, void *arg)
+{
+  int i;
+  latch_path path;
+  node *leaf = find_leaf_exclusive(root, key, LATCH_UPDATE, &path);
+  bool found = false;
+
+  if (leaf != NULL)
+  {
+    i = leaf_index(leaf, leaf->num_keys, key);
+    found = i < leaf->num_keys;
+    if (found)
+      set_slot_value(leaf->pointers[i], fn(slot_value(leaf->pointers[i]), arg));
+  }
+
+  release_path(&path);
+  return found;
+}
+
+// Update under the global rwlock.
+bool update_global(node **root, tree_key key, update_fn fn, void *arg)
+{
+  int i;
+  node *leaf;
+  bool found = false;
+
+  latch_write(&rwlock);
+  leaf = find_leaf(*root, key, false);
+  if (leaf != NULL)
+  {
+    i = leaf_index(leaf, leaf->num_keys, key);
+    found = i < leaf->num_keys;
+    if (found)
+      set_slot_value(leaf->pointers[i], fn(slot_value(leaf->pointers[i]), arg));
+  }
+  pthread_rwlock_unlock(&rwlock);
+
+  return found;
+}
+
+/* Replaces the value of a key with fn(value, arg), in
+ * place and while the leaf is held exclusively, so that
+ * concurrent updates of the same key are not lost. fn
+ * must not use the tree.
+ * Returns false if the key is not present.
+ */
+bool update(node **root, tree_key key, update_fn fn, void *arg)
+{
+  bool found;
+  logged_update logged = {fn, arg, 0};
+  pthread_mutex_t *stripe = NULL;
+
+  if (log_active)
+  {
+    stripe = log_lock_key(key);
+    fn = log_update_fn;
+    arg = &logged;
+  }
+
+  epoch_enter();
+  switch (concurrency)
+  {
+  case CC_COUPLING:
+    found = update_coupled(root, key, fn, arg);
+    break;
+  case CC_BLINK:
+    found = blink_update(root, key, fn, arg);
+    break;
+  case CC_OLC:
+    found = olc_update(root, key, fn, arg);
+    break;
+  default:
+    found = update_global(root, key, fn, arg);
+  }
+  epoch_exit();
+
+  if (stripe != NULL)
+    log_release_key(stripe, found ? log_append(LOG_SET, key, logged.value) : 0);
+  return found;
+}
+
+// DELETION.
+
+/* Utility function for deletion.  Retrieves
+ * the index of a node's nearest neighbor (sibling)
+ * to the left if one exists.  If not (the node
+ * is the leftmost child), returns -1 to signify
+ * this special case.
+ */
+int get_neighbor_index(node *n)
+{
+  /* Return the index of the key to the left
+  * of the pointer in the parent pointing
+  * to n.
+  * If n is the leftmost child, this means
+  * return -1.
+  */
+  int i;
+  for (i = 0; i <= n->parent->num_keys; i++)
+    if (n->parent->pointers[i] == n)
+      return i - 1;
+
+  // Error state.
+  printf("Search for nonexistent pointer to node in parent.\n");
+  printf("Node:  %#lx\n", (unsigned long)n);
+  exit(EXIT_FAILURE);
+}
+
+node *remove_entry_from_node(node *n, tree_key key, node *pointer)
+{
+  int i, key_position;
+
+  // Remove the key and shift other keys accordingly.
+  i = key_position = n->is_leaf ? leaf_index(n, n->num_keys, key)
+                                : key_rank(n->keys, n->num_keys, key);
+  for (++i; i < n->num_keys; i++)
+    n->keys[i - 1] = n->keys[i];
+
+  // Remove the pointer and shift other pointers accordingly.
+  // First determine number of pointers.
+  // A leaf's value sits next to its key, and need not be
+  // different from the values of other keys.
+  int num_pointers = n->is_leaf ? n->num_keys : n->num_keys + 1;
+  i = 0;
+  if (n->is_leaf)
+    i = key_position;
+  else
+    while (n->pointers[i] != pointer)
+      i++;
+  for (++i; i < num_pointers; i++)
+    n->pointers[i - 1] = n->pointers[i];
+
+  // One key fewer.
+  n->num_keys--;
+  if (n->is_leaf)
+    fingerprint_remove(n, key_position);
+
+  // Set the other pointers to NULL for tidiness.
+  // A leaf uses the last pointer to point to the next leaf.
+  if (n->is_leaf)
+    for (i = n->num_keys; i < order - 1; i++)
+      n->pointers[i] = NULL;
+  else
+    for (i = n->num_keys + 1; i < order; i++)
+      n->pointers[i] = NULL;
+
+  return n;
+}
+
+node *adjust_root(node *root)
+{
+  node *new_root;
+
+  // Case: nonempty root.
+  // Key and pointer have already been deleted, nothing to be done.
+  if (root->num_keys > 0)
+    return root;
+
+  STAT_ADD(root_collapses, 1);
+
+  // If it has a child, promote the first (only) child as the new root.
+  if (!root->is_leaf)
+  {
+    new_root = root->pointers[0];
+    new_root->parent = NULL;
+  }
+  // If it is a leaf (has no children) then the whole tree is empty.
+  else
+    new_root = NULL;
+
+  retire_node(root);
+
+  return new_root;
+}
+
+/* Coalesces a node that has become
+ * too small after deletion
+ * with a neighboring node that
+ * can accept the additional entries
+ * without exceeding the maximum.
+ */
+node *coalesce_nodes(node *root, node *n, node *neighbor, int neighbor_index, tree_key k_prime)
+{
+  int i, j, neighbor_insertion_index, n_end;
+  node *tmp;
+
+  STAT_ADD(merges, 1);
+
+  /* Swap neighbor with node if node is on the
+  * extreme left and neighbor is to its right.
+  */
+  if (neighbor_index == -1)
+  {
+    tmp = n;
+    n = neighbor;
+    neighbor = tmp;
+  }
+
+  /* Starting point in the neighbor for copying
+  * keys and pointers from n.
+  * Recall that n and neighbor have swapped places
+  * in the special case of n being a leftmost child.
+  */
+  neighbor_insertion_index = neighbor->num_keys;
+
+  /* Case:  nonleaf node.
+  * Append k_prime and the following pointer.
+  * Append all pointers and keys from the neighbor.
+  */
+  if (!n->is_leaf)
+  {
+    // Append k_prime.
+    neighbor->keys[neighbor_insertion_index] = k_prime;
+    neighbor->num_keys++;
+
+    n_end = n->num_keys;
+
+    for (i = neighbor_insertion_index + 1, j = 0; j < n_end; i++, j++)
+    {
+      neighbor->keys[i] = n->keys[j];
+      neighbor->pointers[i] = n->pointers[j];
+      neighbor->num_keys++;
+      n->num_keys--;
+    }
+
+    /* The number of pointers is always
+    * one more than the number of keys.
+    */
+    neighbor->pointers[i] = n->pointers[j];
+
+    // All children must now point up to the same parent.
+    for (i = 0; i < neighbor->num_keys + 1; i++)
+    {
+      tmp = (node *)neighbor->pointers[i];
+      tmp->parent = neighbor;
+    }
+  }
+  /* In a leaf, append the keys and pointers of
+  * n to the neighbor.
+  * Set the neighbor's last pointer to point to
+  * what had been n's right neighbor.
+  */
+  else
+  {
+    for (i = neighbor_insertion_index, j = 0; j < n->num_keys; i++, j++)
+    {
+      neighbor->keys[i] = n->keys[j];
+      neighbor->pointers[i] = n->pointers[j];
+      neighbor->num_keys++;
+    }
+    fingerprint_leaf(neighbor, neighbor_insertion_index);
+
+    neighbor->pointers[order - 1] = n->pointers[order - 1];
+  }
+
+  // The neighbor takes over the key range of n.
+  neighbor->right = n->right;
+  neighbor->high_key = n->high_key;
+  if (neighbor->is_leaf)
+    remember_rightmost(neighbor);
+
+  root = delete_entry(root, n->parent, k_prime, n);
+  retire_node(n);
+  return root;
+}
+
+/* Redistributes entries between two nodes when
+ * one has become too small after deletion
+ * but its neighbor is too big to append the
+ * small node's entries without exceeding the
+ * maximum
+ */
+node *redistribute_nodes(node *root, node *n, node *neighbor, int neighbor_index, int k_prime_index, tree_key k_prime)
+{
+  STAT_ADD(redistributions, 1);
+
+  /* Case: n has a neighbor to the left.
+    * Pull the neighbor's last key-pointer pair over
+    * from the neighbor's right end to n's left end.
+    */
+  if (neighbor_index != -1)
+  {
+    if (!n->is_leaf)
+      n->pointers[n->num_keys + 1] = n->pointers[n->num_keys];
+
+    int i;
+    for (i = n->num_keys; i > 0; i--)
+    {
+      n->keys[i] = n->keys[i - 1];
+      n->pointers[i] = n->pointers[i - 1];
+    }
+
+    if (!n->is_leaf)
+    {
+      n->pointers[0] = neighbor->pointers[neighbor->num_keys];
+      node *tmp = (node *)n->pointers[0];
+      tmp->parent = n;
+      neighbor->pointers[neighbor->num_keys] = NULL;
+      n->keys[0] = k_prime;
+      n->parent->keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
+    }
+    else
+    {
+      n->pointers[0] = neighbor->pointers[neighbor->num_keys - 1];
+      neighbor->pointers[neighbor->num_keys - 1] = NULL;
+      n->keys[0] = neighbor->keys[neighbor->num_keys - 1];
+      n->parent->keys[k_prime_index] = n->keys[0];
+    }
+  }
+  /* Case: n is the leftmost child.
+    * Take a key-pointer pair from the neighbor to the right.
+    * Move the neighbor's leftmost key-pointer pair
+    * to n's rightmost position.
+    */
+  else
+  {
+    if (n->is_leaf)
+    {
+      n->keys[n->num_keys] = neighbor->keys[0];
+      n->pointers[n->num_keys] = neighbor->pointers[0];
+      n->parent->keys[k_prime_index] = neighbor->keys[1];
+    }
+    else
+    {
+      n->keys[n->num_keys] = k_prime;
+      n->pointers[n->num_keys + 1] = neighbor->pointers[0];
+      node *tmp = (node *)n->pointers[n->num_keys + 1];
+      tmp->parent = n;
+      n->parent->keys[k_prime_index] = neighbor->keys[0];
+    }
+
+    int i;
+    for (i = 0; i < neighbor->num_keys - 1; i++)
+    {
+      neighbor->keys[i] = neighbor->keys[i + 1];
+      neighbor->pointers[i] = neighbor->pointers[i + 1];
+    }
+    if (!n->is_leaf)
+      neighbor->pointers[i] = neighbor->pointers[i + 1];
+  }
+
+  /* n now has one more key and one more pointer;
+  * the neighbor has one fewer of each.
+  * The left one of the pair ends at the new separator.
+  */
+  if (neighbor_index != -1)
+    neighbor->high_key = n->parent->keys[k_prime_index];
+  else
+    n->high_key = n->parent->keys[k_prime_index];
+
+  n->num_keys++;
+  neighbor->num_keys--;
+  if (n->is_leaf)
+  {
+    fingerprint_leaf(n, 0);
+    fingerprint_leaf(neighbor, 0);
+  }
+
+  return root;
+}
+
+/* Deletes an entry from the B+ tree.
+ * Removes the record and its key and pointer
+ * from the leaf, and then makes all appropriate
+ * changes to preserve the B+ tree properties.
+ */
+node *delete_entry(node *root, node *n, tree_key key, void *pointer)
+{
+  node *neighbor;
+  int neighbor_index;
+  int k_prime_index;
+  tree_key k_prime;
+  int capacity;
+
+  // Remove key and pointer from node.
+  n = remove_entry_from_node(n, key, pointer);
+
+  // Case: deletion from the root.
+  if (n->parent == NULL)
+    return adjust_root(n);
+
+  /* Case: node stays at or above minimum.
+  * (The simple case.)
+  */
+  if (n->num_keys >= min_node_keys(n))
+    return root;
+
+  /* Case: node falls below minimum.
+  * Either coalescence or redistribution is needed.
+  */
+
+  /* Find the appropriate neighbor node with which
+  * to coalesce.
+  * Also find the key (k_prime) in the parent
+  * between the pointer to node n and the pointer
+  * to the neighbor.
+  */
+  neighbor_index = get_neighbor_index(n);
+  k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
+  k_prime = n->parent->keys[k_prime_index];
+  neighbor = neighbor_index == -1 ? n->parent->pointers[1] : n->parent->pointers[neighbor_index];
+  latch_neighbor(neighbor);
+
+  capacity = n->is_leaf ? order : order - 1;
+
+  if (neighbor->num_keys + n->num_keys < capacity)
+    return coalesce_nodes(root, n, neighbor, neighbor_index, k_prime);
+
+  return redistribute_nodes(root, n, neighbor, neighbor_index, k_prime_index, k_prime);
+}
+
+/* Deletion under lock coupling. Neighbors borrowed from
+ * or merged with are latched through the current path, and
+ * merged nodes are freed only after it has been released.
+ */
+bool delete_coupled(node **root, tree_key key)
+{
+  int i;
+  latch_path path;
+  node *leaf = find_leaf_exclusive(root, key, LATCH_DELETE, &path);
+
+  if (leaf == NULL)
+  {
+    release_path(&path);
+    return false;
+  }
+
+  i = leaf_index(leaf, leaf->num_keys, key);
+  if (i == leaf->num_keys)
+  {
+    release_path(&path);
+    return false;
+  }
+
+  void *key_slot = leaf->pointers[i];
+
+  current_path = &path;
+  node *new_root = delete_entry(path.root_latched ? *root : NULL, leaf, key, key_slot);
+  current_path = NULL;
+
+  if (path.root_latched)
+    *root = new_root;
+
+  release_path(&path);
+  free_slot(key_slot);
+
+  return true;
+}
+
+// Deletion under the global rwlock.
+bool delete_global(node **root, tree_key key)
+{
+  latch_write(&rwlock);
+
+  void *key_slot;
+  node *key_leaf = find_leaf(*root, key, false);
+  bool found = false;
+  int i;
+
+  if (key_leaf != NULL)
+  {
+    i = leaf_index(key_leaf, key_leaf->num_keys, key);
+    found = i < key_leaf->num_keys;
+  }
+
+  if (found)
+  {
+    key_slot = key_leaf->pointers[i];
+    *root = delete_entry(*root, key_leaf, key, key_slot);
+    free_slot(key_slot);
+  }
+
+  pthread_rwlock_unlock(&rwlock);
+
+  return found;
+}
+
+/* Master deletion function.
+ * Publishes the new root, logs the deletion while the
+ * write-ahead log is active, and returns false if the key
+ * was not present.
+ */
+bool delete (node **root, tree_key key)
+{
+  bool deleted;
+  pthread_mutex_t *stripe = log_active ? log_lock_key(key) : NULL;
+
+  epoch_enter();
+  if (!finger_cache || !finger_delete(root, key, &deleted))
+  {
+    switch (concurrency)
+    {
+    case CC_COUPLING:
+      deleted = delete_coupled(root, key);
+      break;
+    case CC_BLINK:
+      deleted = blink_delete(root, key);
+      break;
+    case CC_OLC:
+      deleted = olc_delete(root, key);
+      break;
+    default:
+      deleted = delete_global(root, key);
+    }
+  }
+  epoch_exit();
+
+  if (stripe != NULL)
+    log_release_key(stripe, deleted ? log_append(LOG_DELETE, key, 0) : 0);
+  return deleted;
+}
+
+// B-LINK TREE
+
+/* Moves right from a locked node until reaching the one
+ * whose key range holds the key, locking at most two nodes
+ * at a time.
+ * Returns the node that holds the key range, locked.
+ */
+node *blink_move_right(node *n, tree_key key)
+{
+  node *right;
+
+  while (n->right != NULL && key >= n->high_key)
+  {
+    right = n->right;
+    version_lock(right);
+    version_unlock(n);
+    n = right;
+  }
+
+  return n;
+}
+
+/* Descends without taking any locks to the node on the
+ * given level (0 for the leaves) whose key range holds
+ * the key. A node that changes while being read is read
+ * again, and concurrent splits are recovered from by
+ * following right links.
+ * If stack is set, the rightmost node visited on each
+ * level above the target is recorded there, root first.
+ */
+node *blink_find_leaf(node *root, tree_key key, node *stack[], int *depth, int level)
+{
+  int i, num_keys;
+  uint64_t version;
+  node *c = root, *next;
+
+  if (depth != NULL)
+    *depth = 0;
+
+  while (c != NULL)
+  {
+    version = version_read_begin(c);
+
+    if (c->right != NULL && key >= c->high_key)
+    {
+      next = c->right;
+      if (version_validate(c, version))
+        c = next;
+      continue;
+    }
+
+    if (c->level <= level)
+    {
+      if (!version_validate(c, version))
+      {
+        STAT_ADD(restarts, 1);
+        continue;
+      }
+      if (c->is_leaf)
+        finger_set(c);
+      return c;
+    }
+
+    num_keys = c->num_keys;
+    if (num_keys > order - 1)
+      continue;
+    i = child_index(c->keys, num_keys, key);
+    next = (node *)c->pointers[i];
+
+    if (!version_validate(c, version))
+    {
+      STAT_ADD(restarts, 1);
+      continue;
+    }
+
+    if (stack != NULL)
+      stack[(*depth)++] = c;
+    c = next;
+  }
+
+  return NULL;
+}
+
+/* Finds the leaf slot of a key without taking any locks.
+ * Deleted records are retired rather than freed, so a boxed
+ * value stays readable until the caller's epoch ends.
+ */
+bool blink_find(node *root, tree_key key, void **slot)
+{
+  int i, num_keys;
+  uint64_t version;
+  bool found;
+  void *found_slot = NULL;
+  node *next, *c = blink_find_leaf(root, key, NULL, NULL, 0);
+
+  while (c != NULL)
+  {
+    version = version_read_begin(c);
+
+    if (c->right != NULL && key >= c->high_key)
+    {
+      next = c->right;
+      if (version_validate(c, version))
+        c = next;
+      continue;
+    }
+
+    num_keys = c->num_keys;
+    if (num_keys > order - 1)
+      num_keys = order - 1;
+    i = leaf_index(c, num_keys, key);
+    found = i < num_keys;
+    if (found)
+      found_slot = c->pointers[i];
+
+    if (version_validate(c, version))
+    {
+      if (found)
+        *slot = found_slot;
+      return found;
+    }
+    STAT_ADD(restarts, 1);
+  }
+
+  return false;
+}
+
+/* Range scan without locks. Each leaf is copied out and
+ * validated on its own; a leaf that changed underneath is
+ * copied again from the start.
+ */
+int blink_find_range(node *root, tree_key key_start, tree_key key_end, tree_key returned_keys[], void *returned_pointers[])
+{
+  int i, num_keys, num_found = 0, leaf_start;
+  uint64_t version;
+  bool past_end;
+  node *next, *n = blink_find_leaf(root, key_start, NULL, NULL, 0);
+
+  while (n != NULL)
+  {
+    version = version_read_begin(n);
+    leaf_start = num_found;
+    past_end = false;
+
+    num_keys = n->num_keys;
+    if (num_keys > order - 1)
+      num_keys = order - 1;
+    for (i = key_rank(n->keys, num_keys, key_start); i < num_keys; i++)
+    {
+      if (n->keys[i] > key_end)
+      {
+        past_end = true;
+        break;
+      }
+      returned_keys[num_found] = n->keys[i];
+      returned_pointers[num_found] = n->pointers[i];
+      num_found++;
+    }
+    next = n->right;
+    if (next != NULL && n->high_key > key_end)
+      past_end = true;
+
+    if (!version_validate(n, version))
+    {
+      STAT_ADD(restarts, 1);
+      num_found = leaf_start;
+      continue;
+    }
+
+    if (past_end)
+      break;
+    n = next;
+  }
+
+  return num_found;
+}
+
+/* Inserts the separator of a split node into the level
+ * above. The left node is locked on entry; the parent is
+ * locked before it is released, and splits keep moving up
+ * the same way. A parent that is not on the recorded path
+ * because the tree has grown since is looked up again.
+ */
+void blink_insert_into_parent(node **root, node *stack[], int depth, node *left, tree_key key, node *right)
+{
+  int left_index;
+  tree_key k_prime;
+  node *parent, *new_root;
+
+  while (true)
+  {
+    if (depth > 0)
+      parent = stack[--depth];
+    else
+    {
+      latch_write(&root_latch);
+      if (*root == left)
+      {
+        new_root = insert_into_new_root(left, key, right);
+        __atomic_store_n(root, new_root, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&root_latch);
+        version_unlock(left);
+        return;
+      }
+      pthread_rwlock_unlock(&root_latch);
+
+      /* The root was split underneath us; wait for the
+       * thread that split it to publish the new one.
+       */
+      while ((parent = __atomic_load_n(root, __ATOMIC_ACQUIRE))->level <= left->level)
+        sched_yield();
+      parent = blink_find_leaf(parent, key, NULL, NULL, left->level + 1);
+    }
+
+    version_lock(parent);
+    parent = blink_move_right(parent, key);
+    version_unlock(left);
+
+    left_index = 0;
+    while (left_index < parent->num_keys && parent->keys[left_index] < key)
+      left_index++;
+
+    if (parent->num_keys < order - 1)
+    {
+      insert_into_node(NULL, parent, left_index, key, right);
+      version_unlock(parent);
+      return;
+    }
+
+    right = split_internal(parent, left_index, key, right, &k_prime);
+    left = parent;
+    key = k_prime;
+  }
+}
+
+/* Insertion into the B-link tree. The leaf is locked on
+ * its own; a split locks one level at a time on the way up.
+ */
+bool blink_insert(node **root, tree_key key, tree_value value, bool overwrite, tree_value *existing)
+{
+  int i, depth;
+  node *stack[MAX_HEIGHT];
+  node *leaf, *new_leaf;
+  void *pointer;
+
+  if (__atomic_load_n(root, __ATOMIC_ACQUIRE) == NULL)
+  {
+    latch_write(&root_latch);
+    if (*root == NULL)
+    {
+      __atomic_store_n(root, start_new_tree(key, make_slot(value)), __ATOMIC_RELEASE);
+      pthread_rwlock_unlock(&root_latch);
+      return true;
+    }
+    pthread_rwlock_unlock(&root_latch);
+  }
+
+  // Case: an ascending key that fits in the rightmost leaf.
+  leaf = append_hint(key);
+  if (leaf != NULL)
+  {
+    version_lock(leaf);
+    if (can_append(leaf, key))
+    {
+      insert_into_leaf(leaf, key, make_slot(value));
+      version_unlock(leaf);
+      return true;
+    }
+    version_unlock(leaf);
+  }
+
+  leaf = blink_find_leaf(__atomic_load_n(root, __ATOMIC_ACQUIRE), key, stack, &depth, 0);
+  version_lock(leaf);
+  leaf = blink_move_right(leaf, key);
+
+  // Case: the key is already present.
+  i = leaf_index(leaf, leaf->num_keys, key);
+  if (i < leaf->num_keys)
+  {
+    put_existing(leaf, i, value, overwrite, existing);
+    version_unlock(leaf);
+    return false;
+  }
+
+  pointer = make_slot(value);
+
+  if (leaf->num_keys < order - 1)
+  {
+    insert_into_leaf(leaf, key, pointer);
+    version_unlock(leaf);
+    return true;
+  }
+
+  new_leaf = split_leaf(leaf, key, pointer);
+  blink_insert_into_parent(root, stack, depth, leaf, new_leaf->keys[0], new_leaf);
+  return true;
+}
+
+/* Deletion from the B-link tree. Only the leaf is locked.
+ * As in Lehman and Yao, underfull nodes are left in place
+ * rather than merged.
+ */
+bool blink_delete(node **root, tree_key key)
+{
+  int i;
+  node *leaf;
+  void *key_slot;
+  node *top = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+
+  if (top == NULL)
+    return false;
+
+  leaf = blink_find_leaf(top, key, NULL, NULL, 0);
+  version_lock(leaf);
+  leaf = blink_move_right(leaf, key);
+
+  i = leaf_index(leaf, leaf->num_keys, key);
+  if (i == leaf->num_keys)
+  {
+    version_unlock(leaf);
+    return false;
+  }
+
+  key_slot = leaf->pointers[i];
+  remove_entry_from_node(leaf, key, key_slot);
+  version_unlock(leaf);
+
+  retire_slot(key_slot);
+  return true;
+}
+
+// Update in the B-link tree. Only the leaf is locked.
+bool blink_update(node **root, tree_key key, update_fn fn, void *arg)
+{
+  int i;
+  node *leaf;
+  bool found;
+  node *top = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+
+  if (top == NULL)
+    return false;
+
+  leaf = blink_find_leaf(top, key, NULL, NULL, 0);
+  version_lock(leaf);
+  leaf = blink_move_right(leaf, key);
+
+  i = leaf_index(leaf, leaf->num_keys, key);
+  found = i < leaf->num_keys;
+  if (found)
+    set_slot_value(leaf->pointers[i], fn(slot_value(leaf->pointers[i]), arg));
+  version_unlock(leaf);
+
+  return found;
+}
+
+// Frees a deleted record once lock-free readers are done with it.
+void retire_record(record *r)
+{
+  epoch_retire(r, OBJECT_RECORD);
+}
+
+// OPTIMISTIC LOCK COUPLING
+
+/* Reads the version of a node for an optimistic read.
+ * Returns false if the node has been unlinked, in which
+ * case the operation has to restart from the root.
+ */
+bool olc_read_lock(node *n, uint64_t *version)
+{
+  *version = version_read_begin(n);
+  return !(*version & VERSION_OBSOLETE);
+}
+
+/* Splits a full internal node in half without inserting
+ * anything, so that its parent never has to split in turn.
+ * If the key on its way down goes past the end of the node
+ * (append), only the last two children move to the new one.
+ * Returns the new right half, and the key that separates
+ * the two halves in k_prime.
+ */
+node *split_full_internal(node *n, bool append, tree_key *k_prime)
+{
+  int i, j, split;
+  node *child, *new_node = make_node();
+
+  STAT_ADD(internal_splits, 1);
+
+  split = n->num_keys / 2;
+  if (append && n->num_keys - 2 > split)
+    split = n->num_keys - 2;
+  *k_prime = n->keys[split];
+
+  for (i = split + 1, j = 0; i < n->num_keys; i++, j++)
+  {
+    new_node->keys[j] = n->keys[i];
+    new_node->pointers[j] = n->pointers[i];
+    child = new_node->pointers[j];
+    child->parent = new_node;
+  }
+  new_node->pointers[j] = n->pointers[i];
+  child = new_node->pointers[j];
+  child->parent = new_node;
+  new_node->num_keys = j;
+  n->num_keys = split;
+
+  new_node->parent = n->parent;
+  new_node->level = n->level;
+  new_node->right = n->right;
+  new_node->high_key = n->high_key;
+  n->right = new_node;
+  n->high_key = *k_prime;
+
+  return new_node;
+}
+
+/* Optimistic descent for lookups and deletions. Returns
+ * the leaf with its version and that of its parent, or
+ * NULL if the descent ran into a writer and has to restart.
+ */
+node *olc_find_leaf(node **root, tree_key key, node **parent, uint64_t *parent_version, uint64_t *version)
+{
+  int i, num_keys;
+  node *child, *n = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+
+  *parent = NULL;
+  if (!olc_read_lock(n, version) || n != __atomic_load_n(root, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  while (!n->is_leaf)
+  {
+    num_keys = n->num_keys;
+    if (num_keys > order - 1)
+      return NULL;
+    i = child_index(n->keys, num_keys, key);
+    child = (node *)n->pointers[i];
+
+    if (!version_validate(n, *version))
+      return NULL;
+
+    *parent = n;
+    *parent_version = *version;
+    n = child;
+    // The child may have split before its version was read, taking the key to its new sibling.
+    if (!olc_read_lock(n, version) || !version_validate(*parent, *parent_version))
+      return NULL;
+  }
+
+  finger_set(n);
+  return n;
+}
+
+/* Finds the leaf slot of a key. Readers never write to
+ * shared memory; if any node on the path has changed by
+ * the time it is validated, the lookup starts over.
+ */
+bool olc_find(node **root, tree_key key, void **slot)
+{
+  int i, num_keys;
+  uint64_t version, parent_version;
+  node *leaf, *parent;
+  bool found;
+  void *found_slot = NULL;
+
+  if (__atomic_load_n(root, __ATOMIC_ACQUIRE) == NULL)
+    return false;
+
+  // Every pass after the first is a restart.
+  for (;; STAT_ADD(restarts, 1))
+  {
+    leaf = olc_find_leaf(root, key, &parent, &parent_version, &version);
+    if (leaf == NULL)
+      continue;
+
+    num_keys = leaf->num_keys;
+    if (num_keys > order - 1)
+      num_keys = order - 1;
+    i = leaf_index(leaf, num_keys, key);
+    found = i < num_keys;
+    if (found)
+      found_slot = leaf->pointers[i];
+
+    if (version_validate(leaf, version))
+    {
+      if (found)
+        *slot = found_slot;
+      return found;
+    }
+  }
+}
+
+/* Insertion with optimistic lock coupling. Full internal
+ * nodes met on the way down are split eagerly, so a leaf
+ * split only ever needs to lock the leaf and its parent.
+ */
+bool olc_insert(node **root, tree_key key, tree_value value, bool overwrite, tree_value *existing)
+{
+  int i, num_keys, left_index;
+  tree_key k_prime;
+  uint64_t version, parent_version = 0;
+  node *n, *parent, *child, *sibling;
+  void *pointer = NULL, *slot;
+  bool have_pointer = false, restarted = false;
+
+  // Case: an ascending key that fits in the rightmost leaf.
+  n = append_hint(key);
+  if (n != NULL)
+  {
+    version_lock(n);
+    if (can_append(n, key))
+    {
+      insert_into_leaf(n, key, make_slot(value));
+      version_unlock(n);
+      return true;
+    }
+    version_unlock(n);
+  }
+
+restart:
+  if (restarted)
+    STAT_ADD(restarts, 1);
+  restarted = true;
+  n = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+  if (n == NULL)
+  {
+    latch_write(&root_latch);
+    if (*root == NULL)
+    {
+      __atomic_store_n(root, start_new_tree(key, make_slot(value)), __ATOMIC_RELEASE);
+      pthread_rwlock_unlock(&root_latch);
+      if (have_pointer)
+        free_slot(pointer);
+      return true;
+    }
+    pthread_rwlock_unlock(&root_latch);
+    goto restart;
+  }
+
+  if (!olc_read_lock(n, &version) || n != __atomic_load_n(root, __ATOMIC_ACQUIRE))
+    goto restart;
+  parent = NULL;
+
+  while (!n->is_leaf)
+  {
+    if (n->num_keys == order - 1)
+    {
+      if (parent != NULL && !version_upgrade(parent, parent_version))
+        goto restart;
+      if (!version_upgrade(n, version))
+      {
+        if (parent != NULL)
+          version_unlock(parent);
+        goto restart;
+      }
+      if (parent == NULL && n != __atomic_load_n(root, __ATOMIC_ACQUIRE))
+      {
+        version_unlock(n);
+        goto restart;
+      }
+
+      sibling = split_full_internal(n, child_index(n->keys, n->num_keys, key) == n->num_keys, &k_prime);
+      if (parent != NULL)
+      {
+        left_index = get_left_index(parent, n);
+        insert_into_node(NULL, parent, left_index, k_prime, sibling);
+        version_unlock(parent);
+      }
+      else
+        __atomic_store_n(root, insert_into_new_root(n, k_prime, sibling), __ATOMIC_RELEASE);
+      version_unlock(n);
+      goto restart;
+    }
+
+    num_keys = n->num_keys;
+    if (num_keys > order - 1)
+      goto restart;
+    i = child_index(n->keys, num_keys, key);
+    child = (node *)n->pointers[i];
+
+    if (!version_validate(n, version))
+      goto restart;
+    if (parent != NULL && !version_validate(parent, parent_version))
+      goto restart;
+
+    parent = n;
+    parent_version = version;
+    n = child;
+    if (!olc_read_lock(n, &version))
+      goto restart;
+  }
+
+  finger_set(n);
+
+  // The current implementation ignores duplicates.
+  num_keys = n->num_keys;
+  if (num_keys > order - 1)
+    goto restart;
+  i = leaf_index(n, num_keys, key);
+  if (i < num_keys)
+  {
+    if (overwrite)
+    {
+      if (!version_upgrade(n, version))
+        goto restart;
+      put_existing(n, i, value, true, existing);
+      version_unlock(n);
+    }
+    else
+    {
+      slot = n->pointers[i];
+      if (!version_validate(n, version))
+        goto restart;
+      if (existing != NULL)
+        *existing = slot_value(slot);
+    }
+    if (have_pointer)
+      free_slot(pointer);
+    return false;
+  }
+
+  if (!have_pointer)
+  {
+    pointer = make_slot(value);
+    have_pointer = true;
+  }
+
+  // Case: leaf must be split, which locks its parent as well.
+  if (num_keys == order - 1)
+  {
+    if (parent != NULL && !version_upgrade(parent, parent_version))
+      goto restart;
+    if (!version_upgrade(n, version))
+    {
+      if (parent != NULL)
+        version_unlock(parent);
+      goto restart;
+    }
+    if (parent == NULL && n != __atomic_load_n(root, __ATOMIC_ACQUIRE))
+    {
+      version_unlock(n);
+      goto restart;
+    }
+
+    sibling = split_leaf(n, key, pointer);
+    if (parent != NULL)
+    {
+      left_index = get_left_index(parent, n);
+      insert_into_node(NULL, parent, left_index, sibling->keys[0], sibling);
+      version_unlock(parent);
+    }
+    else
+      __atomic_store_n(root, insert_into_new_root(n, sibling->keys[0], sibling), __ATOMIC_RELEASE);
+    version_unlock(n);
+    return true;
+  }
+
+  if (!version_upgrade(n, version))
+    goto restart;
+  if (parent != NULL && !version_validate(parent, parent_version))
+  {
+    version_unlock(n);
+    goto restart;
+  }
+
+  insert_into_leaf(n, key, pointer);
+  version_unlock(n);
+  return true;
+}
+
+/* Update with optimistic lock coupling. Only the leaf is
+ * locked, and only if it holds the key.
+ */
+bool olc_update(node **root, tree_key key, update_fn fn, void *arg)
+{
+  int i, num_keys;
+  uint64_t version, parent_version;
+  node *leaf, *parent;
+
+  if (__atomic_load_n(root, __ATOMIC_ACQUIRE) == NULL)
+    return false;
+
+  // Every pass after the first is a restart.
+  for (;; STAT_ADD(restarts, 1))
+  {
+    leaf = olc_find_leaf(root, key, &parent, &parent_version, &version);
+    if (leaf == NULL)
+      continue;
+
+    num_keys = leaf->num_keys;
+    if (num_keys > order - 1)
+      num_keys = order - 1;
+    i = leaf_index(leaf, num_keys, key);
+    if (i == num_keys)
+    {
+      if (version_validate(leaf, version))
+        return false;
+      continue;
+    }
+
+    if (!version_upgrade(leaf, version))
+      continue;
+    set_slot_value(leaf->pointers[i], fn(slot_value(leaf->pointers[i]), arg));
+    version_unlock(leaf);
+    return true;
+  }
+}
+
+/* Deletion with optimistic lock coupling. Only the leaf
+ * is locked, and as in the B-link tree underfull leaves
+ * are not merged.
+ */
+bool olc_delete(node **root, tree_key key)
+{
+  int i, num_keys;
+  uint64_t version, parent_version;
+  node *leaf, *parent;
+  void *key_slot;
+
+  if (__atomic_load_n(root, __ATOMIC_ACQUIRE) == NULL)
+    return false;
+
+  // Every pass after the first is a restart.
+  for (;; STAT_ADD(restarts, 1))
+  {
+    leaf = olc_find_leaf(root, key, &parent, &parent_version, &version);
+    if (leaf == NULL)
+      continue;
+
+    num_keys = leaf->num_keys;
+    if (num_keys > order - 1)
+      num_keys = order - 1;
+    i = leaf_index(leaf, num_keys, key);
+    if (i == num_keys)
+    {
+      if (version_validate(leaf, version))
+        return false;
+      continue;
+    }
+
+    if (!version_upgrade(leaf, version))
+      continue;
+    if (parent != NULL && !version_validate(parent, parent_version))
+    {
+      version_unlock(leaf);
+      continue;
+    }
+
+    key_slot = leaf->pointers[i];
+    remove_entry_from_node(leaf, key, key_slot);
+    version_unlock(leaf);
+
+    retire_slot(key_slot);
+    return true;
+  }
+}
+
+// FINGER CACHE
+
+/* Remembers the leaf a descent has just reached, for the
+ * next operation of the same thread to try first.
+ */
+void finger_set(node *leaf)
+{
+  thread_state *ts;
+
+  if (!finger_cache)
+    return;
+
+  ts = get_thread_state();
+  ts->finger = leaf;
+  ts->finger_epoch = ts->epoch >> 1;
+}
+
+/* Returns the thread's finger if it can still be read. It
+ * may have been unlinked since it was taken, but it cannot
+ * have been freed as long as the global epoch has not moved
+ * on: anything retired after the finger was taken is only
+ * freed two epochs later, and the global epoch cannot get
+ * that far while this thread is inside the same one.
+ */
+node *finger_get(void)
+{
+  thread_state *ts = get_thread_state();
+
+  if (ts->finger == NULL || ts->finger_epoch != ts->epoch >> 1 ||
+      ts->finger_epoch != __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE))
+    return NULL;
+  return ts->finger;
+}
+
+/* Tells whether a key belongs in a leaf with the given
+ * number of keys. Its fences are taken to be its first key
+ * and its high key: a key below the first one may belong in
+ * the leaf too, but only the parent knows, and a deletion
+ * that rebalances the leaf may have raised its lower bound.
+ */
+bool finger_covers(node *leaf, int num_keys, tree_key key)
+{
+  return !(__atomic_load_n(&leaf->version, __ATOMIC_ACQUIRE) & VERSION_OBSOLETE) &&
+         num_keys > 0 && num_keys <= order - 1 &&
+         key >= leaf->keys[0] &&
+         (leaf->right == NULL || key < leaf->high_key);
+}
+
+// Locks the finger for a modification, as each scheme does for a leaf.
+void finger_lock(node *leaf)
+{
+  switch (concurrency)
+  {
+  case CC_COUPLING:
+    latch_write(&leaf->latch);
+    break;
+  case CC_BLINK:
+  case CC_OLC:
+    version_lock(leaf);
+    break;
+  default:
+    latch_write(&rwlock);
+  }
+}
+
+void finger_unlock(node *leaf)
+{
+  switch (concurrency)
+  {
+  case CC_COUPLING:
+    pthread_rwlock_unlock(&leaf->latch);
+    break;
+  case CC_BLINK:
+  case CC_OLC:
+    version_unlock(leaf);
+    break;
+  default:
+    pthread_rwlock_unlock(&rwlock);
+  }
+}
+
+void finger_count(bool hit)
+{
+  if (hit)
+    STAT_ADD(finger_hits, 1);
+  else
+    STAT_ADD(finger_misses, 1);
+}
+
+/* Looks a key up in the thread's finger. Returns false if
+ * the key is not known to belong there, and the caller has
+ * to search from the root.
+ */
+bool finger_search(tree_key key, int *found)
+{
+  int i, num_keys;
+  uint64_t version = 0;
+  void *slot = NULL;
+  bool hit = false, present = false;
+  node *leaf = finger_get();
+
+  if (leaf != NULL)
+  {
+    switch (concurrency)
+    {
+    case CC_COUPLING:
+      latch_read(&leaf->latch);
+      break;
+    case CC_BLINK:
+    case CC_OLC:
+      version = version_read_begin(leaf);
+      break;
+    default:
+      latch_read(&rwlock);
+    }
+
+    num_keys = leaf->num_keys;
+    hit = finger_covers(leaf, num_keys, key);
+    if (hit)
+    {
+      i = leaf_index(leaf, num_keys, key);
+      present = i < num_keys;
+      if (present)
+        slot = leaf->pointers[i];
+    }
+
+    switch (concurrency)
+    {
+    case CC_COUPLING:
+      pthread_rwlock_unlock(&leaf->latch);
+      break;
+    case CC_BLINK:
+    case CC_OLC:
+      hit = hit && version_validate(leaf, version);
+      break;
+    default:
+      pthread_rwlock_unlock(&rwlock);
+    }
+
+    if (hit)
+      *found = present && slot_value(slot) == key;
+  }
+
+  finger_count(hit);
+  return hit;
+}
+
+/* Inserts a key into the thread's finger, or handles it
+ * as put() does if it is already there. Returns false if
+ * the key is not known to belong there or the leaf is full.
+ */
+bool finger_put(tree_key key, tree_value value, bool overwrite, tree_value *existing, bool *inserted)
+{
+  int i, num_keys;
+  bool hit = false;
+  node *leaf = finger_get();
+
+  if (leaf != NULL)
+  {
+    finger_lock(leaf);
+    num_keys = leaf->num_keys;
+    if (finger_covers(leaf, num_keys, key))
+    {
+      i = leaf_index(leaf, num_keys, key);
+      if (i < num_keys)
+      {
+        put_existing(leaf, i, value, overwrite, existing);
+        *inserted = false;
+        hit = true;
+      }
+      else if (num_keys < order - 1)
+      {
+        insert_into_leaf(leaf, key, make_slot(value));
+        *inserted = true;
+        hit = true;
+      }
+    }
+    finger_unlock(leaf);
+  }
+
+  finger_count(hit);
+  return hit;
+}
+
+/* Deletes a key from the thread's finger. Under lock
+ * coupling the leaf must not underflow, since its parent is
+ * not latched; the global lock covers a merge as usual.
+ * Returns false if the caller has to delete from the root.
+ */
+bool finger_delete(node **root, tree_key key, bool *deleted)
+{
+  int i, num_keys;
+  bool hit = false, removed = false;
+  void *key_slot = NULL;
+  node *leaf = finger_get();
+
+  if (leaf != NULL)
+  {
+    finger_lock(leaf);
+    num_keys = leaf->num_keys;
+    if (finger_covers(leaf, num_keys, key))
+    {
+      i = leaf_index(leaf, num_keys, key);
+      if (i == num_keys)
+      {
+        *deleted = false;
+        hit = true;
+      }
+      else if (concurrency != CC_COUPLING || is_safe(leaf, LATCH_DELETE))
+      {
+        key_slot = leaf->pointers[i];
+        if (concurrency == CC_GLOBAL)
+          *root = delete_entry(*root, leaf, key, key_slot);
+        else
+          remove_entry_from_node(leaf, key, key_slot);
+        *deleted = removed = true;
+        hit = true;
+      }
+    }
+    finger_unlock(leaf);
+
+    if (removed)
+    {
+      if (concurrency == CC_BLINK || concurrency == CC_OLC)
+        retire_slot(key_slot);
+      else
+        free_slot(key_slot);
+    }
+  }
+
+  finger_count(hit);
+  return hit;
+}
+
+// CURSORS
+
+/* Copies the keys and the high fence of a leaf into the
+ * cursor, and its value slots into slots. A boxed value is
+ * only safe to read once the copy is known to be consistent,
+ * see cursor_read_values().
+ */
+void cursor_copy_leaf(cursor *c, node *leaf, int num_keys, void *slots[])
+{
+  int i;
+
+  for (i = 0; i < num_keys; i++)
+  {
+    c->keys[i] = leaf->keys[i];
+    slots[i] = leaf->pointers[i];
+  }
+  c->num_keys = num_keys;
+  c->has_high = leaf->right != NULL;
+  c->high_key = leaf->high_key;
+}
+
+void cursor_read_values(cursor *c, void *slots[])
+{
+  int i;
+
+  for (i = 0; i < c->num_keys; i++)
+    c->values[i] = slot_value(slots[i]);
+}
+
+/* Copies the leaf that covers key into the cursor without
+ * taking any locks, as blink_find() does, keeping track of
+ * the lowest key the leaf may hold on the way down. Under
+ * the global rwlock the node versions never change, and the
+ * same descent works.
+ */
+void cursor_load_optimistic(cursor *c, tree_key key)
+{
+  int i, num_keys;
+  tree_key low_key = 0;
+  bool new_low;
+  uint64_t version;
+  void *slots[ORDER - 1];
+  node *next, *n = __atomic_load_n(c->root, __ATOMIC_ACQUIRE);
+
+  c->has_low = false;
+  if (n == NULL)
+  {
+    c->num_keys = 0;
+    c->has_high = false;
+    return;
+  }
+
+  while (true)
+  {
+    version = version_read_begin(n);
+    num_keys = n->num_keys;
+    if (num_keys > order - 1)
+      continue;
+
+    if (n->right != NULL && key >= n->high_key)
+    {
+      next = n->right;
+      new_low = true;
+      low_key = n->high_key;
+    }
+    else if (!n->is_leaf)
+    {
+      i = child_index(n->keys, num_keys, key);
+      next = (node *)n->pointers[i];
+      new_low = i > 0;
+      if (new_low)
+        low_key = n->keys[i - 1];
+    }
+    else
+    {
+      cursor_copy_leaf(c, n, num_keys, slots);
+      if (!version_validate(n, version))
+        continue;
+      cursor_read_values(c, slots);
+      return;
+    }
+
+    if (!version_validate(n, version))
+      continue;
+    if (new_low)
+    {
+      c->has_low = true;
+      c->low_key = low_key;
+    }
+    n = next;
+  }
+}
+
+/* Copies the leaf that covers key into the cursor, and
+ * places the cursor before the first key in it that is not
+ * less than bound.
+ */
+void cursor_load(cursor *c, tree_key key, tree_key bound)
+{
+  node *leaf;
+  void *slots[ORDER - 1];
+
+  epoch_enter();
+  switch (concurrency)
+  {
+  case CC_COUPLING:
+    leaf = find_leaf_shared(c->root, key, &c->has_low, &c->low_key);
+    if (leaf == NULL)
+    {
+      c->num_keys = 0;
+      c->has_high = false;
+      break;
+    }
+    cursor_copy_leaf(c, leaf, leaf->num_keys, slots);
+    cursor_read_values(c, slots);
+    pthread_rwlock_unlock(&leaf->latch);
+    break;
+  case CC_GLOBAL:
+    latch_read(&rwlock);
+    cursor_load_optimistic(c, key);
+    pthread_rwlock_unlock(&rwlock);
+    break;
+  default:
+    cursor_load_optimistic(c, key);
+  }
+  epoch_exit();
+
+  c->position = key_rank(c->keys, c->num_keys, bound);
+}
+
+// Places a cursor on a tree before the first key not less than key.
+void cursor_seek(cursor *c, node **root, tree_key key)
+{
+  c->root = root;
+  cursor_load(c, key, key);
+}
+
+/* Moves the cursor past the next key and stores the key
+ * and its value. Returns false at the end of the tree.
+ */
+bool cursor_next(cursor *c, tree_key *key, tree_value *value)
+{
+  while (c->position == c->num_keys)
+  {
+    if (!c->has_high)
+      return false;
+    cursor_load(c, c->high_key, c->high_key);
+  }
+
+  *key = c->keys[c->position];
+  *value = c->values[c->position];
+  c->position++;
+  return true;
+}
+
+/* Moves the cursor back past the previous key and stores
+ * the key and its value. Returns false at the start of
+ * the tree.
+ */
+bool cursor_prev(cursor *c, tree_key *key, tree_value *value)
+{
+  tree_key low_key;
+
+  while (c->position == 0)
+  {
+    if (!c->has_low || c->low_key == KEY_MIN)
+      return false;
+    low_key = c->low_key;
+    cursor_load(c, low_key - 1, low_key);
+  }
+
+  c->position--;
+  *key = c->keys[c->position];
+  *value = c->values[c->position];
+  return true;
+}
+
+/* Moves the cursor past up to capacity keys, storing them
+ * and their values in order.
+ * Returns the number of keys stored, which is less than
+ * capacity only at the end of the tree.
+ */
+int cursor_next_batch(cursor *c, tree_key keys[], tree_value values[], int capacity)
+{
+  int count = 0, n;
+
+  while (count < capacity)
+  {
+    if (c->position == c->num_keys)
+    {
+      if (!c->has_high)
+        break;
+      cursor_load(c, c->high_key, c->high_key);
+      continue;
+    }
+
+    n = c->num_keys - c->position;
+    if (n > capacity - count)
+      n = capacity - count;
+    memcpy(keys + count, c->keys + c->position, n * sizeof(tree_key));
+    memcpy(values + count, c->values + c->position, n * sizeof(tree_value));
+    c->position += n;
+    count += n;
+  }
+
+  return count;
+}
+
+int compare_pairs(const void *a, const void *b)
+{
+  tree_key x = ((const kv_pair *)a)->key, y = ((const kv_pair *)b)->key;
+  return (x > y) - (x < y);
+}
+
+/* Returns how many nodes a level needs for num_entries
+ * entries when each node should be filled to fill percent
+ * of its capacity. No node gets more than capacity entries,
+ * or fewer than minimum unless the level is a single node.
+ */
+long bulk_level_size(long num_entries, int capacity, int minimum, int fill)
+{
+  long target = (long)capacity * fill / 100;
+  long num_nodes;
+
+  if (target < minimum)
+    target = minimum;
+  if (target > capacity)
+    target = capacity;
+
+  num_nodes = num_entries / target;
+  if (num_nodes < (num_entries + capacity - 1) / capacity)
+    num_nodes = (num_entries + capacity - 1) / capacity;
+  return num_nodes > 0 ? num_nodes : 1;
+}
+
+/* Builds nodes first up to last of a level, and adopts
+ * their children. Sibling links are set by the caller
+ * once the whole level exists.
+ */
+void bulk_build_nodes(bulk_level *level, long first, long last)
+{
+  long j, start, end, e;
+  int k;
+  node *n;
+
+  for (j = first; j < last; j++)
+  {
+    start = j * level->num_entries / level->num_nodes;
+    end = (j + 1) * level->num_entries / level->num_nodes;
+
+    if (level->children == NULL)
+    {
+      n = make_leaf();
+      for (e = start, k = 0; e < end; e++, k++)
+      {
+        n->keys[k] = level->pairs[e].key;
+        n->pointers[k] = make_slot(level->pairs[e].value);
+      }
+      n->num_keys = k;
+      fingerprint_leaf(n, 0);
+      level->lows[j] = level->pairs[start].key;
+    }
+    else
+    {
+      n = make_node();
+      for (e = start, k = 0; e < end; e++, k++)
+      {
+        if (k > 0)
+          n->keys[k - 1] = level->child_lows[e];
+        n->pointers[k] = level->children[e];
+        level->children[e]->parent = n;
+      }
+      n->num_keys = k - 1;
+      n->level = level->children[start]->level + 1;
+      level->lows[j] = level->child_lows[start];
+    }
+    level->nodes[j] = n;
+  }
+}
+
+void *bulk_build_thread(void *args)
+{
+  bulk_task *task = (bulk_task *)args;
+
+  bulk_build_nodes(task->level, task->first, task->last);
+  return NULL;
+}
+
+/* Builds a whole level, splitting its nodes evenly over up
+ * to num_threads threads, and then links the nodes to
+ * their right siblings.
+ */
+void bulk_build_level(bulk_level *level, int num_threads)
+{
+  long j;
+  int t;
+
+  if (num_threads > level->num_nodes)
+    num_threads = (int)level->num_nodes;
+
+  if (num_threads <= 1)
+    bulk_build_nodes(level, 0, level->num_nodes);
+  else
+  {
+    pthread_t threads[num_threads];
+    bulk_task tasks[num_threads];
+
+    for (t = 0; t < num_threads; t++)
+    {
+      tasks[t].level = level;
+      tasks[t].first = t * level->num_nodes / num_threads;
+      tasks[t].last = (t + 1) * level->num_nodes / num_threads;
+      if (pthread_create(&threads[t], NULL, bulk_build_thread, &tasks[t]) != 0)
+      {
+        perror("Bulk load");
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (t = 0; t < num_threads; t++)
+      pthread_join(threads[t], NULL);
+  }
+
+  for (j = 0; j < level->num_nodes; j++)
+  {
+    node *n = level->nodes[j];
+    n->right = j + 1 < level->num_nodes ? level->nodes[j + 1] : NULL;
+    n->high_key = n->right != NULL ? level->lows[j + 1] : 0;
+    if (n->is_leaf)
+      n->pointers[order - 1] = n->right;
+  }
+}
+
+/* Builds a tree bottom-up from num key-value pairs, which
+ * must be sorted by key unless sorted is false, in which
+ * case they are sorted in place first. Of pairs with the
+ * same key only one is kept. Nodes are filled to fill
+ * percent of their capacity, but never below the minimum
+ * that deletion maintains. The levels are built by up to
+ * num_threads threads.
+ * Returns the root of the new tree, which is not yet
+ * visible to any other thread.
+ */
+node *bulk_load(kv_pair *pairs, long num, bool sorted, int fill, int num_threads)
+{
+  bulk_level level = {0};
+  long i, j;
+
+  if (num == 0)
+    return NULL;
+
+  if (!sorted)
+    qsort(pairs, num, sizeof(kv_pair), compare_pairs);
+  for (i = 1, j = 1; i < num; i++)
+    if (pairs[i].key != pairs[j - 1].key)
+      pairs[j++] = pairs[i];
+  num = j;
+
+  level.pairs = pairs;
+  level.num_entries = num;
+  level.num_nodes = bulk_level_size(num, order - 1, cut(order - 1), fill);
+
+  while (true)
+  {
+    level.nodes = malloc(level.num_nodes * sizeof(node *));
+    level.lows = malloc(level.num_nodes * sizeof(tree_key));
+    if (level.nodes == NULL || level.lows == NULL)
+    {
+      perror("Bulk load");
+      exit(EXIT_FAILURE);
+    }
+
+    bulk_build_level(&level, num_threads);
+    if (level.pairs != NULL)
+      remember_rightmost(level.nodes[level.num_nodes - 1]);
+
+    free(level.children);
+    free(level.child_lows);
+    if (level.num_nodes == 1)
+      break;
+
+    level.pairs = NULL;
+    level.children = level.nodes;
+    level.child_lows = level.lows;
+    level.num_entries = level.num_nodes;
+    level.num_nodes = bulk_level_size(level.num_entries, order, cut(order), fill);
+  }
+
+  node *new_root = level.nodes[0];
+  free(level.nodes);
+  free(level.lows);
+  return new_root;
+}
+
+void destroy_tree_nodes(node *root)
+{
+  int i;
+  if (root->is_leaf)
+    for (i = 0; i < root->num_keys; i++)
+      free_slot(root->pointers[i]);
+  else
+    for (i = 0; i < root->num_keys + 1; i++)
+      destroy_tree_nodes(root->pointers[i]);
+
+  free_node(root);
+}
+
+/* Frees the whole tree, along with everything still
+ * waiting for its epoch to pass. No other thread may be
+ * using the tree.
+ */
+void destroy_tree(node *root)
+{
+  thread_state *ts;
+
+  rightmost_leaf = NULL;
+  if (root != NULL)
+    destroy_tree_nodes(root);
+
+  // Leaves fingers that point into the freed tree behind.
+  global_epoch += 2;
+
+  for (ts = thread_states; ts != NULL; ts = ts->next)
+    epoch_reclaim(ts, true);
+}
+
+// STRING KEYS
+
+/* Returns the first four bytes of a key as a big-endian
+ * number, padded with zeros, so that heads that differ
+ * order their keys as comparing the keys' bytes would.
+ */
+uint32_t str_head(const uint8_t *key, int length)
+{
+  uint32_t head = 0;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    head = head << 8 | (i < length ? key[i] : 0);
+  return head;
+}
+
+// Compares two keys byte by byte; a key that is a prefix of another comes first.
+int str_compare(const uint8_t *a, int a_length, const uint8_t *b, int b_length)
+{
+  int c = memcmp(a, b, a_length < b_length ? a_length : b_length);
+
+  return c != 0 ? c : a_length - b_length;
+}
+
+/* Writes the string key that stands for a benchmark key,
+ * "user:" and its digits, to buf, which must have room for
+ * STR_KEY_MAX + 1 bytes. Returns its length.
+ */
+int str_key_format(tree_key key, uint8_t *buf)
+{
+  return sprintf((char *)buf, "user:%" KEY_FORMAT, key);
+}
+
+// Returns the bytes at an offset into a node.
+uint8_t *str_bytes(str_node *n, int offset)
+{
+  return (uint8_t *)n + offset;
+}
+
+str_node *str_make_node(int level)
+{
+  str_node *n;
+
+  if (posix_memalign((void **)&n, CACHE_LINE, STR_NODE_BYTES) != 0)
+  {
+    perror("String node");
+    exit(EXIT_FAILURE);
+  }
+  pthread_rwlock_init(&n->latch, NULL);
+  n->level = level;
+  n->first = NULL;
+  str_set_fences(n, NULL, -1, NULL, -1);
+  return n;
+}
+
+// Contiguous bytes between the slots of a node and its keys.
+int str_free_bytes(str_node *n)
+{
+  return n->heap - (int)offsetof(str_node, slots) - n->num_keys * (int)sizeof(str_slot);
+}
+
+// Tells whether a node has room for a key of the given length, compacting it if need be.
+bool str_room(str_node *n, int length)
+{
+  return str_free_bytes(n) + n->garbage >= (int)sizeof(str_slot) + length - n->prefix_length;
+}
+
+/* Empties a node and sets its fences, a length of -1
+ * standing for none. They may point into a copy of the
+ * node, but not into the node itself.
+ */
+void str_set_fences(str_node *n, const uint8_t *low, int low_length, const uint8_t *high, int high_length)
+{
+  int i = 0;
+
+  n->num_keys = 0;
+  n->garbage = 0;
+  n->heap = STR_NODE_BYTES;
+  if (high_length > 0)
+  {
+    n->heap -= high_length;
+    memcpy(str_bytes(n, n->heap), high, high_length);
+  }
+  n->high_offset = n->heap;
+  n->high_length = high_length;
+  if (low_length > 0)
+  {
+    n->heap -= low_length;
+    memcpy(str_bytes(n, n->heap), low, low_length);
+  }
+  n->low_offset = n->heap;
+  n->low_length = low_length;
+
+  // Every key from one fence up to the other starts with what the two have in common.
+  if (low_length >= 0 && high_length >= 0)
+    while (i < low_length && i < high_length && low[i] == high[i])
+      i++;
+  n->prefix_length = i;
+}
+
+// Copies the key of entry i of a node, prefix included, to buf and returns its length.
+int str_key(str_node *n, int i, uint8_t *buf)
+{
+  str_slot *s = &n->slots[i];
+
+  memcpy(buf, str_bytes(n, n->low_offset), n->prefix_length);
+  memcpy(buf + n->prefix_length, str_bytes(n, s->offset), s->length);
+  return n->prefix_length + s->length;
+}
+
+/* Returns the number of entries of a node whose keys are
+ * less than the given one, which must lie between the
+ * node's fences, and sets *found if the next one equals it.
+ * Only the slots' heads are read until two of them tie.
+ */
+int str_rank(str_node *n, const uint8_t *key, int length, bool *found)
+{
+  int low = 0, high = n->num_keys, middle, c;
+  uint32_t head;
+  str_slot *s;
+
+  key += n->prefix_length;
+  length -= n->prefix_length;
+  head = str_head(key, length);
+  *found = false;
+  while (low < high)
+  {
+    middle = (low + high) / 2;
+    s = &n->slots[middle];
+    if (s->head != head)
+      c = s->head < head ? -1 : 1;
+    else
+      c = str_compare(str_bytes(n, s->offset), s->length, key, length);
+    if (c == 0)
+    {
+      *found = true;
+      return middle;
+    }
+    if (c < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+// Returns the child of an internal node whose subtree holds the key.
+str_node *str_child(str_node *n, const uint8_t *key, int length)
+{
+  bool found;
+  int i = str_rank(n, key, length, &found);
+
+  if (found)
+    return n->slots[i].child;
+  return i == 0 ? n->first : n->slots[i - 1].child;
+}
+
+/* Inserts an entry with the given key, and the value or
+ * child of entry, at position i of a node that has room
+ * for it. The node is compacted first if its free bytes are
+ * not in one piece.
+ */
+void str_insert_at(str_node *n, int i, const uint8_t *key, int length, const str_slot *entry)
+{
+  str_slot s = *entry;
+
+  key += n->prefix_length;
+  length -= n->prefix_length;
+  if (str_free_bytes(n) < (int)sizeof(str_slot) + length)
+    str_compact(n);
+
+  n->heap -= length;
+  memcpy(str_bytes(n, n->heap), key, length);
+  s.head = str_head(key, length);
+  s.offset = n->heap;
+  s.length = length;
+  memmove(&n->slots[i + 1], &n->slots[i], (n->num_keys - i) * sizeof(str_slot));
+  n->slots[i] = s;
+  n->num_keys++;
+}
+
+// Removes entry i of a node. Its key's bytes are reclaimed by the next compaction.
+void str_remove_at(str_node *n, int i)
+{
+  n->garbage += n->slots[i].length;
+  memmove(&n->slots[i], &n->slots[i + 1], (n->num_keys - i - 1) * sizeof(str_slot));
+  n->num_keys--;
+}
+
+/* Empties a node and refills it with entries first to
+ * last - 1 of src, a copy of a node, between the given
+ * fences. The keys lose as much of their start as the new
+ * fences have in common.
+ */
+void str_fill(str_node *n, str_node *src, int first, int last,
+              const uint8_t *low, int low_length, const uint8_t *high, int high_length)
+{
+  uint8_t key[STR_KEY_MAX];
+  int i;
+
+  str_set_fences(n, low, low_length, high, high_length);
+  for (i = first; i < last; i++)
+    str_insert_at(n, n->num_keys, key, str_key(src, i, key), &src->slots[i]);
+}
+
+// Packs the keys of a node together again, reclaiming the bytes of removed ones.
+void str_compact(str_node *n)
+{
+  uint64_t buffer[STR_NODE_BYTES / sizeof(uint64_t)];
+  str_node *copy = (str_node *)buffer;
+
+  memcpy(copy, n, STR_NODE_BYTES);
+  str_fill(n, copy, 0, copy->num_keys,
+           str_bytes(copy, copy->low_offset), copy->low_length,
+           str_bytes(copy, copy->high_offset), copy->high_length);
+}
+
+/* Moves the upper half of a node, by bytes, to a new right
+ * sibling and returns it, with the lowest key of the
+ * sibling's subtree in separator. A leaf only passes up as
+ * much of the sibling's first key as tells it apart from
+ * its own last key (suffix truncation). An internal node
+ * passes up the key between its halves, whose child becomes
+ * the sibling's first.
+ */
+str_node *str_split(str_node *n, uint8_t *separator, int *separator_length)
+{
+  uint64_t buffer[STR_NODE_BYTES / sizeof(uint64_t)];
+  str_node *copy = (str_node *)buffer;
+  str_node *right = str_make_node(n->level);
+  uint8_t last[STR_KEY_MAX];
+  int i, middle, length, last_length, total = 0, half = 0;
+
+  memcpy(copy, n, STR_NODE_BYTES);
+  for (i = 0; i < n->num_keys; i++)
+    total += sizeof(str_slot) + n->slots[i].length;
+  for (middle = 0; 2 * half < total; middle++)
+    half += sizeof(str_slot) + n->slots[middle].length;
+  if (middle > n->num_keys - 1)
+    middle = n->num_keys - 1;
+
+  length = str_key(copy, middle, separator);
+  if (n->level == 0)
+  {
+    last_length = str_key(copy, middle - 1, last);
+    for (i = 0; i < last_length && last[i] == separator[i]; i++)
+      ;
+    length = i + 1;
+    STAT_ADD(leaf_splits, 1);
+  }
+  else
+  {
+    right->first = copy->slots[middle].child;
+    STAT_ADD(internal_splits, 1);
+  }
+  *separator_length = length;
+
+  str_fill(right, copy, n->level == 0 ? middle : middle + 1, copy->num_keys,
+           separator, length, str_bytes(copy, copy->high_offset), copy->high_length);
+  str_fill(n, copy, 0, middle, str_bytes(copy, copy->low_offset), copy->low_length, separator, length);
+  return right;
+}
+
+// Latches a node of the string-key tree under lock coupling.
+void str_latch(str_node *n, bool exclusive)
+{
+  if (concurrency != CC_COUPLING)
+    return;
+  if (exclusive)
+    latch_write(&n->latch);
+  else
+    latch_read(&n->latch);
+}
+
+void str_unlatch(str_node *n)
+{
+  if (concurrency == CC_COUPLING)
+    pthread_rwlock_unlock(&n->latch);
+}
+
+/* Descends to the leaf that should hold the key. Under lock
+ * coupling each node is latched in shared mode until its
+ * child is, and the leaf is returned latched, exclusively
+ * if asked to; otherwise the caller holds the global
+ * rwlock. Returns NULL, with nothing latched, if the tree
+ * is empty.
+ */
+str_node *str_find_leaf(str_node **root, const uint8_t *key, int length, bool exclusive)
+{
+  str_node *n, *child;
+  bool coupled = concurrency == CC_COUPLING;
+
+  if (coupled)
+    latch_read(&root_latch);
+  n = *root;
+  if (n != NULL)
+    str_latch(n, exclusive && n->level == 0);
+  if (coupled)
+    pthread_rwlock_unlock(&root_latch);
+  if (n == NULL)
+    return NULL;
+
+  while (n->level > 0)
+  {
+    child = str_child(n, key, length);
+    str_latch(child, exclusive && child->level == 0);
+    str_unlatch(n);
+    n = child;
+  }
+  return n;
+}
+
+/* Inserts a key from the root down, splitting full nodes on
+ * the way back up. Under lock coupling the path is latched
+ * exclusively, and a node with room for any key lets go of
+ * the latches above it, as no split can reach them.
+ */
+bool str_insert_path(str_node **root, const uint8_t *key, int length, tree_value value)
+{
+  str_node *path[MAX_HEIGHT], *n, *right, *new_root;
+  uint8_t separators[2][STR_KEY_MAX];
+  uint8_t *separator = separators[0];
+  str_slot entry = {.value = value};
+  bool coupled = concurrency == CC_COUPLING, root_latched = coupled, inserted, found;
+  int depth = 0, held = 0, d, i, separator_length;
+
+  if (coupled)
+    latch_write(&root_latch);
+  if (*root == NULL)
+    *root = str_make_node(0);
+
+  n = *root;
+  while (true)
+  {
+    str_latch(n, true);
+    if (coupled && str_room(n, STR_KEY_MAX))
+    {
+      if (root_latched)
+        pthread_rwlock_unlock(&root_latch);
+      root_latched = false;
+      while (held < depth)
+        pthread_rwlock_unlock(&path[held++]->latch);
+    }
+    path[depth++] = n;
+    if (n->level == 0)
+      break;
+    n = str_child(n, key, length);
+  }
+
+  i = str_rank(n, key, length, &found);
+  inserted = !found;
+  for (d = depth - 1; inserted; n = path[--d])
+  {
+    if (str_room(n, length))
+    {
+      str_insert_at(n, i, key, length, &entry);
+      break;
+    }
+    right = str_split(n, separator, &separator_length);
+    if (str_compare(key, length, separator, separator_length) >= 0)
+      n = right;
+    str_insert_at(n, str_rank(n, key, length, &found), key, length, &entry);
+
+    // The separator and the new sibling go into the parent next.
+    entry.child = right;
+    key = separator;
+    length = separator_length;
+    separator = separator == separators[0] ? separators[1] : separators[0];
+    if (d == 0)
+    {
+      new_root = str_make_node(path[0]->level + 1);
+      new_root->first = path[0];
+      str_insert_at(new_root, 0, key, length, &entry);
+      *root = new_root;
+      STAT_ADD(root_splits, 1);
+      break;
+    }
+    i = str_rank(path[d - 1], key, length, &found);
+  }
+
+  if (root_latched)
+    pthread_rwlock_unlock(&root_latch);
+  while (coupled && held < depth)
+    pthread_rwlock_unlock(&path[held++]->latch);
+  return inserted;
+}
+
+/* Inserts a string key of at most STR_KEY_MAX bytes along
+ * with its value. Returns false if the key is already
+ * present. Under lock coupling the leaf is first latched
+ * as a deletion would; only if it is full is the descent
+ * made again with the path latched.
+ */
+bool str_insert(str_node **root, const uint8_t *key, int length, tree_value value)
+{
+  str_node *leaf;
+  str_slot entry = {.value = value};
+  bool found, inserted;
+  int i;
+
+  if (concurrency != CC_COUPLING)
+  {
+    latch_write(&rwlock);
+    inserted = str_insert_path(root, key, length, value);
+    pthread_rwlock_unlock(&rwlock);
+    return inserted;
+  }
+
+  leaf = str_find_leaf(root, key, length, true);
+  if (leaf != NULL)
+  {
+    i = str_rank(leaf, key, length, &found);
+    if (found || str_room(leaf, length))
+    {
+      if (!found)
+        str_insert_at(leaf, i, key, length, &entry);
+      str_unlatch(leaf);
+      return !found;
+    }
+    str_unlatch(leaf);
+  }
+  return str_insert_path(root, key, length, value);
+}
+
+/* Finds a string key and stores its value in *value, if
+ * value is not NULL. Returns false if it is not present.
+ */
+bool str_find(str_node **root, const uint8_t *key, int length, tree_value *value)
+{
+  str_node *leaf;
+  bool found = false;
+  int i;
+
+  if (concurrency != CC_COUPLING)
+    latch_read(&rwlock);
+  leaf = str_find_leaf(root, key, length, false);
+  if (leaf != NULL)
+  {
+    i = str_rank(leaf, key, length, &found);
+    if (found && value != NULL)
+      *value = leaf->slots[i].value;
+    str_unlatch(leaf);
+  }
+  if (concurrency != CC_COUPLING)
+    pthread_rwlock_unlock(&rwlock);
+  return found;
+}
+
+/* Deletes a string key. Returns false if it was not present.
+ * Nodes are never merged, however few keys they are left
+ * with, so only the leaf is latched for writing.
+ */
+bool str_delete(str_node **root, const uint8_t *key, int length)
+{
+  str_node *leaf;
+  bool found = false;
+  int i;
+
+  if (concurrency != CC_COUPLING)
+    latch_write(&rwlock);
+  leaf = str_find_leaf(root, key, length, true);
+  if (leaf != NULL)
+  {
+    i = str_rank(leaf, key, length, &found);
+    if (found)
+      str_remove_at(leaf, i);
+    str_unlatch(leaf);
+  }
+  if (concurrency != CC_COUPLING)
+    pthread_rwlock_unlock(&rwlock);
+  return found;
+}
+
+/* Adds up the nodes of a string-key tree, the keys in its
+ * leaves, and the bytes of those keys as stored and in
+ * full, to what the counts already hold.
+ */
+void str_tree_stats(str_node *n, long *nodes, long *keys, long *stored_bytes, long *key_bytes)
+{
+  int i;
+
+  (*nodes)++;
+  if (n->level > 0)
+  {
+    str_tree_stats(n->first, nodes, keys, stored_bytes, key_bytes);
+    for (i = 0; i < n->num_keys; i++)
+      str_tree_stats(n->slots[i].child, nodes, keys, stored_bytes, key_bytes);
+    return;
+  }
+  *keys += n->num_keys;
+  for (i = 0; i < n->num_keys; i++)
+  {
+    *stored_bytes += n->slots[i].length;
+    *key_bytes += n->prefix_length + n->slots[i].length;
+  }
+}
+
+void print_str_stats(str_node *root)
+{
+  long nodes = 0, keys = 0, stored_bytes = 0, key_bytes = 0;
+
+  if (root == NULL)
+    return;
+  str_tree_stats(root, &nodes, &keys, &stored_bytes, &key_bytes);
+  fprintf(stderr, "String keys: %ld in %ld nodes of %d bytes, height %d, %.1f bytes stored per key of %.1f\n",
+          keys, nodes, STR_NODE_BYTES, root->level + 1,
+          keys > 0 ? (double)stored_bytes / keys : 0, keys > 0 ? (double)key_bytes / keys : 0);
+}
+
+void str_destroy(str_node *n)
+{
+  int i;
+
+  if (n == NULL)
+    return;
+  if (n->level > 0)
+  {
+    str_destroy(n->first);
+    for (i = 0; i < n->num_keys; i++)
+      str_destroy(n->slots[i].child);
+  }
+  pthread_rwlock_destroy(&n->latch);
+  free(n);
+}
+
+/*---------------START BENCHMARK------------------*/
+
+//Emulated pthread spinlock and barrier for MAC OS X (SLOW!!!)
+#if defined(__APPLE__) && defined(__MACH__)
+
+#include <libkern/OSAtomic.h>
+
+typedef volatile OSSpinLock pthread_spinlock_t;
+
+#ifndef PTHREAD_PROCESS_SHARED
+#define PTHREAD_PROCESS_SHARED 1
+#endif
+#ifndef PTHREAD_PROCESS_PRIVATE
+#define PTHREAD_PROCESS_PRIVATE 2
+#endif
+
+static inline int pthread_spin_init(pthread_spinlock_t *lock, int pshared)
+{
+  *lock = OS_SPINLOCK_INIT;
+  return 0;
+}
+
+static inline int pthread_spin_destroy(pthread_spinlock_t *lock)
+{
+  return 0;
+}
+
+static inline int pthread_spin_lock(pthread_spinlock_t *lock)
+{
+  OSSpinLockLock(lock);
+  return 0;
+}
+
+static inline int pthread_spin_trylock(pthread_spinlock_t *lock)
+{
+  return !OSSpinLockTry(lock);
+}
+
+static inline int pthread_spin_unlock(pthread_spinlock_t *lock)
+{
+  OSSpinLockUnlock(lock);
+  return 0;
+}
+
+#ifndef PTHREAD_BARRIER_H_
+#define PTHREAD_BARRIER_H_
+
+#include <pthread.h>
+#include <errno.h>
+
+typedef int pthread_barrierattr_t;
+typedef struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int count;
+  int tripCount;
+} pthread_barrier_t;
+
+int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
+{
+  if (count == 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  if (pthread_mutex_init(&barrier->mutex, 0) < 0)
+  {
+    return -1;
+  }
+  if (pthread_cond_init(&barrier->cond, 0) < 0)
+  {
+    pthread_mutex_destroy(&barrier->mutex);
+    return -1;
+  }
+  barrier->tripCount = count;
+  barrier->count = 0;
+
+  return 0;
+}
+
+int pthread_barrier_destroy(pthread_barrier_t *barrier)
+{
+  pthread_cond_destroy(&barrier->cond);
+  pthread_mutex_destroy(&barrier->mutex);
+  return 0;
+}
+
+int pthread_barrier_wait(pthread_barrier_t *barrier)
+{
+  pthread_mutex_lock(&barrier->mutex);
+  ++(barrier->count);
+  if (barrier->count >= barrier->tripCount)
+  {
+    barrier->count = 0;
+    pthread_cond_broadcast(&barrier->cond);
+    pthread_mutex_unlock(&barrier->mutex);
+    return 1;
+  }
+  else
+  {
+    pthread_cond_wait(&barrier->cond, &(barrier->mutex));
+    pthread_mutex_unlock(&barrier->mutex);
+    return 0;
+  }
+}
+
+#endif // PTHREAD_BARRIER_H_
+#endif
+// END: Helper pthread spinlock function for MAC OS X
+
+int search_coupled(node **root, tree_key val)
+{
+  int i;
+  int found = 0;
+  node *leaf = find_leaf_shared(root, val, NULL, NULL);
+
+  if (leaf == NULL)
+    return 0;
+
+  i = leaf_index(leaf, leaf->num_keys, val);
+  if (i < leaf->num_keys)
+    found = slot_value(leaf->pointers[i]) == val;
+  pthread_rwlock_unlock(&leaf->latch);
+
+  return found;
+}
+
+// Better suited searching
+int search(node **root, tree_key val)
+{
+  int found = 0;
+  tree_value value;
+  void *slot;
+
+  epoch_enter();
+  if (finger_cache && finger_search(val, &found))
+  {
+    epoch_exit();
+    return found;
+  }
+
+  switch (concurrency)
+  {
+  case CC_COUPLING:
+    found = search_coupled(root, val);
+    break;
+  case CC_BLINK:
+  case CC_OLC:
+    found = (concurrency == CC_BLINK ? blink_find(__atomic_load_n(root, __ATOMIC_ACQUIRE), val, &slot)
+                                     : olc_find(root, val, &slot)) &&
+            slot_value(slot) == val;
+    break;
+  default:
+    latch_read(&rwlock);
+    found = find(*root, val, false, &value) && value == val;
+    pthread_rwlock_unlock(&rwlock);
+  }
+  epoch_exit();
+
+  return found;
+}
+
+// Prefetches the header of a node and the middle of its keys.
+void prefetch_node(node *n)
+{
+  __builtin_prefetch(n);
+  __builtin_prefetch((tree_key *)(n + 1) + (order - 1) / 2);
+}
+
+/* Takes one lookup of a batch one node further, down or
+ * to the right, and prefetches that node. Reads are
+ * validated against the node version as in blink_find(),
+ * and a lookup that saw a node change just stays where it
+ * is for the next round.
+ * Returns true once the lookup has reached its leaf and
+ * stored its result.
+ */
+bool search_batch_step(node **current, tree_key key, int *result)
+{
+  int i, num_keys;
+  uint64_t version;
+  void *slot = NULL;
+  node *next, *c = *current;
+
+  version = version_read_begin(c);
+  num_keys = c->num_keys;
+  if (num_keys > order - 1)
+    return false;
+
+  if (c->right != NULL && key >= c->high_key)
+    next = c->right;
+  else if (!c->is_leaf)
+    next = (node *)c->pointers[child_index(c->keys, num_keys, key)];
+  else
+  {
+    i = leaf_index(c, num_keys, key);
+    if (i < num_keys)
+      slot = c->pointers[i];
+    if (!version_validate(c, version))
+      return false;
+    *result = i < num_keys && slot_value(slot) == key;
+    return true;
+  }
+
+  if (!version_validate(c, version))
+    return false;
+  prefetch_node(next);
+  *current = next;
+  return false;
+}
+
+/* Looks up n keys at once, and sets results[i] as search()
+ * would for keys[i]. The keys are sorted in runs, and each
+ * group of lookups descends level by level in lockstep, so
+ * that the memory latency of one lookup overlaps with the
+ * work of the others. Lock coupling gets no such overlap,
+ * as a lookup there holds a latch on its node: each key is
+ * searched on its own.
+ * Returns the number of keys found.
+ */
+int search_batch(node **root, const tree_key keys[], int n, int results[])
+{
+  kv_pair sorted[SEARCH_BATCH_SORT];
+  node *current[SEARCH_BATCH_GROUP];
+  bool done[SEARCH_BATCH_GROUP];
+  int start, count, group, size, active, g, i, found = 0;
+  node *top;
+
+  if (concurrency == CC_COUPLING)
+  {
+    for (i = 0; i < n; i++)
+      found += results[i] = search(root, keys[i]);
+    return found;
+  }
+
+  for (start = 0; start < n; start += SEARCH_BATCH_SORT)
+  {
+    count = n - start < SEARCH_BATCH_SORT ? n - start : SEARCH_BATCH_SORT;
+    for (i = 0; i < count; i++)
+    {
+      sorted[i].key = keys[start + i];
+      sorted[i].value = start + i;
+    }
+    qsort(sorted, count, sizeof(kv_pair), compare_pairs);
+
+    epoch_enter();
+    if (concurrency == CC_GLOBAL)
+      latch_read(&rwlock);
+
+    top = __atomic_load_n(root, __ATOMIC_ACQUIRE);
+    if (top != NULL)
+      prefetch_node(top);
+
+    for (group = 0; group < count; group += SEARCH_BATCH_GROUP)
+    {
+      size = count - group < SEARCH_BATCH_GROUP ? count - group : SEARCH_BATCH_GROUP;
+      for (g = 0; g < size; g++)
+      {
+        current[g] = top;
+        done[g] = top == NULL;
+        if (done[g])
+          results[sorted[group + g].value] = 0;
+      }
+
+      active = top == NULL ? 0 : size;
+      while (active > 0)
+        for (g = 0; g < size; g++)
+          if (!done[g] && search_batch_step(&current[g], sorted[group + g].key,
+                                            &results[sorted[group + g].value]))
+          {
+            done[g] = true;
+            active--;
+          }
+    }
+
+    if (concurrency == CC_GLOBAL)
+      pthread_rwlock_unlock(&rwlock);
+    epoch_exit();
+  }
+
+  for (i = 0; i < n; i++)
+    found += results[i];
+  return found;
+}
+
+/* Reads length keys in order starting at key, through a
+ * buffer of SCAN_BUFFER entries. Returns 1 if all of them
+ * were there, 0 if the scan ran off the end of the tree.
+ */
+int scan(node **root, tree_key key, int length)
+{
+  tree_key keys[SCAN_BUFFER];
+  tree_value values[SCAN_BUFFER];
+  int count, read = 0;
+  cursor c;
+
+  cursor_seek(&c, root, key);
+  while (read < length)
+  {
+    count = cursor_next_batch(&c, keys, values,
+                              length - read < SCAN_BUFFER ? length - read : SCAN_BUFFER);
+    if (count == 0)
+      break;
+    read += count;
+  }
+
+  return read == length;
+}
+
+pthread_barrier_t bench_barrier;
+
+#define __THREAD_PINNING 0
+
+#define MAXITER 5000000
+
+node *root;
+
+/* RANDOM GENERATOR */
+// RANGE: (1 - r)
+tree_key rand_range_re(unsigned int *seed, long r)
+{
+#if KEY_BITS == 64
+  // rand_r() gives 31 bits, so wider ranges take two draws.
+  if (r > RAND_MAX)
+    return ((((tree_key)rand_r(seed) << 31) | rand_r(seed)) % r) + 1;
+#endif
+  return (rand_r(seed) % r) + 1;
+}
+
+// As rand_range_re(), drawing from rand().
+tree_key rand_range(long r)
+{
+#if KEY_BITS == 64
+  if (r > RAND_MAX)
+    return ((((tree_key)rand() << 31) | rand()) % r) + 1;
+#endif
+  return (rand() % r) + 1;
+}
+
+/* KEY GENERATOR */
+
+/* The constants of a Zipfian distribution over n ranks,
+ * from Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases", as used by YCSB.
+ */
+typedef struct zipf_params
+{
+  long n;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+} zipf_params;
+
+/* Per-thread state of the benchmark key generator. Keys
+ * come from a xoshiro256** generator, which is much faster
+ * than rand_r() and has no modulo bias.
+ */
+typedef struct key_generator
+{
+  int distribution;
+  uint64_t state[4];
+  long range;
+  long position; // Next step of a sequential walk.
+  long stride; // Step of a shuffled walk, coprime to range.
+  const zipf_params *zipf;
+} key_generator;
+
+// Newest key under KEY_LATEST, advanced by every insertion.
+uint64_t latest_key;
+
+// The SplitMix64 finalizer, used for seeding and to scatter Zipfian ranks.
+uint64_t mix64(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+uint64_t xoshiro_next(uint64_t s[4])
+{
+  uint64_t result = s[1] * 5, t = s[1] << 17;
+
+  result = ((result << 7) | (result >> 57)) * 9;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = (s[3] << 45) | (s[3] >> 19);
+  return result;
+}
+
+// Returns a number in [0, n) without the bias of a modulo.
+long xoshiro_below(uint64_t s[4], long n)
+{
+  return (long)(((unsigned __int128)xoshiro_next(s) * (uint64_t)n) >> 64);
+}
+
+// Returns a number in [0, 1).
+double xoshiro_double(uint64_t s[4])
+{
+  return (xoshiro_next(s) >> 11) * 0x1.0p-53;
+}
+
+/* Sums 1 / i^theta for i from 1 to n. Past ZIPF_EXACT_TERMS
+ * the sum is approximated by its integral, so that ranges
+ * beyond 2^31 take no longer to set up.
+ */
+double zipf_zeta(long n, double theta)
+{
+  double sum = 0;
+  long i, exact = n < ZIPF_EXACT_TERMS ? n : ZIPF_EXACT_TERMS;
+
+  for (i = 1; i <= exact; i++)
+    sum += 1 / pow(i, theta);
+  if (n > exact)
+    sum += (pow(n + 0.5, 1 - theta) - pow(exact + 0.5, 1 - theta)) / (1 - theta);
+  return sum;
+}
+
+void zipf_init(zipf_params *z, long n, double theta)
+{
+  z->n = n;
+  z->theta = theta;
+  z->alpha = 1 / (1 - theta);
+  z->zetan = zipf_zeta(n, theta);
+  z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zipf_zeta(2, theta) / z->zetan);
+}
+
+// Returns a rank in [0, n), 0 being the most frequent.
+long zipf_next(const zipf_params *z, uint64_t s[4])
+{
+  double u = xoshiro_double(s), uz = u * z->zetan;
+  long rank;
+
+  if (uz < 1)
+    return 0;
+  if (uz < 1 + pow(0.5, z->theta))
+    return 1;
+  rank = (long)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+  return rank < z->n ? rank : z->n - 1;
+}
+
+long gcd(long a, long b)
+{
+  long t;
 
-  return root;
+  while (b != 0)
+  {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
 }
 
-void destroy_tree_nodes(node *root)
+/* Prepares the generator of thread thread out of threads.
+ * Sequential walks start evenly spaced over the range, so
+ * that threads do not repeat each other's keys.
+ */
+void key_generator_init(key_generator *g, int distribution, long range, const zipf_params *zipf,
+                        int thread, int threads, uint64_t seed)
 {
   int i;
-  if (root->is_leaf)
-    for (i = 0; i < root->num_keys; i++)
-      free(root->pointers[i]);
-  else
-    for (i = 0; i < root->num_keys + 1; i++)
-      destroy_tree_nodes(root->pointers[i]);
 
-  free(root->pointers);
-  free(root->keys);
-  free(root);
+  g->distribution = distribution;
+  g->range = range;
+  g->zipf = zipf;
+  for (i = 0; i < 4; i++)
+    g->state[i] = mix64(seed + (i + 1) * 0x9E3779B97F4A7C15ULL);
+  g->position = (long)((unsigned __int128)range * thread / threads);
+
+  // A stride near the golden ratio of the range, coprime to it.
+  g->stride = (long)(range * 0.6180339887) | 1;
+  while (gcd(g->stride, range) != 1)
+    g->stride += 2;
 }
 
-void destroy_tree(node *root)
+/* Returns the key for the next benchmark operation, ops
+ * being its type (1 insert, 2 delete, 3 search):
+ *   uniform    - any key in the range, equally likely.
+ *   zipf       - Zipfian ranks, scattered over the range so
+ *                that hot keys do not share a leaf.
+ *   hotspot    - HOTSPOT_OPS% of keys from the first
+ *                HOTSPOT_KEYS% of the range.
+ *   latest     - insertions append keys above the range;
+ *                other operations pick recent keys, with
+ *                Zipfian recency (YCSB workload D).
+ *   sequential - each thread walks its share of the range.
+ *   shuffled   - as sequential, in a fixed scrambled order
+ *                that still visits every key once.
+ */
+tree_key next_key(key_generator *g, int ops)
 {
-  destroy_tree_nodes(root);
+  long hot, rank;
+  tree_key newest;
+
+  switch (g->distribution)
+  {
+  case KEY_ZIPF:
+    return (tree_key)(mix64(zipf_next(g->zipf, g->state)) % (uint64_t)g->range) + 1;
+  case KEY_HOTSPOT:
+    hot = g->range * HOTSPOT_KEYS / 100;
+    if (hot < 1 || hot == g->range || xoshiro_below(g->state, 100) < HOTSPOT_OPS)
+      return xoshiro_below(g->state, hot > 0 ? hot : g->range) + 1;
+    return hot + xoshiro_below(g->state, g->range - hot) + 1;
+  case KEY_LATEST:
+    // Past KEY_MAX the keys start over from 1.
+    if (ops == 1)
+      return (tree_key)((__atomic_add_fetch(&latest_key, 1, __ATOMIC_RELAXED) - 1) % KEY_MAX) + 1;
+    newest = (tree_key)((__atomic_load_n(&latest_key, __ATOMIC_RELAXED) - 1) % KEY_MAX) + 1;
+    rank = zipf_next(g->zipf, g->state);
+    return newest > rank ? newest - rank : 1;
+  case KEY_SEQUENTIAL:
+    rank = g->position++ % g->range;
+    return rank + 1;
+  case KEY_SHUFFLED:
+    rank = g->position++ % g->range;
+    return (tree_key)((unsigned __int128)rank * g->stride % g->range) + 1;
+  }
+  return xoshiro_below(g->state, g->range) + 1;
 }
 
-/*---------------START BENCHMARK------------------*/
+/* simple function for generating random integer for probability, only works on value of integer 1-100% */
+#define MAX_POOL 1000
 
-//Emulated pthread spinlock and barrier for MAC OS X (SLOW!!!)
-#if defined(__APPLE__) && defined(__MACH__)
+int p_pool[MAX_POOL];
 
-#include <libkern/OSAtomic.h>
+void prepare_randintp(float ins, float del)
+{
+  int i, j = 0;
 
-typedef volatile OSSpinLock pthread_spinlock_t;
+  // Put insert
+  for (i = 0; i < ins * MAX_POOL / 100; i++)
+    p_pool[j++] = 1;
 
-#ifndef PTHREAD_PROCESS_SHARED
-#define PTHREAD_PROCESS_SHARED 1
-#endif
-#ifndef PTHREAD_PROCESS_PRIVATE
-#define PTHREAD_PROCESS_PRIVATE 2
-#endif
+  // Put delete
+  for (i = 0; i < del * MAX_POOL / 100; i++)
+    p_pool[j++] = 2;
 
-static inline int pthread_spin_init(pthread_spinlock_t *lock, int pshared)
-{
-  *lock = OS_SPINLOCK_INIT;
-  return 0;
+  // Put search
+  for (i = j; i < MAX_POOL; i++)
+    p_pool[j++] = 3;
 }
 
-static inline int pthread_spin_destroy(pthread_spinlock_t *lock)
+/* LATENCY HISTOGRAMS */
+const char *latency_op_names[] = {"insert", "delete", "search"};
+const char *latency_format_names[] = {"off", "text", "CSV", "JSON"};
+
+// Counts of operation latencies, in nanoseconds.
+typedef struct latency_histogram
 {
-  return 0;
+  long counts[LATENCY_BUCKETS];
+  long total;
+  uint64_t max;
+} latency_histogram;
+
+uint64_t clock_nsec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static inline int pthread_spin_lock(pthread_spinlock_t *lock)
+/* Values below LATENCY_SUB have a bucket each. Above that,
+ * a value goes by its top LATENCY_SUB_BITS + 1 bits and the
+ * power of two it lies in.
+ */
+int latency_bucket(uint64_t nsec)
 {
-  OSSpinLockLock(lock);
-  return 0;
+  int shift;
+
+  if (nsec < LATENCY_SUB)
+    return (int)nsec;
+  shift = 63 - __builtin_clzll(nsec) - LATENCY_SUB_BITS;
+  return (shift + 1) * LATENCY_SUB + (int)(nsec >> shift) - LATENCY_SUB;
 }
 
-static inline int pthread_spin_trylock(pthread_spinlock_t *lock)
+// The highest value that falls into a bucket.
+uint64_t latency_bucket_high(int bucket)
 {
-  return !OSSpinLockTry(lock);
+  int shift;
+
+  if (bucket < LATENCY_SUB)
+    return bucket;
+  shift = bucket / LATENCY_SUB - 1;
+  return ((uint64_t)(LATENCY_SUB + bucket % LATENCY_SUB) << shift) + ((1ULL << shift) - 1);
 }
 
-static inline int pthread_spin_unlock(pthread_spinlock_t *lock)
+// Counts count operations that took nsec each.
+void latency_record(latency_histogram *h, uint64_t nsec, long count)
 {
-  OSSpinLockUnlock(lock);
-  return 0;
+  h->counts[latency_bucket(nsec)] += count;
+  h->total += count;
+  if (nsec > h->max)
+    h->max = nsec;
 }
 
-#ifndef PTHREAD_BARRIER_H_
-#define PTHREAD_BARRIER_H_
+void latency_merge(latency_histogram *into, const latency_histogram *from)
+{
+  int i;
 
-#include <pthread.h>
-#include <errno.h>
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+    into->counts[i] += from->counts[i];
+  into->total += from->total;
+  if (from->max > into->max)
+    into->max = from->max;
+}
 
-typedef int pthread_barrierattr_t;
-typedef struct
+/* Returns a latency that at least percent of the operations
+ * did not exceed, to within the width of its bucket.
+ */
+uint64_t latency_percentile(const latency_histogram *h, double percent)
 {
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-  int count;
-  int tripCount;
-} pthread_barrier_t;
+  long seen = 0, target = (long)ceil(h->total * percent / 100);
+  int i;
 
-int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
-{
-  if (count == 0)
-  {
-    errno = EINVAL;
-    return -1;
-  }
-  if (pthread_mutex_init(&barrier->mutex, 0) < 0)
+  if (target < 1)
+    target = 1;
+  for (i = 0; i < LATENCY_BUCKETS; i++)
   {
-    return -1;
+    seen += h->counts[i];
+    if (seen >= target)
+      return latency_bucket_high(i) < h->max ? latency_bucket_high(i) : h->max;
   }
-  if (pthread_cond_init(&barrier->cond, 0) < 0)
+  return h->max;
+}
+
+// Prints p50, p99, p99.9 and max of each operation type that ran.
+void print_latency(const latency_histogram latency[3], int format)
+{
+  const latency_histogram *h;
+  int op;
+  bool first = true;
+
+  if (format == LATENCY_CSV)
+    fprintf(stderr, "latency,op,count,p50_ns,p99_ns,p999_ns,max_ns\n");
+  else if (format == LATENCY_JSON)
+    fprintf(stderr, "{\"latency\": {");
+
+  for (op = 0; op < 3; op++)
   {
-    pthread_mutex_destroy(&barrier->mutex);
-    return -1;
+    h = &latency[op];
+    if (h->total == 0)
+      continue;
+
+    switch (format)
+    {
+    case LATENCY_TEXT:
+      fprintf(stderr, "Latency %s: %ld ops, p50 %.2f, p99 %.2f, p99.9 %.2f, max %.2f usec\n",
+              latency_op_names[op], h->total,
+              latency_percentile(h, 50) / 1e3, latency_percentile(h, 99) / 1e3,
+              latency_percentile(h, 99.9) / 1e3, h->max / 1e3);
+      break;
+    case LATENCY_CSV:
+      fprintf(stderr, "latency,%s,%ld,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+              latency_op_names[op], h->total,
+              latency_percentile(h, 50), latency_percentile(h, 99),
+              latency_percentile(h, 99.9), h->max);
+      break;
+    case LATENCY_JSON:
+      fprintf(stderr, "%s\"%s\": {\"count\": %ld, \"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+                      ", \"p999_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}",
+              first ? "" : ", ", latency_op_names[op], h->total,
+              latency_percentile(h, 50), latency_percentile(h, 99),
+              latency_percentile(h, 99.9), h->max);
+      break;
+    }
+    first = false;
   }
-  barrier->tripCount = count;
-  barrier->count = 0;
 
-  return 0;
+  if (format == LATENCY_JSON)
+    fprintf(stderr, "}}\n");
 }
 
-int pthread_barrier_destroy(pthread_barrier_t *barrier)
+/* TIME SERIES */
+
+// Operations that finished within one interval of a timed benchmark.
+typedef struct series_sample
 {
-  pthread_cond_destroy(&barrier->cond);
-  pthread_mutex_destroy(&barrier->mutex);
-  return 0;
+  long ops;
+  uint64_t total_nsec;
+  uint64_t max_nsec;
+} series_sample;
+
+/* Counts count operations that took nsec each and finished
+ * elapsed nanoseconds into the run. Ones that finish after
+ * the last interval, once the run is over, are left out.
+ */
+void series_record(series_sample *series, long num_samples, uint64_t sample_nsec,
+                   uint64_t elapsed, uint64_t nsec, long count)
+{
+  long i = elapsed / sample_nsec;
+  series_sample *s;
+
+  if (i >= num_samples)
+    return;
+  s = &series[i];
+  s->ops += count;
+  s->total_nsec += nsec * count;
+  if (nsec > s->max_nsec)
+    s->max_nsec = nsec;
 }
 
-int pthread_barrier_wait(pthread_barrier_t *barrier)
+/* Prints the intervals of a run that lasted duration_nsec,
+ * each as the time it ends at. The last one may be shorter
+ * than sample_nsec, and its rate is taken over its length.
+ */
+void print_series(const series_sample *series, long num_samples, uint64_t sample_nsec, uint64_t duration_nsec)
 {
-  pthread_mutex_lock(&barrier->mutex);
-  ++(barrier->count);
-  if (barrier->count >= barrier->tripCount)
+  long i;
+  uint64_t end, length;
+
+  fprintf(stderr, "series,msec,ops,ops_per_sec,mean_usec,max_usec\n");
+  for (i = 0; i < num_samples; i++)
   {
-    barrier->count = 0;
-    pthread_cond_broadcast(&barrier->cond);
-    pthread_mutex_unlock(&barrier->mutex);
-    return 1;
+    end = (i + 1) * sample_nsec < duration_nsec ? (i + 1) * sample_nsec : duration_nsec;
+    length = end - i * sample_nsec;
+    fprintf(stderr, "series,%" PRIu64 ",%ld,%.0f,%.2f,%.2f\n",
+            end / 1000000, series[i].ops, series[i].ops * 1e9 / length,
+            series[i].ops ? series[i].total_nsec / 1e3 / series[i].ops : 0.0, series[i].max_nsec / 1e3);
   }
-  else
+}
+
+/* Waits until the monotonic clock reaches nsec. Sleeps wake
+ * up tens of microseconds late, which an open loop benchmark
+ * would count against the tree, so the last WAIT_SPIN_NSEC
+ * are spent spinning instead.
+ */
+void wait_until(uint64_t nsec)
+{
+  struct timespec ts;
+  uint64_t now = clock_nsec();
+
+  if (now + WAIT_SPIN_NSEC < nsec)
   {
-    pthread_cond_wait(&barrier->cond, &(barrier->mutex));
-    pthread_mutex_unlock(&barrier->mutex);
-    return 0;
+    ts.tv_sec = (nsec - WAIT_SPIN_NSEC) / 1000000000;
+    ts.tv_nsec = (nsec - WAIT_SPIN_NSEC) % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
   }
+  while (clock_nsec() < nsec)
+    ;
 }
 
-#endif // PTHREAD_BARRIER_H_
-#endif
-// END: Helper pthread spinlock function for MAC OS X
+/* HARDWARE COUNTERS */
 
-// Better suited searching
-int search(node *root, int val)
+/* Hardware events of one thread over a measured region, or
+ * the sum over several threads. An event that the CPU or
+ * the kernel does not offer is not counted.
+ */
+typedef struct hw_counters
 {
-  pthread_rwlock_rdlock(&rwlock);
-  record *ret = find(root, val, 0);
-  pthread_rwlock_unlock(&rwlock);
+  int fd[NUM_HW_COUNTERS];
+  bool counted[NUM_HW_COUNTERS];
+  double value[NUM_HW_COUNTERS];
+} hw_counters;
+
+#ifdef __linux__
+/* Opens a disabled counter of an event for the calling
+ * thread, on whichever CPU it runs. Only user space is
+ * counted, which perf_event_paranoid up to 2 allows.
+ * Returns the file descriptor, or -1.
+ */
+int hw_counter_open(int counter)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.type = PERF_TYPE_HARDWARE;
+  switch (counter)
+  {
+  case HW_CYCLES:
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case HW_INSTRUCTIONS:
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case HW_LLC_MISSES:
+    // The generic cache miss event is the last level cache on x86.
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    break;
+  case HW_DTLB_MISSES:
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  default:
+    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+  }
 
-  if (ret != NULL && ret->value == val)
-    return 1;
-  else
-    return 0;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
 }
+#endif
 
-pthread_barrier_t bench_barrier;
+/* Opens the counters of the calling thread, if -P is given,
+ * without starting them. Opening takes a few system calls,
+ * so it is done before the measured region.
+ */
+void hw_counters_open(hw_counters *c)
+{
+  int i;
 
-#define __THREAD_PINNING 0
+  memset(c, 0, sizeof(hw_counters));
+  for (i = 0; i < NUM_HW_COUNTERS; i++)
+  {
+    c->fd[i] = -1;
+    if (!hw_counting)
+      continue;
+#ifdef __linux__
+    c->fd[i] = hw_counter_open(i);
+    if (c->fd[i] < 0 && hw_counter_errno == 0)
+      hw_counter_errno = errno;
+#else
+    hw_counter_errno = ENOSYS;
+#endif
+  }
+}
 
-#define MAXITER 5000000
+// Starts counting from zero.
+void hw_counters_start(hw_counters *c)
+{
+#ifdef __linux__
+  int i;
 
-node *root;
+  for (i = 0; i < NUM_HW_COUNTERS; i++)
+  {
+    if (c->fd[i] < 0)
+      continue;
+    ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
 
-/* RANDOM GENERATOR */
-// RANGE: (1 - r)
-int rand_range_re(unsigned int *seed, long r)
+/* Stops counting and reads the counts since the start. A
+ * count is scaled up by the share of the time its event was
+ * actually on the PMU, if the kernel had to multiplex it
+ * with others.
+ */
+void hw_counters_stop(hw_counters *c)
 {
-  return (rand_r(seed) % r) + 1;
+#ifdef __linux__
+  int i;
+  uint64_t data[3]; // Count, time enabled, time running.
+
+  for (i = 0; i < NUM_HW_COUNTERS; i++)
+    if (c->fd[i] >= 0)
+      ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+
+  for (i = 0; i < NUM_HW_COUNTERS; i++)
+  {
+    c->counted[i] = false;
+    if (c->fd[i] < 0 || read(c->fd[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+      continue;
+    c->counted[i] = true;
+    c->value[i] = (double)data[0] * data[1] / data[2];
+  }
+#endif
 }
 
-/* simple function for generating random integer for probability, only works on value of integer 1-100% */
-#define MAX_POOL 1000
+void hw_counters_close(hw_counters *c)
+{
+  int i;
 
-int p_pool[MAX_POOL];
+  for (i = 0; i < NUM_HW_COUNTERS; i++)
+  {
+    if (c->fd[i] >= 0)
+      close(c->fd[i]);
+    c->fd[i] = -1;
+  }
+}
 
-void prepare_randintp(float ins, float del)
+void hw_counters_add(hw_counters *into, const hw_counters *from)
 {
-  int i, j = 0;
+  int i;
 
-  // Put insert
-  for (i = 0; i < ins * MAX_POOL / 100; i++)
-    p_pool[j++] = 1;
+  for (i = 0; i < NUM_HW_COUNTERS; i++)
+  {
+    if (!from->counted[i])
+      continue;
+    into->counted[i] = true;
+    into->value[i] += from->value[i];
+  }
+}
 
-  // Put delete
-  for (i = 0; i < del * MAX_POOL / 100; i++)
-    p_pool[j++] = 2;
+/* Prints the counts divided by the number of operations
+ * they were taken over, e.g. "Counters search: per op 812.3
+ * cycles, 1024.0 instructions (1.26 IPC), 4.12 LLC misses".
+ */
+void print_hw_counters(const char *label, const hw_counters *c, long ops)
+{
+  int i, printed = 0;
 
-  // Put search
-  for (i = j; i < MAX_POOL; i++)
-    p_pool[j++] = 3;
+  if (!hw_counting || ops == 0)
+    return;
+
+  for (i = 0; i < NUM_HW_COUNTERS; i++)
+  {
+    if (!c->counted[i])
+      continue;
+    if (printed++ == 0)
+      fprintf(stderr, "Counters %s: per op", label);
+    else
+      fprintf(stderr, ",");
+    fprintf(stderr, " %.2f %s", c->value[i] / ops, hw_counter_names[i]);
+    if (i == HW_INSTRUCTIONS && c->counted[HW_CYCLES] && c->value[HW_CYCLES] > 0)
+      fprintf(stderr, " (%.2f IPC)", c->value[HW_INSTRUCTIONS] / c->value[HW_CYCLES]);
+  }
+  if (printed == 0)
+    fprintf(stderr, "Counters %s: unavailable (%s)\n", label, strerror(hw_counter_errno));
+  else
+    fprintf(stderr, "\n");
 }
 
 /* Struct for data input/output per-thread */
 struct arg_bench
 {
   unsigned rank;
-  int size;
+  long size;
   unsigned seed;
   unsigned seed2;
   unsigned update;
@@ -1373,62 +7501,190 @@ struct arg_bench
   long timer;
   long *inputs;
   int *ops;
+  int batch; // Searches to gather for each search_batch(), 0 to call search().
+  int scan; // Keys to read per range scan, 0 for point searches.
+  int locality; // Percentage of keys drawn within LOCALITY_WINDOW of the previous one.
+  latency_histogram *latency; // One per operation type, or NULL to not time operations.
+  int cpu; // CPU to pin the thread to, or -1.
+  key_generator keys;
+  double key_nsec; // Average time next_key() took, measured before the start.
+  long duration_msec; // Run until this much time has passed, if not 0.
+  uint64_t period_nsec; // Open loop: start one operation this often, if not 0.
+  uint64_t phase_nsec; // Open loop: when the first operation is due, after the start.
+  series_sample *series; // Intervals of sample_nsec, or NULL.
+  long num_samples;
+  uint64_t sample_nsec;
+  hw_counters counters; // Over the measured loop, with -P.
 };
 
 void *do_bench(void *arguments)
 {
   long counter[3] = {0},
        success[3] = {0};
-  int val = 0;
+  tree_key val = 0;
   unsigned *pool;
   int ops, ret = 0;
-  int b_size;
+  long b_size;
   long cont = 0;
   long max_iter = 0;
+  tree_key *batch_keys = NULL;
+  int *batch_results = NULL;
+  int batch_count = 0;
+  uint64_t op_start = 0, now = 0, bench_start, deadline = 0, intended;
+  long samples;
+  uint8_t key[STR_KEY_MAX + 1];
+  int key_length = 0;
 
   struct timeval start, end;
   struct arg_bench *args = arguments;
+  bool timed = args->latency != NULL || args->series != NULL || args->duration_msec > 0;
 
   max_iter = args->max_iter;
   b_size = args->size;
   pool = args->pool;
 
+  key_generator probe;
+  struct timespec probe_start, probe_end;
+
+  if (args->cpu >= 0)
+    pin_thread(args->cpu);
+
+  // Time the key generator on a copy, so the run draws the same keys.
+  probe = args->keys;
+  clock_gettime(CLOCK_MONOTONIC, &probe_start);
+  for (cont = 0; cont < KEY_GENERATOR_PROBES; cont++)
+    val += next_key(&probe, 3);
+  clock_gettime(CLOCK_MONOTONIC, &probe_end);
+  args->key_nsec = ((probe_end.tv_sec - probe_start.tv_sec) * 1e9 + probe_end.tv_nsec - probe_start.tv_nsec) /
+                   KEY_GENERATOR_PROBES;
+  cont = 0;
+  val = 0;
+
+  if (args->batch > 0)
+  {
+    batch_keys = malloc(args->batch * sizeof(tree_key));
+    batch_results = malloc(args->batch * sizeof(int));
+    if (batch_keys == NULL || batch_results == NULL)
+    {
+      perror("Search batch");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  hw_counters_open(&args->counters);
   pthread_barrier_wait(&bench_barrier);
 
+  hw_counters_start(&args->counters);
   gettimeofday(&start, NULL);
+  bench_start = clock_nsec();
+  intended = bench_start + args->phase_nsec;
+  if (args->duration_msec > 0)
+    deadline = bench_start + args->duration_msec * 1000000ULL;
 
   /* Check the flag once in a while to see when to quit. */
   while (cont < max_iter)
   {
     //--For a completely random values (original)
     ops = pool[rand_range_re(&args->seed, MAX_POOL) - 1];
-    val = rand_range_re(&args->seed2, b_size);
+    if (args->locality > 0 && val > 0 && rand_range_re(&args->seed2, 100) <= args->locality)
+    {
+      // Stay close to the previous key, as a client with key locality would.
+      val += rand_range_re(&args->seed2, 2 * LOCALITY_WINDOW + 1) - LOCALITY_WINDOW - 1;
+      if (val < 1)
+        val = 1;
+      else if (val > b_size)
+        val = b_size;
+    }
+    else
+      val = next_key(&args->keys, ops);
+    if (key_type == KEY_TYPE_STRING)
+      key_length = str_key_format(val, key);
 
     //DEBUG_PRINT("ops:%d, val:%ld\n", ops, val);
 
+    if (args->period_nsec > 0)
+    {
+      // Open loop: an operation that starts late is timed from when it was due.
+      wait_until(intended);
+      op_start = intended;
+      intended += args->period_nsec;
+    }
+    else if (timed)
+      op_start = clock_nsec();
+    samples = 1;
     switch (ops)
     {
     case 1:
-      root = insert(&root, val, val);
+      if (key_type == KEY_TYPE_STRING)
+        ret = str_insert(&str_root, key, key_length, val);
+      else
+        ret = insert(&root, val, val);
       break;
     case 2:
-      root = delete (root, val);
+      if (key_type == KEY_TYPE_STRING)
+        ret = str_delete(&str_root, key, key_length);
+      else
+        ret = delete (&root, val);
       break;
     case 3:
-      ret = search(root, val);
+      if (key_type == KEY_TYPE_STRING)
+        ret = str_find(&str_root, key, key_length, NULL);
+      else if (args->scan > 0)
+        ret = scan(&root, val, args->scan);
+      else if (args->batch > 0)
+      {
+        // Counted as found, and timed, once the batch is searched.
+        batch_keys[batch_count++] = val;
+        ret = 0;
+        samples = 0;
+        if (batch_count == args->batch)
+        {
+          success[2] += search_batch(&root, batch_keys, batch_count, batch_results);
+          samples = batch_count;
+          batch_count = 0;
+        }
+      }
+      else
+        ret = search(&root, val);
       break;
     default:
       exit(EXIT_SUCCESS);
       break;
     }
+    if (timed)
+      now = clock_nsec();
+    if (args->latency != NULL && samples > 0)
+      latency_record(&args->latency[ops - 1], now - op_start, samples);
+    if (args->series != NULL && samples > 0)
+      series_record(args->series, args->num_samples, args->sample_nsec, now - bench_start, now - op_start, samples);
     cont++;
     counter[ops - 1]++;
 
     if (ret)
       success[ops - 1]++;
+    if (deadline != 0 && now >= deadline)
+      break;
+  }
+
+  if (batch_count > 0)
+  {
+    if (timed)
+      op_start = clock_nsec();
+    success[2] += search_batch(&root, batch_keys, batch_count, batch_results);
+    if (timed)
+      now = clock_nsec();
+    if (args->latency != NULL)
+      latency_record(&args->latency[2], now - op_start, batch_count);
+    if (args->series != NULL)
+      series_record(args->series, args->num_samples, args->sample_nsec, now - bench_start, now - op_start, batch_count);
   }
 
   gettimeofday(&end, NULL);
+  hw_counters_stop(&args->counters);
+  hw_counters_close(&args->counters);
+
+  free(batch_keys);
+  free(batch_results);
 
   args->counter_ins = counter[0];
   args->counter_del = counter[1];
@@ -1445,7 +7701,7 @@ void *do_bench(void *arguments)
   pthread_exit(arguments);
 }
 
-int benchmark(int threads, int size, float ins, float del)
+int benchmark(int threads, long size, float ins, float del)
 {
   pthread_t *pid;
   long *inputs;
@@ -1454,6 +7710,12 @@ int benchmark(int threads, int size, float ins, float del)
   int i, k;
 
   struct arg_bench *args, *arg;
+  latency_histogram *latency = NULL;
+  zipf_params zipf;
+  double key_nsec = 0;
+  series_sample *series = NULL;
+  long num_samples = 0;
+  hw_counters counters;
 
   args = calloc(threads, sizeof(struct arg_bench));
 
@@ -1462,6 +7724,10 @@ int benchmark(int threads, int size, float ins, float del)
 
   prepare_randintp(ins, del);
 
+  if (key_distribution == KEY_ZIPF || key_distribution == KEY_LATEST)
+    zipf_init(&zipf, size, zipf_theta);
+  latest_key = size;
+
   long ncores = sysconf(_SC_NPROCESSORS_ONLN);
   int midcores = (int)ncores / 2;
 
@@ -1497,15 +7763,53 @@ int benchmark(int threads, int size, float ins, float del)
     arg->inputs = inputs;
     arg->ops = ops;
 
-    arg->max_iter = ceil(MAXITER / threads);
+    if (bench_duration > 0)
+      arg->max_iter = LONG_MAX; // Stopped by the clock instead.
+    else
+      arg->max_iter = ceil(MAXITER / threads);
+    arg->batch = batch_size;
+    arg->scan = scan_length;
+    arg->locality = locality;
+    arg->cpu = num_affinity_cpus > 0 ? affinity_cpus[i % num_affinity_cpus] : -1;
+    key_generator_init(&arg->keys, key_distribution, size, &zipf, i, threads, rand());
+
+    arg->duration_msec = bench_duration * 1000L;
+    arg->period_nsec = bench_rate > 0 ? (uint64_t)(1e9 * threads / bench_rate) : 0;
+    // Threads take turns, so that operations arrive evenly rather than in bursts.
+    arg->phase_nsec = arg->period_nsec * i / threads;
+    arg->series = NULL;
+    arg->sample_nsec = sample_msec * 1000000ULL;
+    if (bench_duration > 0)
+    {
+      arg->num_samples = num_samples = (bench_duration * 1000L + sample_msec - 1) / sample_msec;
+      arg->series = calloc(num_samples, sizeof(series_sample));
+      if (arg->series == NULL)
+      {
+        perror("Time series");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    arg->latency = NULL;
+    if (latency_report != LATENCY_OFF)
+    {
+      arg->latency = calloc(3, sizeof(latency_histogram));
+      if (arg->latency == NULL)
+      {
+        perror("Latency histograms");
+        exit(EXIT_FAILURE);
+      }
+    }
   }
 
   pid = calloc(threads, sizeof(pthread_t));
 
   pthread_barrier_init(&bench_barrier, NULL, threads);
 
-  fprintf(stderr, "\nStarting benchmark...");
-  fprintf(stderr, "\n0: %d, %0.2f, %0.2f, %d, ", size, ins, del, threads);
+  // Count only the splits and merges of the benchmark itself.
+  reset_structure_stats();
+
+  fprintf(stderr, "\nStarting benchmark...\n");
 
   for (i = 0; i < threads; i++)
     pthread_create(&pid[i], NULL, &do_bench, &args[i]);
@@ -1513,11 +7817,6 @@ int benchmark(int threads, int size, float ins, float del)
   for (i = 0; i < threads; i++)
     pthread_join(pid[i], NULL);
 
-#ifdef __USEPCM
-  pcm_bench_end();
-  pcm_bench_print();
-#endif
-
   struct arg_bench result = {
       .counter_del = 0,
       .counter_del_s = 0,
@@ -1527,6 +7826,7 @@ int benchmark(int threads, int size, float ins, float del)
       .counter_search_s = 0,
       .timer = 0};
 
+  memset(&counters, 0, sizeof(counters));
   for (i = 0; i < threads; i++)
   {
     arg = &args[i];
@@ -1540,8 +7840,62 @@ int benchmark(int threads, int size, float ins, float del)
 
     if (arg->timer > result.timer)
       result.timer = arg->timer;
+    key_nsec += arg->key_nsec / threads;
+    hw_counters_add(&counters, &arg->counters);
+  }
+
+  if (bench_duration > 0)
+  {
+    series = calloc(num_samples, sizeof(series_sample));
+    if (series == NULL)
+    {
+      perror("Time series");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < threads; i++)
+    {
+      for (k = 0; k < num_samples; k++)
+      {
+        series[k].ops += args[i].series[k].ops;
+        series[k].total_nsec += args[i].series[k].total_nsec;
+        if (args[i].series[k].max_nsec > series[k].max_nsec)
+          series[k].max_nsec = args[i].series[k].max_nsec;
+      }
+      free(args[i].series);
+    }
+  }
+
+  if (latency_report != LATENCY_OFF)
+  {
+    latency = calloc(3, sizeof(latency_histogram));
+    if (latency == NULL)
+    {
+      perror("Latency histograms");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < threads; i++)
+    {
+      for (k = 0; k < 3; k++)
+        latency_merge(&latency[k], &args[i].latency[k]);
+      free(args[i].latency);
+    }
   }
 
+  // Reports go first, so the result line stays the last line of output.
+  print_allocator_stats();
+  print_structure_stats();
+  print_log_stats();
+  print_str_stats(str_root);
+  fprintf(stderr, "Keys: %s, %.1f nsec per key to generate (%.0f msec of each thread's time)\n",
+          key_distribution_names[key_distribution], key_nsec,
+          key_nsec * (result.counter_ins + result.counter_del + result.counter_search) / threads / 1e6);
+  if (series != NULL)
+    print_series(series, num_samples, sample_msec * 1000000ULL, bench_duration * 1000000000ULL);
+  if (latency != NULL)
+    print_latency(latency, latency_report);
+  print_hw_counters("benchmark", &counters, result.counter_ins + result.counter_del + result.counter_search);
+
+  fprintf(stderr, "0: %ld, %0.2f, %0.2f, %d, ", size, ins, del, threads);
   fprintf(stderr, " %ld, %ld, %ld,", result.counter_ins, result.counter_del, result.counter_search);
   fprintf(stderr, " %ld, %ld, %ld, %ld\n", result.counter_ins_s, result.counter_del_s, result.counter_search_s, result.timer);
 
@@ -1549,23 +7903,50 @@ int benchmark(int threads, int size, float ins, float del)
   free(inputs);
   free(ops);
   free(args);
+  free(latency);
+  free(series);
 
   return 0;
 }
 
-void initial_add(int num, int range)
+/* Pre-fills the tree with num random keys. If fill is
+ * above 0 the tree is bulk loaded with nodes filled to
+ * that percentage, using num_threads threads.
+ */
+void initial_add(int num, long range, int fill, int num_threads)
 {
-  int i = 0, j = 0;
+  int i = 0;
+  tree_key j;
+  kv_pair *pairs;
+  uint8_t key[STR_KEY_MAX + 1];
+
+  if (fill > 0)
+  {
+    pairs = malloc(num * sizeof(kv_pair));
+    if (pairs == NULL)
+    {
+      perror("Pre-fill");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < num; i++)
+      pairs[i].key = pairs[i].value = rand_range(range);
+    root = bulk_load(pairs, num, false, fill, num_threads);
+    free(pairs);
+    return;
+  }
 
   while (i < num)
   {
-    j = (rand() % range) + 1;
-    root = insert(&root, j, j);
+    j = rand_range(range);
+    if (key_type == KEY_TYPE_STRING)
+      str_insert(&str_root, key, str_key_format(j, key), j);
+    else
+      insert(&root, j, j);
     i++;
   }
 }
 
-void start_benchmark(int key_size, int updaterate, int num_thread)
+void start_benchmark(long key_size, int updaterate, int num_thread)
 {
   float update = (float)updaterate / 2;
   benchmark(num_thread, key_size, update, update);
@@ -1573,6 +7954,7 @@ void start_benchmark(int key_size, int updaterate, int num_thread)
 
 int *bulk;
 int nr;
+hw_counters *test_counters; // Of each do_test() thread, with -P.
 
 void *do_test(void *args)
 {
@@ -1590,10 +7972,14 @@ void *do_test(void *args)
 
   fprintf(stdout, "id:%d, s:%d, r:%d, e:%d\n", myid, start, range, end);
 
+  hw_counters_open(&test_counters[myid]);
   pthread_barrier_wait(&bench_barrier);
 
+  hw_counters_start(&test_counters[myid]);
   for (i = start; i < end; i++)
-    root = insert(&root, bulk[i], bulk[i]);
+    insert(&root, bulk[i], bulk[i]);
+  hw_counters_stop(&test_counters[myid]);
+  hw_counters_close(&test_counters[myid]);
 
   pthread_exit((void *)args);
 }
@@ -1603,6 +7989,7 @@ void test(int initial, int updaterate, int num_thread, bool random)
   int i;
   pthread_t pid[num_thread];
   int arg[num_thread];
+  hw_counters counters;
 
   struct timeval start, end;
   pthread_barrier_init(&bench_barrier, NULL, num_thread + 1);
@@ -1611,6 +7998,12 @@ void test(int initial, int updaterate, int num_thread, bool random)
 
   nr = num_thread;
   bulk = calloc(MAXITER, sizeof(int));
+  test_counters = calloc(num_thread, sizeof(hw_counters));
+  if (bulk == NULL || test_counters == NULL)
+  {
+    perror("Parallel test");
+    exit(EXIT_FAILURE);
+  }
 
   for (i = 0; i < allkey; i++)
   {
@@ -1637,9 +8030,15 @@ void test(int initial, int updaterate, int num_thread, bool random)
 
   printf("time : %lu usec\n", (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
 
+  memset(&counters, 0, sizeof(counters));
+  for (i = 0; i < num_thread; i++)
+    hw_counters_add(&counters, &test_counters[i]);
+  print_hw_counters("insert", &counters, allkey);
+  free(test_counters);
+
   for (i = 0; i < allkey; i++)
   {
-    if (!search(root, bulk[i]))
+    if (!search(&root, bulk[i]))
     {
       fprintf(stderr, "Error found! Exiting.\n");
       exit(EXIT_FAILURE);
@@ -1649,16 +8048,287 @@ void test(int initial, int updaterate, int num_thread, bool random)
   fprintf(stderr, "PASSED!\n");
 }
 
+/* Times every key search kernel this CPU supports on one
+ * node's worth of keys for a range of orders, and checks
+ * that they all agree. Prints nanoseconds per lookup.
+ */
+void key_search_benchmark(void)
+{
+  int orders[] = {4, 8, 16, 32, 64, 128, 256, 336, MAX_ORDER};
+  int num_orders = sizeof(orders) / sizeof(orders[0]);
+  tree_key keys[MAX_ORDER];
+  tree_key *probes;
+  int i, j, kernel, num_keys;
+  long sum, expected;
+  key_search_fn rank;
+  struct timeval start, end;
+
+  probes = malloc(KEY_SEARCH_PROBES * sizeof(tree_key));
+  if (probes == NULL)
+  {
+    perror("Key search benchmark");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("order");
+  for (kernel = KEY_SEARCH_LINEAR; kernel <= KEY_SEARCH_AVX2; kernel++)
+    printf("\t%s", key_search_names[kernel]);
+  printf("\t(nsec per lookup)\n");
+
+  for (i = 0; i < num_orders; i++)
+  {
+    num_keys = orders[i] - 1;
+    for (j = 0; j < num_keys; j++)
+      keys[j] = 2 * j + 1;
+    for (j = 0; j < KEY_SEARCH_PROBES; j++)
+      probes[j] = rand() % (2 * num_keys + 2);
+
+    printf("%d", orders[i]);
+    expected = -1;
+    for (kernel = KEY_SEARCH_LINEAR; kernel <= KEY_SEARCH_AVX2; kernel++)
+    {
+      rank = key_search_kernel(kernel);
+      if (rank == NULL)
+      {
+        printf("\t-");
+        continue;
+      }
+
+      sum = 0;
+      gettimeofday(&start, NULL);
+      for (j = 0; j < KEY_SEARCH_PROBES; j++)
+        sum += rank(keys, num_keys, probes[j]);
+      gettimeofday(&end, NULL);
+
+      if (expected != -1 && sum != expected)
+      {
+        fprintf(stderr, "Key search kernel %s disagrees at order %d!\n",
+                key_search_names[kernel], orders[i]);
+        exit(EXIT_FAILURE);
+      }
+      expected = sum;
+      printf("\t%.1f", ((end.tv_sec - start.tv_sec) * 1e6 + end.tv_usec - start.tv_usec) * 1000.0 / KEY_SEARCH_PROBES);
+    }
+    printf("\n");
+  }
+
+  free(probes);
+}
+
+/* Bulk loads MAXITER shuffled keys with nodes filled to
+ * fill percent, checks that all of them can be found, then
+ * deletes every other key and checks the rest again.
+ */
+void testbulk(int fill, int num_threads)
+{
+  int i, j, count = 0;
+  tree_key key;
+  tree_value value;
+  struct timeval start, end;
+  kv_pair *pairs, swap;
+  node *bulk_root;
+  cursor c;
+
+  pairs = malloc(MAXITER * sizeof(kv_pair));
+  if (pairs == NULL)
+  {
+    perror("Bulk load test");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < MAXITER; i++)
+    pairs[i].key = pairs[i].value = i + 1;
+  for (i = MAXITER - 1; i > 0; i--)
+  {
+    j = rand() % (i + 1);
+    swap = pairs[i];
+    pairs[i] = pairs[j];
+    pairs[j] = swap;
+  }
+
+  printf("Bulk loading %d (Shuffled) elements at %d%% fill...\n", MAXITER, fill);
+
+  gettimeofday(&start, NULL);
+  bulk_root = bulk_load(pairs, MAXITER, false, fill, num_threads);
+  gettimeofday(&end, NULL);
+  printf("bulk load time : %lu usec\n", (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < MAXITER; i++)
+    if (!search(&bulk_root, i + 1))
+      count++;
+  gettimeofday(&end, NULL);
+  printf("search time : %lu usec\n", (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
+
+  for (i = 0; i < MAXITER; i += 2)
+    if (!delete(&bulk_root, i + 1))
+      count++;
+  for (i = 0; i < MAXITER; i++)
+    if (search(&bulk_root, i + 1) != i % 2)
+      count++;
+
+  // Walk the remaining keys forwards and back with a cursor.
+  cursor_seek(&c, &bulk_root, KEY_MIN);
+  for (i = 2; cursor_next(&c, &key, &value); i += 2)
+    if (key != i || value != i)
+      count++;
+  if (i != MAXITER + 2)
+    count++;
+  for (i -= 2; cursor_prev(&c, &key, &value); i -= 2)
+    if (key != i)
+      count++;
+  if (i != 0)
+    count++;
+
+  free(pairs);
+  destroy_tree(bulk_root);
+
+  if (count)
+  {
+    fprintf(stderr, "Error in bulk loaded tree :%d!\n", count);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "PASSED!\n");
+}
+
+/* Bulk loads the even keys up to 2 * MAXITER, then looks up
+ * every key up to MAXITER in random order with one
+ * search_batch(), checking which of them it finds.
+ */
+void testbatch(int num_threads)
+{
+  int i, j, found, count = 0;
+  struct timeval start, end;
+  kv_pair *pairs;
+  tree_key *keys, swap;
+  int *results;
+  node *batch_root;
+  hw_counters counters;
+
+  pairs = malloc(MAXITER * sizeof(kv_pair));
+  keys = malloc(MAXITER * sizeof(tree_key));
+  results = malloc(MAXITER * sizeof(int));
+  if (pairs == NULL || keys == NULL || results == NULL)
+  {
+    perror("Batch search test");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < MAXITER; i++)
+  {
+    pairs[i].key = pairs[i].value = 2 * (i + 1);
+    keys[i] = i + 1;
+  }
+  for (i = MAXITER - 1; i > 0; i--)
+  {
+    j = rand() % (i + 1);
+    swap = keys[i];
+    keys[i] = keys[j];
+    keys[j] = swap;
+  }
+  batch_root = bulk_load(pairs, MAXITER, true, 100, num_threads);
+
+  printf("Searching for %d (Shuffled) keys in one batch, every other one present...\n", MAXITER);
+
+  hw_counters_open(&counters);
+  hw_counters_start(&counters);
+  gettimeofday(&start, NULL);
+  found = search_batch(&batch_root, keys, MAXITER, results);
+  gettimeofday(&end, NULL);
+  hw_counters_stop(&counters);
+  hw_counters_close(&counters);
+  printf("batch search time : %lu usec\n", (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
+  print_hw_counters("batch search", &counters, MAXITER);
+
+  if (found != MAXITER / 2)
+    count++;
+  for (i = 0; i < MAXITER; i++)
+    if (results[i] != (keys[i] % 2 == 0))
+      count++;
+
+  free(pairs);
+  free(keys);
+  free(results);
+  destroy_tree(batch_root);
+
+  if (count)
+  {
+    fprintf(stderr, "Error in batch search :%d!\n", count);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "PASSED!\n");
+}
+
+// An update_fn that adds *(int *)arg to the value.
+tree_value update_add(tree_value value, void *arg)
+{
+  return value + *(int *)arg;
+}
+
+/* Bulk loads MAXITER keys, changes the value of each in
+ * place with update() and puts it back with upsert(), then
+ * checks that insert_or_get() leaves it alone.
+ */
+void testupdate(int num_threads)
+{
+  int i, delta = 1, count = 0;
+  tree_value value;
+  struct timeval start, end;
+  kv_pair *pairs;
+  node *update_root;
+  hw_counters counters;
+
+  pairs = malloc(MAXITER * sizeof(kv_pair));
+  if (pairs == NULL)
+  {
+    perror("Update test");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < MAXITER; i++)
+    pairs[i].key = pairs[i].value = i + 1;
+  update_root = bulk_load(pairs, MAXITER, true, 100, num_threads);
+  free(pairs);
+
+  printf("Updating %d (Increasing) elements...\n", MAXITER);
+
+  hw_counters_open(&counters);
+  hw_counters_start(&counters);
+  gettimeofday(&start, NULL);
+  for (i = 1; i <= MAXITER; i++)
+  {
+    if (!update(&update_root, i, update_add, &delta) ||
+        !find(update_root, i, false, &value) || value != i + 1)
+      count++;
+    if (upsert(&update_root, i, i) ||
+        insert_or_get(&update_root, i, 0, &value) || value != i)
+      count++;
+  }
+  gettimeofday(&end, NULL);
+  hw_counters_stop(&counters);
+  hw_counters_close(&counters);
+  printf("update time : %lu usec\n", (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
+  // Per key: an update and a lookup, then an upsert and an insert_or_get().
+  print_hw_counters("update", &counters, MAXITER);
+
+  destroy_tree(update_root);
+
+  if (count)
+  {
+    fprintf(stderr, "Error updating :%d!\n", count);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "PASSED!\n");
+}
+
 void testseq(bool random)
 {
   int i, count = 0;
   struct timeval start, end;
-  int *values;
+  tree_key *values;
+  hw_counters counters;
 
   int seed_r = rand();
   srand(seed_r);
 
-  values = calloc(MAXITER, sizeof(int));
+  values = calloc(MAXITER, sizeof(tree_key));
 
   for (i = 0; i < MAXITER; i++)
   {
@@ -1670,26 +8340,37 @@ void testseq(bool random)
 
   printf("Inserting %d (%s) elements...\n", MAXITER, random ? "Random" : "Increasing");
 
+  hw_counters_open(&counters);
+  hw_counters_start(&counters);
   gettimeofday(&start, NULL);
   for (i = 0; i < MAXITER; i++)
   {
-    root = insert(&root, values[i], values[i]);
+    insert(&root, values[i], values[i]);
   }
   gettimeofday(&end, NULL);
+  hw_counters_stop(&counters);
   printf("insert time : %lu usec\n", (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
+  print_hw_counters("insert", &counters, MAXITER);
 
   srand(seed_r);
 
+  hw_counters_start(&counters);
   gettimeofday(&start, NULL);
   for (i = 0; i < MAXITER; i++)
   {
-    if (!search(root, values[i]))
+    if (!search(&root, values[i]))
     {
       count++;
     }
   }
   gettimeofday(&end, NULL);
+  hw_counters_stop(&counters);
   printf("search time : %lu usec\n", (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
+  hw_counters_close(&counters);
+  print_hw_counters("search", &counters, MAXITER);
+
+  print_allocator_stats();
+  print_structure_stats();
 
   free(values);
 
@@ -1703,6 +8384,174 @@ void testseq(bool random)
     fprintf(stderr, "PASSED!\n");
   }
 }
+
+/* Writes the key of string test entry i to key and returns
+ * its length: the benchmark's key for i, padded for one in
+ * sixteen with up to STR_KEY_MAX bytes of letters.
+ */
+int str_test_key(int i, uint8_t *key)
+{
+  int length = str_key_format(i, key);
+
+  if (i % 16 == 0)
+    while (length < 16 + i % (STR_KEY_MAX - 15))
+      key[length++] = 'a' + i % 26;
+  return length;
+}
+
+/* Checks that the keys under a string node are sorted, lie
+ * between its fences and share its prefix, and that each
+ * child's fences are the keys around it in its parent.
+ * previous holds the last key checked, or has a length of
+ * -1. Returns the number of faults found.
+ */
+int str_check(str_node *n, uint8_t *previous, int *previous_length)
+{
+  uint8_t key[STR_KEY_MAX], low[STR_KEY_MAX];
+  int i, length, low_length, errors = 0;
+  str_node *child;
+  bool found;
+
+  for (i = 0; i < n->num_keys; i++)
+  {
+    length = str_key(n, i, key);
+    if ((n->low_length >= 0 && str_compare(key, length, str_bytes(n, n->low_offset), n->low_length) < 0) ||
+        (n->high_length >= 0 && str_compare(key, length, str_bytes(n, n->high_offset), n->high_length) >= 0) ||
+        str_rank(n, key, length, &found) != i || !found)
+      errors++;
+    if (n->level == 0)
+    {
+      if (*previous_length >= 0 && str_compare(previous, *previous_length, key, length) >= 0)
+        errors++;
+      memcpy(previous, key, length);
+      *previous_length = length;
+      continue;
+    }
+
+    // The child's low fence is this key, and the previous child's high fence too.
+    child = n->slots[i].child;
+    if (child->low_length != length || memcmp(str_bytes(child, child->low_offset), key, length) != 0 ||
+        child->level != n->level - 1)
+      errors++;
+    low_length = i == 0 ? n->low_length : str_key(n, i - 1, low);
+    if (low_length >= 0 && i == 0)
+      memcpy(low, str_bytes(n, n->low_offset), low_length);
+    child = i == 0 ? n->first : n->slots[i - 1].child;
+    if (child->high_length != length || memcmp(str_bytes(child, child->high_offset), key, length) != 0 ||
+        child->low_length != low_length || (low_length >= 0 && memcmp(str_bytes(child, child->low_offset), low, low_length) != 0))
+      errors++;
+  }
+
+  if (n->level > 0)
+  {
+    errors += str_check(n->first, previous, previous_length);
+    for (i = 0; i < n->num_keys; i++)
+      errors += str_check(n->slots[i].child, previous, previous_length);
+  }
+  return errors;
+}
+
+void *do_teststr(void *args)
+{
+  int myid = *((int *)args);
+  int i;
+  int start = (MAXITER / nr) * myid;
+  int end = myid == nr - 1 ? MAXITER : start + MAXITER / nr;
+  uint8_t key[STR_KEY_MAX + 1];
+
+  pthread_barrier_wait(&bench_barrier);
+  for (i = MAXITER + 1 + start; i <= MAXITER + end; i++)
+    str_insert(&str_root, key, str_test_key(i, key), i);
+
+  pthread_exit(args);
+}
+
+/* Inserts MAXITER string keys in random order, searches for
+ * them and deletes every other one, then inserts as many
+ * again from num_threads threads, checking the tree and the
+ * keys in it after each step.
+ */
+void teststr(int num_threads)
+{
+  int i, j, swap, count = 0, previous_length = -1;
+  int *order;
+  uint8_t key[STR_KEY_MAX + 1], previous[STR_KEY_MAX];
+  tree_value value;
+  struct timeval start, end;
+  pthread_t pid[num_threads];
+  int arg[num_threads];
+
+  order = malloc(MAXITER * sizeof(int));
+  if (order == NULL)
+  {
+    perror("String key test");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < MAXITER; i++)
+    order[i] = i + 1;
+  for (i = MAXITER - 1; i > 0; i--)
+  {
+    j = rand() % (i + 1);
+    swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+
+  printf("Inserting %d (Shuffled) string keys...\n", MAXITER);
+  gettimeofday(&start, NULL);
+  for (i = 0; i < MAXITER; i++)
+    if (!str_insert(&str_root, key, str_test_key(order[i], key), order[i]))
+      count++;
+  gettimeofday(&end, NULL);
+  printf("insert time : %lu usec\n", (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
+
+  gettimeofday(&start, NULL);
+  for (i = 0; i < MAXITER; i++)
+    if (!str_find(&str_root, key, str_test_key(order[i], key), &value) || value != order[i])
+      count++;
+  gettimeofday(&end, NULL);
+  printf("search time : %lu usec\n", (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
+  count += str_check(str_root, previous, &previous_length);
+
+  for (i = 1; i <= MAXITER; i += 2)
+    if (!str_delete(&str_root, key, str_test_key(i, key)) || str_delete(&str_root, key, str_test_key(i, key)))
+      count++;
+  for (i = 1; i <= MAXITER; i++)
+    if (str_find(&str_root, key, str_test_key(i, key), NULL) != (i % 2 == 0))
+      count++;
+  print_str_stats(str_root);
+
+  nr = num_threads;
+  pthread_barrier_init(&bench_barrier, NULL, num_threads + 1);
+  for (i = 0; i < num_threads; i++)
+  {
+    arg[i] = i;
+    pthread_create(&pid[i], NULL, &do_teststr, &arg[i]);
+  }
+  pthread_barrier_wait(&bench_barrier);
+  gettimeofday(&start, NULL);
+  for (i = 0; i < num_threads; i++)
+    pthread_join(pid[i], NULL);
+  gettimeofday(&end, NULL);
+  printf("parallel insert time : %lu usec\n", (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
+
+  for (i = MAXITER + 1; i <= 2 * MAXITER; i++)
+    if (!str_find(&str_root, key, str_test_key(i, key), &value) || value != i)
+      count++;
+  previous_length = -1;
+  count += str_check(str_root, previous, &previous_length);
+
+  print_structure_stats();
+  print_str_stats(str_root);
+  free(order);
+
+  if (count)
+  {
+    fprintf(stderr, "Error in string key tree :%d!\n", count);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "PASSED!\n");
+}
 /*------------------- END BENCHMARK ---------------------*/
 
 int main(int argc, char **argv)
@@ -1713,7 +8562,8 @@ int main(int argc, char **argv)
   fprintf(stderr, "Use -h switch for help.\n\n");
 
   // Init lock
-  if (pthread_rwlock_init(&rwlock, NULL) != 0)
+  if (pthread_rwlock_init(&rwlock, NULL) != 0 ||
+      pthread_rwlock_init(&root_latch, NULL) != 0)
   {
     // init failed
     return -1;
@@ -1721,20 +8571,32 @@ int main(int argc, char **argv)
 
   // Default values
   int initial_count = 1023;
-  int range = 5000000;
+  long range = 5000000;
   int update_rate = 10;
   int seed = 0;
   int num_threads = 1;
   int test_mode = false;
+  bool kernel_benchmark = false;
+  int bulk_fill = 0;
+  int affinity_policy = AFFINITY_NONE;
+  const char *affinity_list = NULL;
+  const char *tree_file = NULL;
+  const char *log_file = NULL;
+  bool reopened = false;
+  bool recovered = false;
+  uint64_t open_start;
+  int i;
 
   int myopt = 0;
   while (EOF != myopt)
   {
-    myopt = getopt(argc, argv, "r:t:n:i:u:s:hb:");
+    myopt = getopt(argc, argv, "r:t:n:i:u:s:c:q:l:m:fL:H:a:N:d:z:D:R:I:PF:W:y:G:C:kK:hb:");
     switch (myopt)
     {
     case 'r':
-      range = atoi(optarg);
+      range = atol(optarg);
+      if (range < 1 || range > KEY_MAX)
+        usage();
       break;
     case 'n':
       num_threads = atoi(optarg);
@@ -1751,49 +8613,275 @@ int main(int argc, char **argv)
     case 's':
       seed = atoi(optarg);
       break;
+    case 'c':
+      concurrency = atoi(optarg);
+      if (concurrency < CC_GLOBAL || concurrency > CC_OLC)
+        usage();
+      break;
+    case 'q':
+      batch_size = atoi(optarg);
+      if (batch_size < 0)
+        usage();
+      break;
+    case 'l':
+      scan_length = atoi(optarg);
+      if (scan_length < 0)
+        usage();
+      break;
+    case 'm':
+      merge_percent = atoi(optarg);
+      if (merge_percent < 1 || merge_percent > 50)
+        usage();
+      break;
+    case 'f':
+      finger_cache = true;
+      break;
+    case 'P':
+      hw_counting = true;
+      break;
+    case 'F':
+      tree_file = optarg;
+      break;
+    case 'W':
+      log_file = optarg;
+      break;
+    case 'y':
+      for (durability = DURABILITY_LAZY; durability <= DURABILITY_SYNC; durability++)
+        if (strcmp(optarg, durability_names[durability]) == 0)
+          break;
+      if (durability > DURABILITY_SYNC)
+        usage();
+      break;
+    case 'G':
+      commit_usec = atol(optarg);
+      if (commit_usec < 0)
+        usage();
+      break;
+    case 'C':
+      checkpoint_sec = atoi(optarg);
+      if (checkpoint_sec < 0)
+        usage();
+      break;
+    case 'L':
+      locality = atoi(optarg);
+      if (locality < 0 || locality > 100)
+        usage();
+      break;
+    case 'H':
+      latency_report = atoi(optarg);
+      if (latency_report < LATENCY_OFF || latency_report > LATENCY_JSON)
+        usage();
+      break;
+    case 'a':
+      for (affinity_policy = AFFINITY_NONE; affinity_policy < AFFINITY_LIST; affinity_policy++)
+        if (strcmp(optarg, affinity_names[affinity_policy]) == 0)
+          break;
+      affinity_list = optarg;
+      break;
+    case 'd':
+      for (key_distribution = KEY_UNIFORM; key_distribution <= KEY_SHUFFLED; key_distribution++)
+        if (strcmp(optarg, key_distribution_names[key_distribution]) == 0)
+          break;
+      if (key_distribution > KEY_SHUFFLED)
+        usage();
+      break;
+    case 'z':
+      zipf_theta = atof(optarg);
+      if (zipf_theta <= 0 || zipf_theta >= 1)
+        usage();
+      break;
+    case 'D':
+      bench_duration = atoi(optarg);
+      if (bench_duration < 0)
+        usage();
+      break;
+    case 'R':
+      bench_rate = atol(optarg);
+      if (bench_rate < 0)
+        usage();
+      break;
+    case 'I':
+      sample_msec = atoi(optarg);
+      if (sample_msec < 1)
+        usage();
+      break;
+    case 'N':
+      node_placement = atoi(optarg);
+      if (node_placement < PLACE_FIRST_TOUCH || node_placement > PLACE_INTERLEAVE)
+        usage();
+      break;
+    case 'k':
+      kernel_benchmark = true;
+      break;
+    case 'K':
+      for (key_type = KEY_TYPE_INT; key_type <= KEY_TYPE_STRING; key_type++)
+        if (strcmp(optarg, key_type_names[key_type]) == 0)
+          break;
+      if (key_type > KEY_TYPE_STRING)
+        usage();
+      break;
+    case 'b':
+      bulk_fill = atoi(optarg);
+      if (bulk_fill < 0 || bulk_fill > 100)
+        usage();
+      break;
     case 'h':
       usage();
     }
   }
   fprintf(stderr, "Parameters:\n");
-  fprintf(stderr, "- Range size:\t\t %d\n", range);
+  fprintf(stderr, "- Range size:\t\t %ld\n", range);
   fprintf(stderr, "- Update rate:\t\t %d%% \n", update_rate);
   fprintf(stderr, "- Number of threads:\t %d\n", num_threads);
   fprintf(stderr, "- Initial tree size:\t %d\n", initial_count);
+  if (bulk_fill > 0)
+    fprintf(stderr, "- Bulk load fill:\t %d%%\n", bulk_fill);
   fprintf(stderr, "- Random seed:\t\t %d\n", seed);
   fprintf(stderr, "- Test mode:\t\t %s\n", test_mode ? "true" : "false");
-
-  fprintf(stderr, "Node size: %lu bytes\n", sizeof(node) + ((order - 1) * sizeof(int)) + (order * sizeof(void *)));
+  fprintf(stderr, "- Concurrency:\t\t %s\n", cc_mode_names[concurrency]);
+  fprintf(stderr, "- Order:\t\t %d\n", order);
+  fprintf(stderr, "- Key bits:\t\t %d\n", KEY_BITS);
+  if (key_type == KEY_TYPE_STRING)
+    fprintf(stderr, "- Key type:\t\t string, nodes of %d bytes\n", STR_NODE_BYTES);
+  if (key_type == KEY_TYPE_STRING &&
+      (concurrency > CC_COUPLING || batch_size > 0 || scan_length > 0 || finger_cache || bulk_fill > 0 ||
+       tree_file != NULL || log_file != NULL))
+    usage();
+  if (batch_size > 0)
+    fprintf(stderr, "- Search batch size:\t %d\n", batch_size);
+  if (scan_length > 0)
+    fprintf(stderr, "- Scan length:\t\t %d\n", scan_length);
+  fprintf(stderr, "- Merge threshold:\t %d%%\n", merge_percent);
+  if (finger_cache)
+    fprintf(stderr, "- Finger cache:\t\t on\n");
+  if (locality > 0)
+    fprintf(stderr, "- Key locality:\t\t %d%%\n", locality);
+  if (latency_report != LATENCY_OFF)
+    fprintf(stderr, "- Latency report:\t %s\n", latency_format_names[latency_report]);
+  if (hw_counting)
+    fprintf(stderr, "- Hardware counters:\t on\n");
+  if (tree_file != NULL && test_mode)
+    usage();
+  if (tree_file != NULL)
+    fprintf(stderr, "- Tree file:\t\t %s\n", tree_file);
+  if ((log_file != NULL && (test_mode || tree_file != NULL)) || (log_file == NULL && durability != DURABILITY_NONE))
+    usage();
+  if (log_file != NULL)
+  {
+    if (durability == DURABILITY_NONE)
+      durability = DURABILITY_SYNC;
+    fprintf(stderr, "- Log:\t\t\t %s, %s, commit interval %ld usec\n", log_file, durability_names[durability], commit_usec);
+    if (checkpoint_sec > 0)
+      fprintf(stderr, "- Checkpoints:\t\t every %d s\n", checkpoint_sec);
+  }
+  key_search_init();
+  fprintf(stderr, "- Key search:\t\t %s\n", key_search_names[key_search]);
+  if (LEAF_FINGERPRINTS)
+    fprintf(stderr, "- Leaf fingerprints:\t on\n");
+  affinity_init(affinity_policy, affinity_list);
+  if (affinity != AFFINITY_NONE)
+  {
+    fprintf(stderr, "- Affinity:\t\t %s (CPUs", affinity_names[affinity]);
+    for (i = 0; i < num_threads; i++)
+      fprintf(stderr, "%c%d", i ? ',' : ' ', affinity_cpus[i % num_affinity_cpus]);
+    fprintf(stderr, ")\n");
+  }
+  if (node_placement != PLACE_FIRST_TOUCH)
+    fprintf(stderr, "- Node memory:\t\t %s\n", placement_names[node_placement]);
+  if (bench_rate > 0 && bench_duration == 0)
+    usage();
+  if (bench_duration > 0)
+    fprintf(stderr, "- Duration:\t\t %d s, in intervals of %d msec\n", bench_duration, sample_msec);
+  if (bench_rate > 0)
+    fprintf(stderr, "- Target rate:\t\t %ld ops/s\n", bench_rate);
+  if (key_distribution == KEY_ZIPF || key_distribution == KEY_LATEST)
+    fprintf(stderr, "- Key distribution:\t %s (theta %.2f)\n", key_distribution_names[key_distribution], zipf_theta);
+  else if (key_distribution != KEY_UNIFORM)
+    fprintf(stderr, "- Key distribution:\t %s\n", key_distribution_names[key_distribution]);
+
+  fprintf(stderr, "Node size: %lu bytes\n", (unsigned long)node_size());
 
   if (seed == 0)
     srand((int)time(0));
   else
     srand(seed);
 
+  if (kernel_benchmark)
+  {
+    key_search_benchmark();
+    return 0;
+  }
+
+  memory_init();
+
   root = NULL;
-  if (test_mode == true)
+  if (test_mode == true && key_type == KEY_TYPE_STRING)
+  {
+    fprintf(stderr, "Now doing correctness test\n");
+    fprintf(stderr, "String key test\n");
+    teststr(num_threads);
+    fprintf(stderr, "\n\n");
+  }
+  else if (test_mode == true)
   {
     fprintf(stderr, "Now doing correctness test\n");
     fprintf(stderr, "Sequential test\n");
     testseq(false);
     fprintf(stderr, "\n\n");
 
+    fprintf(stderr, "Bulk load test\n");
+    testbulk(bulk_fill > 0 ? bulk_fill : 100, num_threads);
+    fprintf(stderr, "\n\n");
+
+    fprintf(stderr, "Batch search test\n");
+    testbatch(num_threads);
+    fprintf(stderr, "\n\n");
+
+    fprintf(stderr, "Update test\n");
+    testupdate(num_threads);
+    fprintf(stderr, "\n\n");
+
     fprintf(stderr, "Parallel test\n");
     test(range, update_rate, num_threads, false);
     fprintf(stderr, "\n\n");
   }
   else
   {
-    if (initial_count > 0)
+    if (tree_file != NULL)
+    {
+      open_start = clock_nsec();
+      reopened = tree_file_open(tree_file, &root);
+      if (reopened)
+        fprintf(stderr, "Reopened the tree in %s, %lu MiB, in %.2f msec\n", tree_file,
+                (unsigned long)(tree_header->slabs * SLAB_BYTES >> 20), (clock_nsec() - open_start) / 1e6);
+    }
+    if (log_file != NULL)
+      recovered = log_recover(log_file, &root, bulk_fill > 0 ? bulk_fill : 100, num_threads);
+    if (initial_count > 0 && !reopened && !recovered)
     {
-      fprintf(stderr, "Now pre-filling %d random elements...\n", initial_count);
-      initial_add(initial_count, range);
+      fprintf(stderr, "Now %s %d random elements...\n",
+              bulk_fill > 0 ? "bulk loading" : "pre-filling", initial_count);
+      initial_add(initial_count, range, bulk_fill, num_threads);
       fprintf(stderr, "...Done!\n\n");
     }
+    if (log_file != NULL)
+      log_start(&root);
 
     start_benchmark(range, update_rate, num_threads);
   }
 
+  if (log_active)
+    log_close(&root);
+  if (tree_header != NULL)
+    tree_file_close(root);
+  else
+  {
+    destroy_tree(root);
+    memory_release();
+  }
+  str_destroy(str_root);
+
+  pthread_rwlock_destroy(&root_latch);
   pthread_rwlock_destroy(&rwlock);
 
   return 0;